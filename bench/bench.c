@@ -0,0 +1,612 @@
+/**
+ * This file is part of DBrew, the dynamic binary rewriting library.
+ *
+ * (c) 2015-2016, Josef Weidendorfer <josef.weidendorfer@gmx.de>
+ *
+ * DBrew is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * DBrew is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with DBrew.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark harness for DBrew
+ *
+ * Measures rewrite latency (per phase, see DBrewStats), throughput of
+ * native vs. rewritten kernels (stencil variants from examples/stencil.c,
+ * matrix kernel from examples/matrix.c, string compare against a known
+ * string), rewrites per second for small functions, decode/capture
+ * throughput in instructions per second, and rewrite latency depending
+ * on the number of parallel capture workers.
+ *
+ * Results are written as CSV (default) or JSON lines to stdout, one
+ * measurement per line: benchmark, variant, metric, value, unit. Any
+ * other output to stdout (e.g. from the rewriter) is discarded.
+ * Each benchmark runs in its own process: if rewriting fails, only this
+ * benchmark is reported as failed.
+ *
+ * Usage: bench [-j] [-s <scale>] [<benchmark> ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "dbrew.h"
+
+static int jsonOutput = 0;
+static int scale = 1;
+// results; stdout gets debug output of the rewriter
+static FILE* out;
+
+static
+uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+static
+void result(const char* bench, const char* variant,
+            const char* metric, double value, const char* unit)
+{
+    if (jsonOutput)
+        fprintf(out, "{\"benchmark\":\"%s\",\"variant\":\"%s\","
+                "\"metric\":\"%s\",\"value\":%.3f,\"unit\":\"%s\"}\n",
+                bench, variant, metric, value, unit);
+    else
+        fprintf(out, "%s,%s,%s,%.3f,%s\n", bench, variant, metric, value, unit);
+    fflush(out);
+}
+
+// rewrite latency per phase, from statistics of the last rewrite with <r>
+static
+void resultRewrite(const char* bench, const char* variant,
+                   Rewriter* r, uint64_t wallTime)
+{
+    DBrewStats s;
+
+    dbrew_get_stats(r, &s);
+    result(bench, variant, "rewrite", wallTime, "ns");
+    result(bench, variant, "decode", s.decodeTime, "ns");
+    result(bench, variant, "capture", s.captureTime, "ns");
+    result(bench, variant, "opt", s.optTime, "ns");
+    result(bench, variant, "generate", s.generateTime, "ns");
+    result(bench, variant, "code", dbrew_generated_size(r), "bytes");
+}
+
+// minimum time of <reps> runs of <f>
+#define BEST_OF(reps, t, f)                         \
+    do {                                            \
+        t = ~0ul;                                   \
+        for(int _rep = 0; _rep < (reps); _rep++) {  \
+            uint64_t _t = now();                    \
+            f;                                      \
+            _t = now() - _t;                        \
+            if (_t < t) t = _t;                     \
+        }                                           \
+    } while(0)
+
+
+//----------------------------------------------------------
+// 2d stencil (see examples/stencil.c)
+
+typedef struct {
+    int xdiff, ydiff;
+    double factor;
+} StencilPoint;
+
+typedef struct {
+    int points;
+    StencilPoint p[];
+} Stencil;
+
+typedef struct {
+    double factor;
+    int points;
+    StencilPoint* p;
+} StencilFactor;
+
+typedef struct {
+    int factors;
+    StencilFactor f[];
+} SortedStencil;
+
+static Stencil s5 = {5, {{0,0,-.2}, {-1,0,.3},{1,0,.3},{0,-1,.3},{0,1,.3}}};
+static SortedStencil s5s = {2, {{-.2,1,&(s5.p[0])},{.3,4,&(s5.p[1])}}};
+
+typedef double (*apply_func)(double*, int, void*);
+
+__attribute__((noinline))
+static
+double apply(double* m, int xsize, Stencil* s)
+{
+    double res = 0;
+
+    for(int i = 0; i < s->points; i++) {
+        StencilPoint* p = s->p + i;
+        res += p->factor * m[p->xdiff + p->ydiff * xsize];
+    }
+    return res;
+}
+
+__attribute__((noinline))
+static
+double applyS(double* m, int xsize, SortedStencil* s)
+{
+    double sum, res = 0;
+
+    for(int f = 0; f < s->factors; f++) {
+        StencilFactor* sf = s->f + f;
+        StencilPoint* p = sf->p;
+        sum = m[p->xdiff + p->ydiff * xsize];
+        for(int i = 1; i < sf->points; i++) {
+            p = sf->p + i;
+            sum += m[p->xdiff + p->ydiff * xsize];
+        }
+        res += sf->factor * sum;
+    }
+    return res;
+}
+
+__attribute__((noinline))
+static
+double apply2(double* m, int xsize, void* s)
+{
+    (void) s;
+    return -.2 * m[0] + .3 * (m[-1] + m[1] + m[-xsize] + m[xsize]);
+}
+
+__attribute__((noinline))
+static
+void applyLoop(int size, double* src, double* dst, apply_func af, void* s)
+{
+    for(int y = 1; y < size - 1; y++)
+        for(int x = 1; x < size - 1; x++)
+            dst[x + y * size] = af(&(src[x + y * size]), size, s);
+}
+
+static
+void benchStencil(const char* variant, apply_func af, void* s)
+{
+    const int size = 202, iter = 20 * scale;
+    double* m1 = (double*) malloc(sizeof(double) * size * size);
+    double* m2 = (double*) malloc(sizeof(double) * size * size);
+    double points = (double) (size - 2) * (size - 2) * iter;
+    uint64_t start, tNative, tRewritten;
+    apply_func raf;
+    Rewriter* r;
+
+    for(int i = 0; i < size * size; i++)
+        m1[i] = m2[i] = (i % 7);
+
+    r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) af);
+    dbrew_config_staticpar(r, 1); // size is constant
+    dbrew_config_staticpar(r, 2); // stencil is constant
+    dbrew_config_staticmem(r, (uint64_t) &s5, sizeof(s5) + 5 * sizeof(StencilPoint));
+    dbrew_config_staticmem(r, (uint64_t) &s5s, sizeof(s5s) + 2 * sizeof(StencilFactor));
+    dbrew_config_returnfp(r);
+    start = now();
+    raf = (apply_func) dbrew_rewrite(r, m1 + size + 1, size, s);
+    resultRewrite("stencil", variant, r, now() - start);
+
+    if (raf(m1 + size + 1, size, s) != af(m1 + size + 1, size, s)) {
+        fprintf(stderr, "stencil %s: rewritten result differs\n", variant);
+        exit(1);
+    }
+
+    BEST_OF(3, tNative,
+            for(int i = 0; i < iter; i++) applyLoop(size, m1, m2, af, s));
+    BEST_OF(3, tRewritten,
+            for(int i = 0; i < iter; i++) applyLoop(size, m1, m2, raf, s));
+    result("stencil", variant, "native", tNative / points, "ns/point");
+    result("stencil", variant, "rewritten", tRewritten / points, "ns/point");
+    result("stencil", variant, "speedup", (double) tNative / tRewritten, "x");
+
+    dbrew_free(r);
+    free(m1);
+    free(m2);
+}
+
+static
+void benchStencilGeneric(void)
+{
+    benchStencil("generic", (apply_func) apply, &s5);
+}
+
+static
+void benchStencilGrouped(void)
+{
+    benchStencil("grouped", (apply_func) applyS, &s5s);
+}
+
+static
+void benchStencilManual(void)
+{
+    benchStencil("manual", apply2, 0);
+}
+
+
+//----------------------------------------------------------
+// matrix multiplication kernel (see examples/matrix.c)
+
+typedef void (*mm_t)(int s, double* a, double* b, double* c,
+                     int i, int j, int k);
+
+__attribute__((noinline))
+static
+void mm_kernel(int s, double* a, double* b, double* c, int i, int j, int k)
+{
+    a[i * s + k] += b[i * s + j] * c[j * s + k];
+}
+
+static
+void mm(mm_t f, int s, double* a, double* b, double* c)
+{
+    for(int i = 0; i < s; i++)
+        for(int j = 0; j < s; j++)
+            for(int k = 0; k < s; k++)
+                f(s, a, b, c, i, j, k);
+}
+
+static
+void benchMatrix(void)
+{
+    const int s = 64, iter = 4 * scale;
+    double* a = (double*) calloc(s * s, sizeof(double));
+    double* b = (double*) malloc(s * s * sizeof(double));
+    double* c = (double*) malloc(s * s * sizeof(double));
+    double calls = (double) s * s * s * iter;
+    uint64_t start, tNative, tRewritten;
+    Rewriter* r;
+    mm_t mmf;
+
+    for(int i = 0; i < s * s; i++) {
+        b[i] = 2.0;
+        c[i] = 3.0;
+    }
+
+    r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) mm_kernel);
+    dbrew_config_staticpar(r, 0); // size is constant
+    start = now();
+    mmf = (mm_t) dbrew_rewrite(r, s, a, b, c, 0, 0, 0);
+    resultRewrite("matrix", "kernel", r, now() - start);
+
+    BEST_OF(3, tNative,
+            for(int i = 0; i < iter; i++) mm(mm_kernel, s, a, b, c));
+    BEST_OF(3, tRewritten,
+            for(int i = 0; i < iter; i++) mm(mmf, s, a, b, c));
+    result("matrix", "kernel", "native", tNative / calls, "ns/call");
+    result("matrix", "kernel", "rewritten", tRewritten / calls, "ns/call");
+    result("matrix", "kernel", "speedup", (double) tNative / tRewritten, "x");
+
+    dbrew_free(r);
+    free(a);
+    free(b);
+    free(c);
+}
+
+
+//----------------------------------------------------------
+// string compare against a known string (see examples/strcmp.c).
+// The C library strcmp uses vector instructions, and the emulator does
+// not support 8-bit loads with extension: use a loop over 32-bit chars
+
+typedef int (*cmp_t)(const int*, const int*);
+
+__attribute__((noinline))
+static
+int wideStrcmp(const int* a, const int* b)
+{
+    // end of b checked first: static with known b
+    while(*b && (*a == *b)) {
+        a++;
+        b++;
+    }
+    return *a - *b;
+}
+
+#define MAXWORDLEN 8
+
+static
+void toWide(int* dst, const char* src)
+{
+    int i = 0;
+
+    for(; src[i] && (i < MAXWORDLEN - 1); i++)
+        dst[i] = src[i];
+    dst[i] = 0;
+}
+
+static
+void benchStrcmp(void)
+{
+    static const char* words[] = {
+        "Hello", "Help", "World", "Hello!", "H", "", "Hallo", "Hell"
+    };
+    enum { nwords = sizeof(words) / sizeof(words[0]) };
+    static int wwords[nwords][MAXWORDLEN], hello[MAXWORDLEN];
+    const int iter = 1000000 * scale;
+    uint64_t start, tNative, tRewritten;
+    volatile int sum = 0;
+    Rewriter* r;
+    cmp_t cmpf;
+
+    for(int w = 0; w < nwords; w++)
+        toWide(wwords[w], words[w]);
+    toWide(hello, "Hello");
+
+    r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) wideStrcmp);
+    dbrew_config_staticpar(r, 1); // compare against known string
+    dbrew_config_staticmem(r, (uint64_t) hello, sizeof(hello));
+    start = now();
+    cmpf = (cmp_t) dbrew_rewrite(r, wwords[0], hello);
+    resultRewrite("strcmp", "hello", r, now() - start);
+
+    for(int w = 0; w < nwords; w++) {
+        if (cmpf(wwords[w], hello) != wideStrcmp(wwords[w], hello)) {
+            fprintf(stderr, "strcmp: rewritten result differs\n");
+            exit(1);
+        }
+    }
+
+    BEST_OF(3, tNative,
+            for(int i = 0; i < iter; i++)
+                sum += wideStrcmp(wwords[i % nwords], hello));
+    BEST_OF(3, tRewritten,
+            for(int i = 0; i < iter; i++)
+                sum += cmpf(wwords[i % nwords], hello));
+    result("strcmp", "hello", "native", (double) tNative / iter, "ns/call");
+    result("strcmp", "hello", "rewritten", (double) tRewritten / iter, "ns/call");
+    result("strcmp", "hello", "speedup", (double) tNative / tRewritten, "x");
+
+    dbrew_free(r);
+}
+
+
+//----------------------------------------------------------
+// rewrites per second of small functions, reusing one rewriter
+
+__attribute__((noinline))
+static
+long small(long a, long b)
+{
+    return (a + b) * (a - b) + 3 * a;
+}
+
+static
+void benchRewriteRate(const char* variant, uint64_t f, int staticPar)
+{
+    const int count = 2000 * scale;
+    uint64_t start, t;
+    Rewriter* r = dbrew_new();
+
+    dbrew_set_function(r, f);
+    if (staticPar >= 0)
+        dbrew_config_staticpar(r, staticPar);
+    // first rewrite includes decoding and allocation
+    dbrew_rewrite(r, 6, 2, 0, 0, 0, 0);
+
+    start = now();
+    for(int i = 0; i < count; i++)
+        dbrew_rewrite(r, 6, 2, 0, 0, 0, 0);
+    t = now() - start;
+    dbrew_free(r);
+
+    result("rewrite-rate", variant, "rate", count * 1e9 / t,
+           "rewrites/s");
+}
+
+static
+void benchRewriteSmall(void)
+{
+    benchRewriteRate("small", (uint64_t) small, -1);
+    benchRewriteRate("small-static", (uint64_t) small, 1);
+    benchRewriteRate("mm-kernel", (uint64_t) mm_kernel, 0);
+}
+
+
+//----------------------------------------------------------
+// decode and capture throughput, in instructions per second
+
+static
+void benchDecodeCapture(void)
+{
+    static uint64_t funcs[] = {
+        (uint64_t) apply, (uint64_t) applyS, (uint64_t) applyLoop,
+        (uint64_t) mm_kernel, (uint64_t) wideStrcmp, (uint64_t) small
+    };
+    const int batches = 200 * scale;
+    uint64_t instrs = 0, decodeTime = 0, captureTime = 0;
+    double* m = (double*) calloc(202 * 3, sizeof(double));
+    DBrewStats s;
+    Rewriter* r;
+
+    // decoding: new rewriter per batch, as decoded BBs are cached
+    for(int b = 0; b < batches; b++) {
+        r = dbrew_new();
+        for(unsigned f = 0; f < sizeof(funcs) / sizeof(funcs[0]); f++)
+            dbrew_decode(r, funcs[f]);
+        dbrew_get_stats(r, &s);
+        instrs += s.instrDecoded;
+        decodeTime += s.decodeTime;
+        dbrew_free(r);
+    }
+    result("decode-capture", "decode", "rate", instrs * 1e9 / decodeTime,
+           "instrs/s");
+
+    // capturing: unrolled generic stencil, decoded BBs are reused
+    r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) apply);
+    dbrew_config_staticpar(r, 1);
+    dbrew_config_staticpar(r, 2);
+    dbrew_config_staticmem(r, (uint64_t) &s5,
+                           sizeof(s5) + 5 * sizeof(StencilPoint));
+    dbrew_config_returnfp(r);
+    dbrew_rewrite(r, m + 203, 202, &s5);
+    dbrew_reset_stats(r);
+    for(int b = 0; b < batches; b++)
+        dbrew_rewrite(r, m + 203, 202, &s5);
+    dbrew_get_stats(r, &s);
+    instrs = s.instrCaptured;
+    captureTime = s.captureTime;
+    dbrew_free(r);
+    result("decode-capture", "capture", "rate", instrs * 1e9 / captureTime,
+           "instrs/s");
+    free(m);
+}
+
+
+//----------------------------------------------------------
+// rewrite latency with parallel capture workers, for a function with a
+// static loop count and a branch on a dynamic value per iteration
+
+__attribute__((noinline))
+static
+long branchy(long n, long x)
+{
+    long sum = x;
+
+    for(long i = 0; i < n; i++) {
+        if (x > i)
+            sum += 3 * i;
+        else
+            sum -= i;
+    }
+    return sum;
+}
+
+typedef long (*branchy_t)(long, long);
+
+static
+void benchParallelCapture(void)
+{
+    static const int workers[] = { 0, 1, 2, 4, 8 };
+    const int iter = 5 * scale;
+    const long n = 60;
+    uint64_t start, t;
+    char variant[20];
+    branchy_t f;
+    Rewriter* r;
+
+    for(unsigned w = 0; w < sizeof(workers) / sizeof(workers[0]); w++) {
+        r = dbrew_new();
+        dbrew_set_capture_capacity(r, 200000, 20000, 2000000);
+        dbrew_set_function(r, (uint64_t) branchy);
+        dbrew_config_staticpar(r, 0);
+        dbrew_config_parallel(r, workers[w]);
+        f = (branchy_t) dbrew_rewrite(r, n, 0);
+        if (f(n, n / 2) != branchy(n, n / 2)) {
+            fprintf(stderr, "parallel-capture: rewritten result differs\n");
+            exit(1);
+        }
+
+        BEST_OF(iter, t, dbrew_rewrite(r, n, 0));
+        sprintf(variant, "workers-%d", workers[w]);
+        dbrew_reset_stats(r);
+        start = now();
+        dbrew_rewrite(r, n, 0);
+        resultRewrite("parallel-capture", variant, r, now() - start);
+        result("parallel-capture", variant, "best", t, "ns");
+        dbrew_free(r);
+    }
+}
+
+
+//----------------------------------------------------------
+
+typedef struct {
+    const char* name;
+    void (*run)(void);
+} Benchmark;
+
+static Benchmark benchmarks[] = {
+    { "stencil-generic", benchStencilGeneric },
+    { "stencil-grouped", benchStencilGrouped },
+    { "stencil-manual",  benchStencilManual },
+    { "matrix",          benchMatrix },
+    { "strcmp",          benchStrcmp },
+    { "rewrite-rate",    benchRewriteSmall },
+    { "decode-capture",  benchDecodeCapture },
+    { "parallel-capture", benchParallelCapture },
+    { 0, 0 }
+};
+
+// run benchmark in child process, report failure
+static
+int runBenchmark(Benchmark* b)
+{
+    int status;
+    pid_t pid;
+
+    fflush(out);
+    pid = fork();
+    if (pid == 0) {
+        b->run();
+        exit(0);
+    }
+    if ((pid < 0) || (waitpid(pid, &status, 0) < 0) ||
+        !WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+        result(b->name, "-", "failed", 1, "-");
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    int arg = 1, failed = 0, selected = 0;
+
+    while((arg < argc) && (argv[arg][0] == '-')) {
+        if (strcmp(argv[arg], "-j") == 0)
+            jsonOutput = 1;
+        else if ((strcmp(argv[arg], "-s") == 0) && (arg + 1 < argc))
+            scale = atoi(argv[++arg]);
+        else {
+            fprintf(stderr, "Usage: %s [-j] [-s <scale>] [<benchmark> ...]\n",
+                    argv[0]);
+            return 1;
+        }
+        arg++;
+    }
+    if (scale < 1) scale = 1;
+
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    if ((out == 0) || (freopen("/dev/null", "w", stdout) == 0)) {
+        perror("Can not redirect stdout");
+        return 1;
+    }
+    if (!jsonOutput)
+        fprintf(out, "benchmark,variant,metric,value,unit\n");
+    for(Benchmark* b = benchmarks; b->name; b++) {
+        if (arg < argc) {
+            int found = 0;
+            for(int i = arg; i < argc; i++)
+                if (strcmp(argv[i], b->name) == 0) found = 1;
+            if (!found) continue;
+        }
+        selected++;
+        failed += runBenchmark(b);
+    }
+    if (selected == 0) {
+        fprintf(stderr, "No benchmark selected\n");
+        return 1;
+    }
+    return (failed > 0);
+}
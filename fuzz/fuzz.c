@@ -0,0 +1,561 @@
+/**
+ * This file is part of DBrew, the dynamic binary rewriting library.
+ *
+ * (c) 2015-2016, Josef Weidendorfer <josef.weidendorfer@gmx.de>
+ *
+ * DBrew is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * DBrew is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with DBrew.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Differential fuzzer for DBrew
+ *
+ * From an input byte string, a function is generated with a random
+ * sequence of instructions supported by decoder and emulator: ALU ops
+ * with registers, immediates and memory, lea, shifts, imul, cmov, push/pop
+ * pairs, and forward conditional jumps (so it always terminates).
+ * Conditions only use flags defined by previous instructions.
+ * The function gets 4 integer parameters and a pointer to a memory block,
+ * and at the end stores all working registers and the defined flags into
+ * the memory block.
+ *
+ * The function is run natively, via dbrew_emulate (following the taken
+ * path), and rewritten via dbrew_rewrite with a random set of static
+ * parameters; return values and memory blocks have to match.
+ *
+ * Standalone: fuzz [-v] [-n <count>] [-s <seed>]
+ * As libFuzzer target: compile with -DDBREW_LIBFUZZER -fsanitize=fuzzer
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "dbrew.h"
+
+#define MAXINSTR   24
+#define MAXCODE    1024
+#define MEMWORDS   24
+
+// memory block: data words for loads, for stores, registers, flags.
+// With a static block address, DBrew assumes memory contents to be known
+// data: code never reads what it has written before
+#define MEM_DATA   0
+#define MEM_STORE  4
+#define MEM_REGS   8
+#define MEM_FLAGS  16
+
+typedef uint64_t (*fuzz_func)(uint64_t, uint64_t, uint64_t, uint64_t,
+                              uint64_t*, uint64_t);
+
+// working registers (x86 encoding): rax, rcx, rdx, rsi, rdi, r9, r10, r11.
+// r8 is the pointer to the memory block and not modified
+static const int workReg[8] = { 0, 1, 2, 6, 7, 9, 10, 11 };
+
+// flags as bits in a mask
+enum { F_Z = 1, F_C = 2, F_S = 4, F_O = 8, F_P = 16, F_All = 31 };
+
+// flags tested by condition code <cc>
+static const int ccFlags[16] = {
+    F_O, F_O, F_C, F_C, F_Z, F_Z, F_C|F_Z, F_C|F_Z,
+    F_S, F_S, F_P, F_P, F_S|F_O, F_S|F_O, F_Z|F_S|F_O, F_Z|F_S|F_O
+};
+
+// condition codes supported by the emulator for cmov
+static const int cmovCC[8] = { 0, 1, 2, 3, 4, 5, 8, 9 };
+
+// reader for input bytes, returning 0 at end
+typedef struct {
+    const uint8_t* data;
+    size_t size, pos;
+} Input;
+
+static
+int next(Input* in, int n)
+{
+    int v = (in->pos < in->size) ? in->data[in->pos] : 0;
+    in->pos++;
+    return v % n;
+}
+
+static
+uint32_t next32(Input* in)
+{
+    uint32_t v = 0;
+
+    for(int i = 0; i < 4; i++)
+        v = (v << 8) | next(in, 256);
+    return v;
+}
+
+// generated instruction
+typedef struct {
+    uint8_t b[16];
+    int len;
+    int skip; // forward jump over <skip> instructions, 0 if none
+} GenInstr;
+
+typedef struct {
+    GenInstr instr[MAXINSTR + 1];
+    int count;
+    // flags defined at start of instruction, from jumps to it
+    int jumpFlags[MAXINSTR + 1];
+} Program;
+
+static
+void put(GenInstr* gi, int b)
+{
+    gi->b[gi->len++] = (uint8_t) b;
+}
+
+static
+void put32(GenInstr* gi, uint32_t v)
+{
+    for(int i = 0; i < 4; i++)
+        put(gi, (v >> (8 * i)) & 255);
+}
+
+// REX prefix if needed (always with 64-bit)
+static
+void putRex(GenInstr* gi, int w, int reg, int index, int base)
+{
+    int rex = (w ? 8 : 0) | ((reg & 8) ? 4 : 0) |
+              ((index & 8) ? 2 : 0) | ((base & 8) ? 1 : 0);
+    if (rex) put(gi, 0x40 | rex);
+}
+
+// opcode with register/register operands
+static
+void genRR(GenInstr* gi, int w, int opc, int reg, int rm)
+{
+    putRex(gi, w, reg, 0, rm);
+    if (opc > 255) put(gi, opc >> 8);
+    put(gi, opc & 255);
+    put(gi, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// opcode with register and memory operand disp(%r8)
+static
+void genRM(GenInstr* gi, int w, int opc, int reg, int disp)
+{
+    putRex(gi, w, reg, 0, 8);
+    put(gi, opc);
+    if ((disp >= -128) && (disp < 128)) {
+        put(gi, 0x40 | ((reg & 7) << 3));
+        put(gi, disp);
+    }
+    else {
+        put(gi, 0x80 | ((reg & 7) << 3));
+        put32(gi, disp);
+    }
+}
+
+// append generated instruction to <buf> at offset <o>
+static
+int emit(uint8_t* buf, int o, GenInstr* gi)
+{
+    memcpy(buf + o, gi->b, gi->len);
+    return o + gi->len;
+}
+
+// generate instruction into <gi>, update defined flags in <flags>
+static
+void genInstr(Input* in, GenInstr* gi, int* flags, int remaining)
+{
+    // add, or, and, sub, xor, cmp with digit / opcode (r/m, r)
+    static const int aluDigit[6] = { 0, 1, 4, 5, 6, 7 };
+    int w = next(in, 4) > 0; // mostly 64-bit
+    int d = workReg[next(in, 8)];
+    int s = workReg[next(in, 8)];
+    int op, cc;
+
+    gi->len = 0;
+    gi->skip = 0;
+    switch(next(in, 14)) {
+    case 0: // ALU reg,reg
+        op = next(in, 7);
+        if (op == 6) genRR(gi, w, 0x85, s, d); // test
+        else genRR(gi, w, 1 + 8 * aluDigit[op], s, d);
+        *flags = F_All;
+        break;
+    case 1: { // ALU reg,imm8 / imm32
+        int imm8 = next(in, 2);
+        op = aluDigit[next(in, 6)];
+        // emulator supports or, and, xor only with imm32 and 32-bit,
+        // add, cmp with imm8, and sub with both
+        if ((op == 1) || (op == 4) || (op == 6)) {
+            imm8 = 0;
+            w = 0;
+        }
+        else if (!imm8 && (op != 5))
+            imm8 = 1;
+        putRex(gi, w, 0, 0, d);
+        if (imm8) {
+            put(gi, 0x83);
+            put(gi, 0xC0 | (op << 3) | (d & 7));
+            put(gi, next(in, 256));
+        }
+        else {
+            put(gi, 0x81);
+            put(gi, 0xC0 | (op << 3) | (d & 7));
+            put32(gi, next32(in));
+        }
+        *flags = F_All;
+        break;
+    }
+    case 2: // mov reg,reg / mov imm32,reg
+        if (next(in, 2))
+            genRR(gi, w, 0x89, s, d);
+        else {
+            putRex(gi, w, 0, 0, d);
+            put(gi, 0xC7);
+            put(gi, 0xC0 | (d & 7));
+            put32(gi, next32(in));
+        }
+        break;
+    case 3: // load, store
+        if (next(in, 2))
+            genRM(gi, w, 0x8B, d, 8 * MEM_DATA + (w ? 8 : 4) * next(in, 4));
+        else
+            genRM(gi, w, 0x89, s, 8 * MEM_STORE + (w ? 8 : 4) * next(in, 4));
+        break;
+    case 4: // add/sub/cmp with memory as source
+        op = next(in, 4);
+        if (op < 3) {
+            // r, r/m
+            genRM(gi, w, (op == 0) ? 0x03 : (op == 1) ? 0x2B : 0x3B,
+                  d, 8 * MEM_DATA + (w ? 8 : 4) * next(in, 4));
+        }
+        else // r/m, r
+            genRM(gi, w, 0x39, s, 8 * MEM_DATA + (w ? 8 : 4) * next(in, 4));
+        *flags = F_All;
+        break;
+    case 5: { // lea disp8(base,index,scale),reg
+        int idx = workReg[next(in, 8)];
+        putRex(gi, 1, d, idx, s);
+        put(gi, 0x8D);
+        put(gi, 0x44 | ((d & 7) << 3));
+        put(gi, (next(in, 4) << 6) | ((idx & 7) << 3) | (s & 7));
+        put(gi, next(in, 256));
+        break;
+    }
+    case 6: // inc, dec, neg
+        op = next(in, 3);
+        putRex(gi, w, 0, 0, d);
+        put(gi, (op == 2) ? 0xF7 : 0xFF);
+        put(gi, 0xC0 | (((op == 2) ? 3 : op) << 3) | (d & 7));
+        if (op == 2) *flags = F_All;
+        else *flags |= F_Z | F_S | F_O | F_P; // carry unchanged
+        break;
+    case 7: // shl, shr, sar by 2 .. width-1
+        // flags not set by emulator (see FIXME there): treat as undefined
+        op = next(in, 3);
+        putRex(gi, w, 0, 0, d);
+        put(gi, 0xC1);
+        put(gi, 0xC0 | (((op == 2) ? 7 : 4 + op) << 3) | (d & 7));
+        put(gi, 2 + next(in, w ? 62 : 30));
+        *flags = 0;
+        break;
+    case 8: // imul reg,reg: only carry and overflow defined
+        genRR(gi, w, 0x0FAF, d, s);
+        *flags = F_C | F_O;
+        break;
+    case 9: // cmov
+        cc = cmovCC[next(in, 8)];
+        if ((*flags & ccFlags[cc]) != ccFlags[cc])
+            genRR(gi, w, 0x89, s, d);
+        else
+            genRR(gi, w, 0x0F40 + cc, d, s);
+        break;
+    case 10: // push/pop: move via stack
+        putRex(gi, 0, 0, 0, s);
+        put(gi, 0x50 + (s & 7));
+        putRex(gi, 0, 0, 0, d);
+        put(gi, 0x58 + (d & 7));
+        break;
+    case 11: // cltq, cqto
+        put(gi, 0x48);
+        put(gi, next(in, 2) ? 0x98 : 0x99);
+        break;
+    default: // forward conditional jump
+        cc = next(in, 16);
+        if ((remaining == 0) || ((*flags & ccFlags[cc]) != ccFlags[cc])) {
+            genRR(gi, w, 0x85, s, d); // test instead
+            *flags = F_All;
+            break;
+        }
+        put(gi, 0x70 + cc);
+        put(gi, 0);
+        gi->skip = 1 + next(in, (remaining < 4) ? remaining : 4);
+        break;
+    }
+}
+
+// emit prologue: registers not used for parameters get random values
+static
+int genPrologue(Input* in, uint8_t* buf)
+{
+    static const int reg[4] = { 0, 9, 10, 11 };
+    GenInstr gi;
+    int o = 0;
+
+    for(int i = 0; i < 4; i++) {
+        // mov $imm32,reg (sign-extended)
+        gi.len = 0;
+        putRex(&gi, 1, 0, 0, reg[i]);
+        put(&gi, 0xC7);
+        put(&gi, 0xC0 | (reg[i] & 7));
+        put32(&gi, next32(in));
+        o = emit(buf, o, &gi);
+    }
+    return o;
+}
+
+// emit epilogue: store registers and defined flags into memory block,
+// return first working register
+static
+int genEpilogue(uint8_t* buf, int flags)
+{
+    static const int cc[5] = { 4, 2, 8, 0, 10 }; // z, c, s, o, p
+    GenInstr gi;
+    int o = 0;
+
+    for(int i = 0; i < 8; i++) {
+        gi.len = 0;
+        genRM(&gi, 1, 0x89, workReg[i], 8 * (MEM_REGS + i));
+        o = emit(buf, o, &gi);
+    }
+
+    for(int f = 0; f < 5; f++) {
+        if ((flags & (1 << f)) == 0) continue;
+        // movq $0,flag(%r8); j(not)cc +11; movq $1,flag(%r8)
+        // (moves do not change flags)
+        gi.len = 0;
+        genRM(&gi, 1, 0xC7, 0, 8 * (MEM_FLAGS + f));
+        put32(&gi, 0);
+        put(&gi, 0x70 + (cc[f] ^ 1));
+        put(&gi, 11);
+        o = emit(buf, o, &gi);
+        gi.len = 0;
+        genRM(&gi, 1, 0xC7, 0, 8 * (MEM_FLAGS + f));
+        put32(&gi, 1);
+        o = emit(buf, o, &gi);
+    }
+
+    buf[o++] = 0xC3; // ret
+    return o;
+}
+
+// generate function into <buf>, return its size
+static
+int genProgram(Input* in, uint8_t* buf)
+{
+    Program p;
+    int flags = 0, o;
+
+    o = genPrologue(in, buf);
+    p.count = 1 + next(in, MAXINSTR);
+    for(int i = 0; i <= p.count; i++)
+        p.jumpFlags[i] = F_All;
+
+    for(int i = 0; i < p.count; i++) {
+        GenInstr* gi = p.instr + i;
+
+        // flags must be defined on all paths
+        flags &= p.jumpFlags[i];
+        genInstr(in, gi, &flags, p.count - i - 1);
+        if (gi->skip)
+            p.jumpFlags[i + 1 + gi->skip] &= flags;
+    }
+    flags &= p.jumpFlags[p.count];
+
+    for(int i = 0; i < p.count; i++) {
+        GenInstr* gi = p.instr + i;
+
+        if (gi->skip) {
+            int dist = 0;
+            for(int j = i + 1; j <= i + gi->skip; j++)
+                dist += p.instr[j].len;
+            gi->b[1] = (uint8_t) dist;
+        }
+        o = emit(buf, o, gi);
+    }
+    return o + genEpilogue(buf + o, flags);
+}
+
+static uint8_t* code;
+static int verbose = 0;
+// seed of current test case in standalone mode (0: input from libFuzzer)
+static uint64_t caseSeed = 0;
+// memory blocks for native, emulated, and rewritten execution
+// (static in low memory: rewritten code may use absolute addresses)
+static uint64_t memInit[MEMWORDS], memN[MEMWORDS], memE[MEMWORDS];
+static uint64_t memR[MEMWORDS];
+
+static
+void dumpCode(int size)
+{
+    fprintf(stderr, "Code:");
+    for(int i = 0; i < size; i++)
+        fprintf(stderr, " %02x", code[i]);
+    fprintf(stderr, "\n");
+}
+
+static
+void report(const char* what, uint64_t* par, int staticMask, int size,
+            uint64_t* mem, uint64_t ret, uint64_t retN)
+{
+    Rewriter* r;
+
+    fprintf(stderr, "Mismatch %s (static mask %x), parameters %lx %lx %lx %lx\n",
+            what, staticMask, par[0], par[1], par[2], par[3]);
+    if (ret != retN)
+        fprintf(stderr, "  return value %lx, native %lx\n", ret, retN);
+    for(int i = 0; i < MEMWORDS; i++)
+        if (mem[i] != memN[i])
+            fprintf(stderr, "  word %2d: %lx, native %lx\n", i, mem[i], memN[i]);
+
+    if (caseSeed)
+        fprintf(stderr, "Reproduce with: fuzz -v -n 1 -s %lu\n", caseSeed);
+    dumpCode(size);
+    r = dbrew_new();
+    dbrew_config_function_setname(r, (uint64_t) code, "fuzz");
+    dbrew_config_function_setsize(r, (uint64_t) code, size);
+    dbrew_decode_print(r, (uint64_t) code, size);
+    dbrew_free(r);
+    abort();
+}
+
+// run one test case from input bytes
+static
+void runInput(const uint8_t* data, size_t len)
+{
+    Input in = { data, len, 0 };
+    fuzz_func f = (fuzz_func) code;
+    uint64_t par[4], retN, retE, retR;
+    int size, staticMask;
+    fuzz_func rf;
+    Rewriter* r;
+
+    size = genProgram(&in, code);
+    for(int i = 0; i < 4; i++)
+        par[i] = ((uint64_t) next32(&in) << 32) | next32(&in);
+    for(int i = 0; i < MEMWORDS; i++)
+        memInit[i] = ((uint64_t) next32(&in) << 32) | next32(&in);
+    // parameters 0-3, bit 4: memory block address
+    staticMask = next(&in, 32);
+
+    if (verbose) {
+        dumpCode(size);
+        r = dbrew_new();
+        dbrew_decode_print(r, (uint64_t) code, size);
+        dbrew_free(r);
+    }
+
+    memcpy(memN, memInit, sizeof(memN));
+    retN = f(par[0], par[1], par[2], par[3], memN, 0);
+
+    // emulation of the path taken with the given parameters
+    memcpy(memE, memInit, sizeof(memE));
+    r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) code);
+    if (verbose) dbrew_verbose(r, false, false, true);
+    dbrew_config_branches_known(r, true);
+    retE = dbrew_emulate(r, par[0], par[1], par[2], par[3], memE, 0);
+    dbrew_free(r);
+    if ((retE != retN) || memcmp(memE, memN, sizeof(memN)))
+        report("emulation", par, 0, size, memE, retE, retN);
+
+    // rewriting: emulation during capture writes into memory block
+    memcpy(memR, memInit, sizeof(memR));
+    r = dbrew_new();
+    // each dynamic branch may double the number of paths
+    dbrew_set_capture_capacity(r, 100000, 5000, 1000000);
+    dbrew_set_function(r, (uint64_t) code);
+    if (verbose) dbrew_verbose(r, false, false, true);
+    for(int i = 0; i < 5; i++)
+        if (staticMask & (1 << i))
+            dbrew_config_staticpar(r, i);
+    rf = (fuzz_func) dbrew_rewrite(r, par[0], par[1], par[2], par[3], memR, 0);
+    memcpy(memR, memInit, sizeof(memR));
+    retR = rf(par[0], par[1], par[2], par[3], memR, 0);
+    dbrew_free(r);
+    if ((retR != retN) || memcmp(memR, memN, sizeof(memN)))
+        report("rewriting", par, staticMask, size, memR, retR, retN);
+}
+
+static
+void initCode(void)
+{
+    if (code) return;
+    code = (uint8_t*) mmap(0, MAXCODE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        perror("Can not mmap code buffer");
+        exit(1);
+    }
+}
+
+#ifdef DBREW_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    initCode();
+    runInput(data, size);
+    return 0;
+}
+
+#else
+
+int main(int argc, char* argv[])
+{
+    uint8_t data[512];
+    uint64_t seed = 1, x;
+    int count = 1000;
+
+    for(int arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "-v") == 0)
+            verbose = 1;
+        else if ((strcmp(argv[arg], "-n") == 0) && (arg + 1 < argc))
+            count = atoi(argv[++arg]);
+        else if ((strcmp(argv[arg], "-s") == 0) && (arg + 1 < argc))
+            seed = strtoull(argv[++arg], 0, 0);
+        else {
+            fprintf(stderr, "Usage: %s [-v] [-n <count>] [-s <seed>]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    initCode();
+    for(int i = 0; i < count; i++, seed++) {
+        // xorshift, seeded per test case: failures reproducible via -s
+        x = seed * 0x9E3779B97F4A7C15ul;
+        for(size_t j = 0; j < sizeof(data); j++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            data[j] = (uint8_t) x;
+        }
+        caseSeed = seed;
+        if (verbose)
+            fprintf(stderr, "Test case with seed %lu\n", seed);
+        runInput(data, sizeof(data));
+    }
+    fprintf(stderr, "%d test cases passed.\n", count);
+    return 0;
+}
+
+#endif
@@ -110,10 +110,53 @@ uint64_t makeStatic(uint64_t v);
 typedef struct _Rewriter Rewriter;
 typedef struct _DBB DBB;
 
+// parameter value for dbrew_rewrite_argv, according to signature
+typedef union _DBrewArg {
+    int64_t i;
+    void* p;
+    float f;
+    double d;
+} DBrewArg;
+
+// statistics of a rewriter, summed up over all rewrites since creation
+// or dbrew_reset_stats (see dbrew_get_stats)
+typedef struct _DBrewStats {
+    // time spent per phase in nanoseconds (decode not included in capture)
+    uint64_t decodeTime, captureTime, optTime, generateTime;
+    // instructions decoded, emulated, captured, and generated
+    uint64_t instrDecoded, instrEmulated, instrCaptured, instrGenerated;
+    // decoded BBs (DBBs), captured BBs (CBBs), saved emulator states
+    uint64_t dbbCount, cbbCount, esCount;
+    // comparisons of emulator states (esIsEqual) when saving a state
+    uint64_t esCompares;
+    // bytes of generated code (incl. jump tables)
+    uint64_t bytesGenerated;
+    // cache hits: already decoded DBB, captured CBB, saved state found
+    uint64_t dbbHits, cbbHits, esHits;
+    // profitability estimates (see dbrew_config_profitability): dynamic
+    // instructions on the trace path in original and rewritten code,
+    // code bytes, and number of rewrites returning the original function
+    // (also counting lazy stubs continuing in original code)
+    uint64_t estInstrOrig, estInstrRewritten, estCodeSize;
+    uint64_t fallbacks;
+} DBrewStats;
+
+// execution count of a generated BB (see dbrew_get_counters)
+typedef struct _DBrewCounter {
+    // address of original BB, and ID of emulator state at its start
+    uint64_t addr;
+    int esID;
+    uint64_t count;
+} DBrewCounter;
+
+// called before memory access of rewritten code to a configured range
+typedef void (*DBrewMemHook)(uint64_t addr, int size, bool write);
+
 // allocate space for a given number of decoded instructions
 Rewriter* dbrew_new(void);
 
-// free rewriter resources
+// free rewriter resources, including all code generated by it: no thread
+// may execute this code anymore (also after dbrew_uninstall)
 void dbrew_free(Rewriter*);
 
 // configure size of internal buffer space of a rewriter
@@ -122,15 +165,24 @@ void dbrew_set_decoding_capacity(Rewriter* r,
 void dbrew_set_capture_capacity(Rewriter* r,
                                 int instrCapacity, int bbCapacity,
                                 int codeCapacity);
+// configure size of emulated stack in bytes, a multiple of 16 (default 1024)
+void dbrew_set_stack_size(Rewriter* r, int size);
 
 // set function to rewrite
 // this clears any previously decoded/captured instructions
 void dbrew_set_function(Rewriter* rewriter, uint64_t f);
 
+// declare parameter types of function to rewrite (e.g. "iPPdd")
+void dbrew_set_signature(Rewriter* r, const char* sig);
+
 // set rewriter activities to be verbose or quiet
 void dbrew_verbose(Rewriter* rewriter,
                    bool decode, bool emuState, bool emuSteps);
 void dbrew_optverbose(Rewriter* r, bool v);
+// write perf map and/or jitdump for generated code (see perf-report(1))
+void dbrew_set_perf_output(Rewriter* r, bool perfMap, bool jitDump);
+// register generated code with debug info via the GDB JIT interface
+void dbrew_set_gdb_jit(Rewriter* r, bool enable);
 
 // decode a piece of x86 binary code starting add address <f>
 DBB* dbrew_decode(Rewriter* r, uint64_t f);
@@ -155,9 +207,41 @@ int dbrew_generated_size(Rewriter* r);
 // configure rewriter
 void dbrew_config_reset(Rewriter* r);
 void dbrew_config_staticpar(Rewriter* r, int staticParPos);
+// static parameter <par>, loads via more than <depth> indirections dynamic
+void dbrew_config_staticpar_depth(Rewriter* r, int par, int depth);
+// limit bytes loaded as static via static parameters to <bytes>
+void dbrew_config_staticbudget(Rewriter* r, int bytes);
 void dbrew_config_returnfp(Rewriter* r);
-// assume all calculated results to be unknown at call depth lower <depth>
+// assume all calculated results to be unknown at call depth <depth>
 void dbrew_config_force_unknown(Rewriter* r, int depth);
+// same for all call depths in [<from>,<to>], no upper bound if <to> < 0
+void dbrew_config_force_unknown_range(Rewriter* r, int from, int to);
+// roll loops after <factor> iterations, earlier if over code size budget
+// (estimated bytes per loop)
+void dbrew_config_unroll(Rewriter* r, int factor, int budget);
+// capture paths with <workers> threads in parallel (0: sequential)
+void dbrew_config_parallel(Rewriter* r, int workers);
+// capture paths not taken in the trace lazily on first execution
+void dbrew_config_lazy(Rewriter* r, bool lazy);
+// return original function if rewriting is estimated to be not profitable,
+// or generated code to be larger than <sizeBudget> bytes (0: unlimited)
+void dbrew_config_profitability(Rewriter* r, bool check, int sizeBudget);
+// tiered rewriting: profile values of parameter <par> at function entry
+void dbrew_config_profilepar(Rewriter* r, int par);
+// same for <size> bytes (4 or 8) at <addr>
+void dbrew_config_profilemem(Rewriter* r, uint64_t addr, int size);
+// declare <len> bytes at <addr> as read-only: loads become static
+void dbrew_config_staticmem(Rewriter* r, uint64_t addr, uint64_t len);
+// call <fn> before accesses of rewritten code to <len> bytes at <addr>
+void dbrew_config_memaccess_hook(Rewriter* r, uint64_t addr, uint64_t len,
+                                 DBrewMemHook fn);
+// speculate on parameter <par> to be <value>, guarded at function entry
+void dbrew_config_expectpar(Rewriter* r, int par, uint64_t value);
+// speculate on <size> bytes (4 or 8) at <addr> to be <value>
+void dbrew_config_expectmem(Rewriter* r, uint64_t addr, int size,
+                            uint64_t value);
+// on failing guard, use generic rewritten version instead of original
+void dbrew_config_expectfallback(Rewriter* r, bool capture);
 // assume all branches to be fixed according to rewriter input parameters
 void dbrew_config_branches_known(Rewriter* r, bool);
 // provide a name for a function (for debugging)
@@ -176,7 +260,36 @@ uint64_t dbrew_emulate(Rewriter* r, ...);
 // rewrite configured function, return pointer to rewritten code
 uint64_t dbrew_rewrite(Rewriter* r, ...);
 
-// rewrite <f> using default config, return pointer to rewritten code
+// same as dbrew_rewrite, with parameters as array according to signature
+uint64_t dbrew_rewrite_argv(Rewriter* r, DBrewArg* argv);
+
+// rewrite for <nsets> parameter sets, return array of entry points
+uint64_t* dbrew_rewrite_batch(Rewriter* r, int nsets, uint64_t args[][6]);
+
+// start rewriting in background, return stub calling original until done
+uint64_t dbrew_rewrite_async(Rewriter* r, ...);
+// rewrite with profiling of values, return stub switching to code
+// specialized for values stable over <threshold> calls (in background)
+uint64_t dbrew_rewrite_tiered(Rewriter* r, int threshold, ...);
+// has the stub of a tiered rewrite been switched to specialized code?
+bool dbrew_rewrite_promoted(Rewriter* r);
+// wait for a background rewrite of <r> to finish (stops tiered rewriting)
+void dbrew_rewrite_wait(Rewriter* r);
+// patch entry of original function to jump to rewritten code
+bool dbrew_install(Rewriter* r);
+void dbrew_uninstall(Rewriter* r);
+// statistics of rewrites with <r> (see DBrewStats), and resetting them
+void dbrew_get_stats(Rewriter* r, DBrewStats* stats);
+void dbrew_reset_stats(Rewriter* r);
+// instrument generated BBs with execution counters
+void dbrew_set_counters(Rewriter* r, bool enable);
+// get up to <max> counters into <c>, return number of counters
+int dbrew_get_counters(Rewriter* r, DBrewCounter* c, int max);
+void dbrew_reset_counters(Rewriter* r);
+
+// rewrite <f> using default config of the default rewriter of the calling
+// thread, return pointer to rewritten code. The default rewriter (with the
+// rewritten code) is freed when the thread exits
 uint64_t dbrew_rewrite_func(uint64_t f, ...);
 
 
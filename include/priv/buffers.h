@@ -20,6 +20,7 @@
 #ifndef BUFFERS_H
 #define BUFFERS_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 // XXX: Move Struct in C file after removing all direct dependencies!
@@ -33,6 +34,7 @@ struct _CodeStorage {
 typedef struct _CodeStorage CodeStorage;
 
 CodeStorage* initCodeStorage(int size);
+CodeStorage* initDataStorage(int size);
 void freeCodeStorage(CodeStorage* cs);
 
 /* this checks whether enough storage is available, but does
@@ -41,4 +43,28 @@ void freeCodeStorage(CodeStorage* cs);
 uint8_t* reserveCodeStorage(CodeStorage* cs, int size);
 uint8_t* useCodeStorage(CodeStorage* cs, int size);
 
+/* Arena: bump-pointer allocation of objects freed all at once by
+ * resetArena(). Memory is kept in a list of chunks and reused after
+ * a reset.
+ */
+typedef struct _ArenaChunk ArenaChunk;
+struct _ArenaChunk {
+    ArenaChunk* next;
+    size_t size;
+    size_t used;
+    uint8_t buf[] __attribute__((aligned(16)));
+};
+
+typedef struct _Arena {
+    ArenaChunk* first;
+    ArenaChunk* current;
+    size_t chunkSize;
+} Arena;
+
+Arena* initArena(size_t chunkSize);
+void freeArena(Arena* a);
+void resetArena(Arena* a);
+// allocate <size> bytes, 16-byte aligned
+void* allocArena(Arena* a, size_t size);
+
 #endif // BUFFERS_H
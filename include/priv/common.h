@@ -25,6 +25,7 @@
 #include "expr.h"
 #include "instr.h"
 
+#include <pthread.h>
 #include <stdint.h>
 
 #define debug(format, ...) printf("!DBG %s: " format "\n", __PRETTY_FUNCTION__, ##__VA_ARGS__)
@@ -39,6 +40,7 @@ struct _DBB {
     int size; // in bytes
     int count;
     Instr* instr; // pointer to first decoded instruction
+    DBB* nextHash; // chain in hash table of decoded BBs
 };
 
 
@@ -47,6 +49,7 @@ struct _CBB {
     // ID: address of original BB + EmuState at start
     uint64_t dec_addr;
     int esID;
+    CBB* nextHash; // chain in hash table of CBBs (see getCaptureBB)
 
     // if !=0, capturing of instructions in this BB started in this function
     FunctionConfig* fc;
@@ -54,6 +57,8 @@ struct _CBB {
     // instructions captured within this BB
     int count;
     Instr* instr;
+    // original instructions emulated while capturing this BB
+    int origCount;
 
     // two possible exits: next on branching or fall-through
     CBB *nextBranch, *nextFallThrough;
@@ -61,19 +66,28 @@ struct _CBB {
     InstrType endType;
     // a hint for conditional branches whether branching is more likely
     bool preferBranch;
+    // parallel capture: already taken by a worker
+    bool claimed;
+
+    // indirect jump via jump table (endType IT_JMPI): index register,
+    // and targets as range in jump table entries of the rewriter
+    Reg jtIndex;
+    int jtFirst, jtCount;
 
     // for code generation/relocation
     int size;
     uint64_t addr1, addr2;
     bool genJcc8, genJump;
+    uint64_t jtAddr; // generated jump table
+    uint64_t lazyAddr; // not captured yet: record of generated stub
+    uint64_t* counter; // execution counter incremented by generated code
 };
 
 char* cbb_prettyName(CBB* bb);
 
 
 
-#define CC_MAXPARAM     6
-#define CC_MAXCALLDEPTH 5
+#define CC_MAXPARAM     16
 
 // emulator capture states
 typedef enum _CaptureState {
@@ -89,6 +103,8 @@ typedef enum _CaptureState {
 // in registers or on (private) stack
 typedef struct _MetaState {
     CaptureState cState;
+    // CS_STATIC2: indirections still giving CS_STATIC2 (0: unlimited)
+    int indir;
     ExprNode* range;  // constrains for dynamic value
     ExprNode* parDep; // analysis: dependency from input parameters
 } MetaState;
@@ -100,6 +116,57 @@ void initMetaState(MetaState* ms, CaptureState cs);
 // Rewriter Configuration
 //
 
+// range of call depths [from, to] a policy applies to (to < 0: unbounded)
+typedef struct _DepthRange
+{
+    int from, to;
+} DepthRange;
+
+// value expected at a memory location (size 4 or 8)
+typedef struct _ExpectedMem
+{
+    uint64_t addr;
+    int size;
+    uint64_t val;
+} ExpectedMem;
+
+// value observed at function entry for tiered rewriting: a parameter
+// (register resolved on rewriting), or <size> bytes at <addr>
+typedef struct _ProfiledValue
+{
+    int par; // -1 for memory
+    Reg reg;
+    uint64_t addr;
+    int size;
+} ProfiledValue;
+
+// memory range [start, end) declared read-only
+typedef struct _StaticMem
+{
+    uint64_t start, end;
+} StaticMem;
+
+// loop header candidate: visits of a decoded address within same frame
+typedef struct _LoopHeader
+{
+    uint64_t addr;
+    int visits;
+    int esID; // state at last visit
+    // instructions captured by all workers up to the first visit
+    int capturedStart;
+} LoopHeader;
+
+// parameter types of a function signature (see dbrew_set_signature)
+typedef enum _ParType {
+    PT_None = 0,
+    PT_Int,    // 32-bit integer
+    PT_Long,   // 64-bit integer
+    PT_Ptr,    // pointer
+    PT_Float,  // single precision, in XMM register
+    PT_Double, // double precision, in XMM register
+    PT_Max
+} ParType;
+
 struct _FunctionConfig
 {
     uint64_t func;
@@ -115,13 +182,47 @@ typedef struct _CaptureConfig
     MetaState par_state[CC_MAXPARAM];
     // for debug: allow parameters to be named
     char* par_name[CC_MAXPARAM];
+    // signature: without (parCount 0), 6 integer parameters are assumed
+    int parCount;
+    ParType par_type[CC_MAXPARAM];
+
+    // speculate on expected values, checked by guards at function entry
+    bool par_expected[CC_MAXPARAM];
+    uint64_t par_expectedVal[CC_MAXPARAM];
+    int expectedMemCount;
+    ExpectedMem* expectedMem;
+    // if guards fail: capture generic version instead of calling original
+    bool expectFallbackCapture;
+    // read-only memory: sorted by address, without overlaps
+    int staticMemCount;
+    StaticMem* staticMem;
+    // bytes loaded via CS_STATIC2 addresses made static (0: unlimited)
+    int staticBudget;
+    // values profiled by first tier of tiered rewriting
+    int profiledCount;
+    ProfiledValue* profiled;
+    // hook called before memory accesses to [memHookStart, memHookEnd)
+    DBrewMemHook memHook;
+    uint64_t memHookStart, memHookEnd;
 
      // does function to rewrite return floating point?
     bool hasReturnFP;
     // avoid unrolling at call depths
-    bool force_unknown[CC_MAXCALLDEPTH];
+    int force_unknownCount;
+    DepthRange* force_unknown;
     // all branches forced known
     bool branches_known;
+    // loop unrolling: iterations before rolling, captured instruction budget
+    int unrollFactor;
+    int unrollBudget;
+    // number of threads exploring paths in parallel (0: sequential)
+    int parallelWorkers;
+    // capture paths not taken in the trace only on first execution
+    bool lazyCapture;
+    // return original function if rewriting is not profitable, or code
+    // estimated to be larger than sizeBudget bytes (0: unlimited)
+    bool checkProfit;
+    int sizeBudget;
 
     // linked list of configurations per function
     FunctionConfig* function_configs;
@@ -130,6 +231,7 @@ typedef struct _CaptureConfig
 
 
 FunctionConfig* config_find_function(Rewriter* r, uint64_t f);
+bool config_force_unknown(Rewriter* r, int depth);
 
 
 
@@ -150,17 +252,23 @@ typedef struct _EmuValue {
 } EmuValue;
 
 
-#define MAX_CALLDEPTH 5
-
 // emulator state. for memory, use the real memory apart from stack
 
 struct _EmuState;
 typedef struct _EmuState EmuState;
 
+// in-memory object file registered with GDB (see gdbjit.c)
+typedef struct _GdbJitEntry GdbJitEntry;
+
 struct _EmuState {
 
     // when saving an EmuState, remember root
     EmuState* parent;
+    // saved states only: ID, hash of static content, and chain in
+    // hash bucket (see saveEmuState)
+    int esID;
+    uint32_t hash;
+    EmuState* nextSaved;
 
     // general registers: Reg_AX .. Reg_R15
     uint64_t reg[Reg_Max];
@@ -175,13 +283,34 @@ struct _EmuState {
     int stackSize;
     uint8_t* stack; // real memory backing
     uint64_t stackStart, stackAccessed, stackTop; // virtual stack boundaries
-    // capture state of stack
-    MetaState *stackState;
-
-    // own return stack
-    uint64_t ret_stack[MAX_CALLDEPTH];
+    // capture state of stack, one byte per stack byte: CaptureState in
+    // bits 0-2, for CS_STATIC2 remaining indirections in bits 3-7 (see
+    // MetaState). Other parts of MetaState are not kept for values on stack
+    uint8_t* stackState;
+
+    // own return stack, grows with call depth
+    int retStackCapacity;
+    uint64_t* ret_stack;
     int depth;
 
+    // on a speculated path: memory with expected values (see CaptureConfig)
+    int expectedMemCount;
+    ExpectedMem* expectedMem;
+    // read-only memory (see CaptureConfig)
+    int staticMemCount;
+    StaticMem* staticMem;
+    // budget for loads via CS_STATIC2 addresses, and bytes used over all
+    // paths (shared by saved states, see CaptureConfig)
+    int staticBudget;
+    int* staticBytes;
+    // emulation follows the path taken at runtime (see branches_known):
+    // only then memory gets read via dynamic addresses
+    bool runtimePath;
+
+    // register compared with immediate by the instruction just emulated:
+    // a following conditional jump provides a bound for its value
+    Reg cmpReg;
+    uint64_t cmpVal;
 };
 
 
@@ -191,21 +320,32 @@ struct _Rewriter {
     int decInstrCount, decInstrCapacity;
     Instr* decInstr;
 
-    // decoded basic blocks
+    // decoded basic blocks, hashed by address (see BB_HASH_BITS)
     int decBBCount, decBBCapacity;
     DBB* decBB;
+    DBB** decBBHash;
 
-    // captured instructions
+    // captured instructions, and number captured by all workers in
+    // this rewrite (see capturedCount)
     int capInstrCount, capInstrCapacity;
     Instr* capInstr;
+    int capturedTotal;
 
-    // captured basic blocks
+    // captured basic blocks, hashed by address and esID
     int capBBCount, capBBCapacity;
     CBB* capBB;
+    CBB** capBBHash;
     CBB* currentCapBB;
+    // lazy capturing at runtime: stop paths before capacities run out
+    // (see captureCapacityLeft)
+    bool capLimited;
 
-    // expressions for analysis
-    ExprPool * ePool;
+    // per-rewrite allocations: expressions for analysis and saved
+    // emulator states, freed at start of capturing (see resetCapturing)
+    Arena* arena;
+
+    // size of emulated stack (see EmuState)
+    int emuStackSize;
 
     // function to capture
     uint64_t func;
@@ -215,24 +355,84 @@ struct _Rewriter {
     CodeStorage* cs;
     uint64_t generatedCodeAddr;
     int generatedCodeSize;
+    // data used by generated code: execution counters of CBBs (see
+    // dbrew_set_counters), record for memory access hook (see MemHookRec)
+    bool genCounters;
+    CodeStorage* dataStorage;
+    uint64_t* memHookRec;
+    // tiered rewriting: generate value profiling at entry into records
+    // in data storage (last value and count of repeated observations per
+    // profiled value), and re-specialize once counts reach tierThreshold
+    bool genProfile;
+    uint64_t* profRec;
+    int tierThreshold;
+    bool tierStop, tierPromoted;
+
+    // parallel capture: workers are copies of the rewriter with own
+    // emulator state, captured instructions and capture stack, using
+    // all other structures of <shared> (protected by captureLock).
+    // Lock and condition are allocated once and shared by the copies
+    Rewriter* shared;
+    pthread_mutex_t* captureLock;
+    pthread_cond_t* captureCond;
+    int busyWorkers;
+    // instructions captured by workers, freed on reset
+    int workerInstrCount;
+    Instr** workerInstr;
+
+    // asynchronous rewriting: stub jumping to original or rewritten code
+    CodeStorage* stubStorage;
+    // storage which may still be used by other threads (e.g. code reached
+    // via the stub before it was switched), freed in freeRewriter
+    int retiredCount, retiredCapacity;
+    CodeStorage** retired;
+    bool asyncActive;
+    pthread_t asyncThread;
+    uint64_t asyncPar[CC_MAXPARAM];
+
+    // original function entry patched to jump to generated code (see
+    // dbrew_install): replaced bytes, and storage for relocated prologue.
+    // Patch sites for trapping threads are owned until the next install
+    // or freeing of the rewriter (0 if none)
+    bool installed;
+    int installSize;
+    uint8_t installOrig[14];
+    CodeStorage* installStorage;
+    uint64_t patchedFunc, patchedFallback;
+    // guard fallback jumping to the original function (0 if none)
+    CBB* guardFallback;
+
+    // bytes loaded as static via CS_STATIC2 addresses in this rewrite
+    int staticBytes;
+
+    // statistics with times in time stamp counter ticks (see statsAdd)
+    DBrewStats stats;
 
     // structs for emulator & capture config
     CaptureConfig* cc;
     EmuState* es;
-    // saved emulator states
-#define SAVEDSTATE_MAX 20
-    int savedStateCount;
-    EmuState* savedState[SAVEDSTATE_MAX];
+    // saved emulator states, and their hash buckets with own locks for
+    // parallel capture workers (see ES_HASH_BITS)
+    int savedStateCount, savedStateCapacity;
+    EmuState** savedState;
+    EmuState** savedStateHash;
+    pthread_mutex_t* savedStateLock;
 
     // stack of unfinished BBs to capture
-#define CAPTURESTACK_LEN 20
-    int capStackTop;
-    CBB* capStack[CAPTURESTACK_LEN];
+    int capStackTop, capStackCapacity;
+    CBB** capStack;
+
+    // targets of captured jump tables
+    int capJTCount, capJTCapacity;
+    CBB** capJT;
+
+    // visited addresses for loop detection
+    int loopHeaderCount, loopHeaderCapacity;
+    LoopHeader* loopHeader;
 
     // capture order
-#define GENORDER_MAX 20
-    int genOrderCount;
-    CBB* genOrder[GENORDER_MAX];
+    int genOrderCount, genOrderCapacity;
+    CBB** genOrder;
 
     // for optimization passes
     bool addInliningHints;
@@ -240,6 +440,17 @@ struct _Rewriter {
 
     // debug output
     bool showDecoding, showEmuState, showEmuSteps, showOptSteps;
+    // announce generated code to perf (see dbrew_set_perf_output)
+    bool perfMap, perfJitDump;
+
+    // debug info for captured instructions: original instruction being
+    // emulated, and offset of frame address (see Instr)
+    uint64_t capOrigAddr;
+    int capCfaOffset;
+    // code registered with the GDB JIT interface (see dbrew_set_gdb_jit)
+    bool gdbJit;
+    int gdbJitCount, gdbJitCapacity;
+    GdbJitEntry** gdbJitEntry;
 };
 
 
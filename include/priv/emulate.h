@@ -52,20 +52,33 @@
 EmuState* allocEmuState(int size);
 void freeEmuState(Rewriter* r);
 void resetEmuState(EmuState* es);
+// set capture state of <len> stack bytes at offset <off>
+void setStackState(EmuState* es, uint64_t off, int len, MetaState* ms);
 // save current emulator state for later rollback, return ID
 int saveEmuState(Rewriter* r);
 // set current emulator state to previously saved state <esID>
 void restoreEmuState(Rewriter* r, int esID);
+void materializeEmuState(EmuState* es, uint64_t* reg, bool* flag, uint64_t rsp);
 void printEmuState(EmuState* es);
 void printStaticEmuState(EmuState* es, int esID);
 
 void resetCapturing(Rewriter* r);
 CBB* getCaptureBB(Rewriter* r, uint64_t f, int esID);
+CBB* newCaptureBB(Rewriter* r, uint64_t f, int esID);
 int pushCaptureBB(Rewriter* r, CBB* bb);
-CBB* popCaptureBB(Rewriter* r);
+// finish current CBB with <endType>, pop it from the capture stack
+CBB* popCaptureBB(Rewriter* r, InstrType endType);
 Instr* newCapInstr(Rewriter* r);
 void capture(Rewriter* r, Instr* instr);
 void captureRet(Rewriter* r, Instr* orig, EmuState* es);
+// at start of emulating <addr>: roll loop (end current CBB) if needed
+bool captureLoopHeader(Rewriter* r, uint64_t addr);
+// register loop header candidate if <dbb> ends with a backward branch
+void noteLoopHeader(Rewriter* r, DBB* dbb);
+// with r->capLimited: capacities left to capture a BB creating <bbs> CBBs?
+bool captureCapacityLeft(Rewriter* r, int bbs);
+// end current CBB with a jump to a CBB at <addr> left uncaptured
+void captureDefer(Rewriter* r, uint64_t addr);
 
 // emulate <instr> by changing <es> and capture it if not static.
 // return 0 to fall through to next instruction, or return address to jump to
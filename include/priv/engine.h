@@ -29,9 +29,45 @@ Rewriter* allocRewriter(void);
 void initRewriter(Rewriter* r);
 void freeRewriter(Rewriter* r);
 
+// parallel capture: rewriter holding shared structures, and their lock
+Rewriter* sharedRewriter(Rewriter* r);
+void lockShared(Rewriter* r);
+void unlockShared(Rewriter* r);
+
+// hash tables for decoded/captured BBs and saved emulator states.
+// Lookups of BBs need no lock: entries get published after being
+// initialized, and are only removed on reset
+#define BB_HASH_BITS 10
+#define ES_HASH_BITS 8
+uint32_t hashBB(uint64_t addr, int esID);
+
+// storage possibly used by other threads is freed with the rewriter
+void retireStorage(Rewriter* r, CodeStorage* cs);
+void retireGenerated(Rewriter* r);
+
+// instructions captured by all parallel capture workers in this rewrite
+int capturedCount(Rewriter* r);
+// upper bound of generated bytes per captured instruction
+int instrCodeBound(Rewriter* r);
+
+// statistics (see dbrew_get_stats): time stamp counter, and adding to a
+// counter of the shared rewriter (atomic for parallel capture workers)
+uint64_t statsTicks(void);
+#define statsAdd(r, field, n) \
+    __atomic_add_fetch(&(sharedRewriter(r)->stats.field), (n), __ATOMIC_RELAXED)
+
 // Rewrite engine
+// read parameters for emulateAndCapture according to signature
+void readParameters(Rewriter* r, va_list args, uint64_t* par);
+// register of integer parameter <p>, Reg_None if on stack or FP
+Reg parRegister(CaptureConfig* cc, int p);
 void vEmulateAndCapture(Rewriter* r, va_list args);
+// same with 6 parameters given in array <par>. With <appendCode>, code
+// generated afterwards gets appended to code generated before
+void emulateAndCapture(Rewriter* r, uint64_t* par, bool appendCode);
 void runOptsOnCaptured(Rewriter* r);
 void generateBinaryFromCaptured(Rewriter* r);
+// lazy capturing: callback from generated stub, returns code to jump to
+uint64_t lazyCompile(void* stub, uint64_t* regs);
 
 #endif // ENGINE_H
@@ -15,41 +15,33 @@
 
 #include <stdint.h>
 
+#include "buffers.h"
+
 typedef enum _NodeType {
     NT_Invalid, NT_Const, NT_Sum, NT_Scaled, NT_Par, NT_Ref
 } NodeType;
 
 typedef struct _ExprNode ExprNode;
-typedef struct _ExprPool ExprPool;
 
+// nodes are allocated from an arena, valid until it gets reset
 #define EN_NAMELEN 8
 struct _ExprNode {
-    ExprPool* p;
     NodeType type;
 
     int ival;      // Const, Scaled: scaling factor, FuncPar: par no
     uint64_t ptr;  // Ref: base pointer
-    int left;      // Sum: Op1, Ref: index
-    int right;     // Sum: Op2
+    ExprNode* left;  // Sum: Op1, Ref: index
+    ExprNode* right; // Sum: Op2
     char name[EN_NAMELEN]; // Par: parameter name, Ref: array name
 };
 
-struct _ExprPool {
-    int size;
-    int used;
-    ExprNode n[1];
-};
-
-ExprPool* expr_allocPool(int s);
-void expr_freePool(ExprPool* p);
-ExprNode* expr_newNode(ExprPool* p, NodeType t);
-int expr_nodeIndex(ExprPool* p, ExprNode* n);
+ExprNode* expr_newNode(Arena* a, NodeType t);
 
-ExprNode* expr_newConst(ExprPool* p, int val);
-ExprNode* expr_newPar(ExprPool* p, int no, char* n);
-ExprNode* expr_newScaled(ExprPool* p, int factor, ExprNode* e);
-ExprNode* expr_newRef(ExprPool* p, uint64_t ptr, char* n, ExprNode* idx);
-ExprNode* expr_newSum(ExprPool* p, ExprNode* left, ExprNode* right);
+ExprNode* expr_newConst(Arena* a, int val);
+ExprNode* expr_newPar(Arena* a, int no, char* n);
+ExprNode* expr_newScaled(Arena* a, int factor, ExprNode* e);
+ExprNode* expr_newRef(Arena* a, uint64_t ptr, char* n, ExprNode* idx);
+ExprNode* expr_newSum(Arena* a, ExprNode* left, ExprNode* right);
 
 char* expr_toString(ExprNode* e);
 
@@ -0,0 +1,31 @@
+/**
+ * This file is part of DBrew, the dynamic binary rewriting library.
+ *
+ * (c) 2015-2016, Josef Weidendorfer <josef.weidendorfer@gmx.de>
+ *
+ * DBrew is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * DBrew is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with DBrew.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GDBJIT_H
+#define GDBJIT_H
+
+#include "common.h"
+
+// register code generated for CBBs r->genOrder[] with GDB, ending at
+// offset <codeEnd> in code storage (see dbrew_set_gdb_jit)
+void gdbJitRegisterCBBs(Rewriter* r, int codeEnd);
+// unregister all code of <r>, e.g. before code storage gets reused
+void gdbJitUnregister(Rewriter* r);
+
+#endif // GDBJIT_H
@@ -102,13 +102,14 @@ typedef enum _OpSegOverride {
     OSO_None = 0, OSO_UseFS, OSO_UseGS
 } OpSegOverride;
 
+// enum fields use 8 bits: 16 bytes per operand
 typedef struct _Operand {
     uint64_t val; // imm or displacement
-    OpType type;
-    Reg reg;
-    Reg ireg; // with SIB
-    int scale; // with SIB
-    OpSegOverride seg; // with OP_Ind type
+    OpType type : 8;
+    Reg reg : 8;
+    Reg ireg : 8; // with SIB
+    uint8_t scale; // with SIB
+    OpSegOverride seg : 8; // with OP_Ind type
 } Operand;
 
 // for passthrough instructions
@@ -141,26 +142,49 @@ typedef enum _StateChange {
     SC_dstDyn // operand dst is valid, should change to dynamic
 } StateChange;
 
+// Decoded and captured instructions are arrays of Instr, packed for memory
+// footprint: fields used by every decode/emulate/generate step come first
+// and fit into one cache line (64 bytes), followed by annotations only
+// needed for some instructions. Enum fields use 8 bits: 88 bytes per Instr.
 typedef struct _Instr {
     uint64_t addr;
-    int len;
-    InstrType type;
+    InstrType type : 8;
+    ValType vtype : 8; // without explicit operands or all operands of same type
+    OperandForm form : 8;
+    uint8_t len;
+    // captured instr: offset of the canonical frame address from the
+    // stack pointer (0 if unknown)
+    int32_t cfaOffset;
+    Operand dst, src; //  with binary op: dst = dst op src
+    Operand src2; // with ternary op: dst = src op src2
 
     // annotation for pass-through (not used when ptLen == 0)
-    int ptLen;
-    PrefixSet ptPSet;
+    uint8_t ptLen;
+    PrefixSet ptPSet : 8;
+    OperandEncoding ptEnc : 8;
+    StateChange ptSChange : 8;
     unsigned char ptOpc[4];
-    OperandEncoding ptEnc;
-    StateChange ptSChange;
-
-    ValType vtype; // without explicit operands or all operands of same type
-    OperandForm form;
-    Operand dst, src; //  with binary op: dst = dst op src
-    Operand src2; // with ternary op: dst = src op src2
 
     ExprNode* info_memAddr; // annotate memory reference of instr
+
+    // captured instr: address of original instruction
+    uint64_t origAddr;
 } Instr;
 
+// enums stored in 8-bit fields of Operand and Instr must fit
+_Static_assert(Reg_Max < 256, "Reg does not fit into 8 bits");
+_Static_assert(OT_MAX < 256, "OpType does not fit into 8 bits");
+_Static_assert(OSO_UseGS < 256, "OpSegOverride does not fit into 8 bits");
+_Static_assert(IT_Max < 256, "InstrType does not fit into 8 bits");
+_Static_assert(VT_Max < 256, "ValType does not fit into 8 bits");
+_Static_assert(OF_Max < 256, "OperandForm does not fit into 8 bits");
+_Static_assert(PS_2E < 256, "PrefixSet does not fit into 8 bits");
+_Static_assert(OE_RMI < 256, "OperandEncoding does not fit into 8 bits");
+_Static_assert(SC_dstDyn < 256, "StateChange does not fit into 8 bits");
+// footprint of the packed layout (see above)
+_Static_assert(sizeof(Operand) == 16, "Operand layout not packed");
+_Static_assert(sizeof(Instr) == 88, "Instr layout not packed");
+
 
 ValType opValType(Operand* o);
 int opTypeWidth(Operand* o);
@@ -174,8 +198,8 @@ bool opIsEqual(Operand* o1, Operand* o2);
 
 OpType getGPRegOpType(ValType t);
 void setRegOp(Operand* o, ValType t, Reg r);
-Operand* getRegOp(ValType t, Reg r);      // returns pointer to static object
-Operand* getImmOp(ValType t, uint64_t v); // returns pointer to static object
+Operand* getRegOp(ValType t, Reg r);      // pointer to thread-local static object
+Operand* getImmOp(ValType t, uint64_t v); // pointer to thread-local static object
 
 
 void copyOperand(Operand* dst, Operand* src);
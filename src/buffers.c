@@ -26,7 +26,8 @@
 #include <sys/mman.h>
 
 
-CodeStorage* initCodeStorage(int size)
+static
+CodeStorage* allocStorage(int size, int prot)
 {
     int fullsize;
     uint8_t* buf;
@@ -38,8 +39,7 @@ CodeStorage* initCodeStorage(int size)
     /* We do not want to use malloc as we need execute permission.
     * This will return an address aligned to a page boundary
     */
-    buf = (uint8_t*) mmap(0, fullsize,
-                          PROT_READ | PROT_WRITE | PROT_EXEC,
+    buf = (uint8_t*) mmap(0, fullsize, prot,
                           MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
     if (buf == (uint8_t*)-1) {
         perror("Can not mmap code region.");
@@ -57,6 +57,20 @@ CodeStorage* initCodeStorage(int size)
     return cs;
 }
 
+CodeStorage* initCodeStorage(int size)
+{
+    return allocStorage(size, PROT_READ | PROT_WRITE | PROT_EXEC);
+}
+
+/* Storage for data written by generated code (e.g. counters), also
+ * addressed by generated code via 64-bit immediates. Separate
+ * from code to avoid writes into pages with code being executed.
+ */
+CodeStorage* initDataStorage(int size)
+{
+    return allocStorage(size, PROT_READ | PROT_WRITE);
+}
+
 void freeCodeStorage(CodeStorage* cs)
 {
     if (cs)
@@ -85,3 +99,78 @@ uint8_t* useCodeStorage(CodeStorage* cs, int size)
     cs->used += size;
     return p;
 }
+
+
+static
+ArenaChunk* allocChunk(size_t size)
+{
+    ArenaChunk* c;
+
+    c = (ArenaChunk*) malloc(sizeof(ArenaChunk) + size);
+    if (c == 0) {
+        perror("Can not allocate arena chunk");
+        exit(1);
+    }
+    c->next = 0;
+    c->size = size;
+    c->used = 0;
+    return c;
+}
+
+Arena* initArena(size_t chunkSize)
+{
+    Arena* a = (Arena*) malloc(sizeof(Arena));
+
+    a->chunkSize = chunkSize;
+    a->first = allocChunk(chunkSize);
+    a->current = a->first;
+    return a;
+}
+
+void freeArena(Arena* a)
+{
+    ArenaChunk* c;
+
+    if (!a) return;
+    c = a->first;
+    while(c) {
+        ArenaChunk* next = c->next;
+        free(c);
+        c = next;
+    }
+    free(a);
+}
+
+/* O(1): chunks after the first are reset when reached again */
+void resetArena(Arena* a)
+{
+    a->current = a->first;
+    a->current->used = 0;
+}
+
+void* allocArena(Arena* a, size_t size)
+{
+    ArenaChunk* c = a->current;
+    void* p;
+
+    size = (size + 15) & ~((size_t) 15);
+    if (c->size - c->used < size) {
+        // continue with next chunk if large enough, else insert new one
+        if (c->next && (c->next->size >= size)) {
+            c = c->next;
+            c->used = 0;
+        }
+        else {
+            ArenaChunk* n;
+
+            n = allocChunk((size > a->chunkSize) ? size : a->chunkSize);
+            n->next = c->next;
+            c->next = n;
+            c = n;
+        }
+        a->current = c;
+    }
+    p = c->buf + c->used;
+    c->used += size;
+    return p;
+}
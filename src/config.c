@@ -30,10 +30,32 @@ void cc_init(CaptureConfig* cc)
         initMetaState(&(cc->par_state[i]), CS_DYNAMIC);
     for(int i=0; i < CC_MAXPARAM; i++)
         cc->par_name[i] = 0;
-    for(int i=0; i < CC_MAXCALLDEPTH; i++)
-        cc->force_unknown[i] = false;
+    for(int i=0; i < CC_MAXPARAM; i++)
+        cc->par_expected[i] = false;
+    cc->parCount = 0;
+    for(int i=0; i < CC_MAXPARAM; i++)
+        cc->par_type[i] = PT_None;
+    cc->expectedMemCount = 0;
+    cc->expectedMem = 0;
+    cc->expectFallbackCapture = false;
+    cc->staticMemCount = 0;
+    cc->staticMem = 0;
+    cc->staticBudget = 0;
+    cc->profiledCount = 0;
+    cc->profiled = 0;
+    cc->memHook = 0;
+    cc->memHookStart = 0;
+    cc->memHookEnd = 0;
+    cc->force_unknownCount = 0;
+    cc->force_unknown = 0;
     cc->hasReturnFP = false;
     cc->branches_known = false;
+    cc->unrollFactor = 0;
+    cc->unrollBudget = 0;
+    cc->parallelWorkers = 0;
+    cc->lazyCapture = false;
+    cc->checkProfit = false;
+    cc->sizeBudget = 0;
     cc->function_configs = 0;
 
 }
@@ -45,6 +67,10 @@ void cc_free(CaptureConfig* cc)
 
     for(int i=0; i < CC_MAXPARAM; i++)
         free(cc->par_name[i]);
+    free(cc->force_unknown);
+    free(cc->expectedMem);
+    free(cc->staticMem);
+    free(cc->profiled);
 
     FunctionConfig* fc = cc->function_configs;
     while(fc) {
@@ -127,6 +153,19 @@ FunctionConfig* config_find_function(Rewriter* r, uint64_t f)
     return fc_find(cc, f);
 }
 
+// should results of operations at call depth <depth> be forced to unknown?
+bool config_force_unknown(Rewriter* r, int depth)
+{
+    CaptureConfig* cc = cc_get(r);
+
+    for(int i = 0; i < cc->force_unknownCount; i++) {
+        DepthRange* dr = cc->force_unknown + i;
+        if ((depth >= dr->from) && ((dr->to < 0) || (depth <= dr->to)))
+            return true;
+    }
+    return false;
+}
+
 
 //---------------------------------------------------------------------
 // DBrew API functions for configuration
@@ -139,6 +178,37 @@ void dbrew_config_reset(Rewriter* r)
     r->cc = cc_new();
 }
 
+/**
+ * Declare the parameters of the function to rewrite, one character per
+ * parameter: 'i' for int, 'l' for long, 'p' or 'P' for pointers, 'f' for
+ * float and 'd' for double. This determines where parameter values are
+ * expected according to the calling convention (general purpose or XMM
+ * registers, or on the stack if running out of registers), and how many
+ * parameters are given to dbrew_rewrite. Without a signature, 6 integer
+ * parameters are assumed.
+ * Static floating point parameters get loaded into their XMM register at
+ * entry of the rewritten code.
+ */
+void dbrew_set_signature(Rewriter* r, const char* sig)
+{
+    CaptureConfig* cc = cc_get(r);
+    int i;
+
+    for(i = 0; sig[i]; i++) {
+        assert(i < CC_MAXPARAM);
+        switch(sig[i]) {
+        case 'i': cc->par_type[i] = PT_Int; break;
+        case 'l': cc->par_type[i] = PT_Long; break;
+        case 'p':
+        case 'P': cc->par_type[i] = PT_Ptr; break;
+        case 'f': cc->par_type[i] = PT_Float; break;
+        case 'd': cc->par_type[i] = PT_Double; break;
+        default: assert(0);
+        }
+    }
+    cc->parCount = i;
+}
+
 void dbrew_config_staticpar(Rewriter* r, int staticParPos)
 {
     CaptureConfig* cc = cc_get(r);
@@ -147,6 +217,184 @@ void dbrew_config_staticpar(Rewriter* r, int staticParPos)
     initMetaState(&(cc->par_state[staticParPos]), CS_STATIC2);
 }
 
+/**
+ * Same as dbrew_config_staticpar, but limit following pointers: values
+ * loaded via <depth> indirections starting from parameter <par> (e.g. a
+ * chain of <depth> "next" pointers) are static, further loads are
+ * dynamic. A depth of 0 means no limit.
+ */
+void dbrew_config_staticpar_depth(Rewriter* r, int par, int depth)
+{
+    CaptureConfig* cc = cc_get(r);
+
+    assert((par >= 0) && (par < CC_MAXPARAM));
+    assert(depth >= 0);
+    initMetaState(&(cc->par_state[par]), CS_STATIC2);
+    cc->par_state[par].indir = depth;
+}
+
+/**
+ * Limit the bytes loaded as static via static parameters (see
+ * dbrew_config_staticpar) to <bytes> over all captured paths, bounding
+ * code size for large data structures. Further loads are dynamic.
+ * A budget of 0 means no limit.
+ */
+void dbrew_config_staticbudget(Rewriter* r, int bytes)
+{
+    CaptureConfig* cc = cc_get(r);
+
+    assert(bytes >= 0);
+    cc->staticBudget = bytes;
+}
+
+/**
+ * Speculate on parameter <par> to have value <value> on most calls:
+ * the rewritten code checks the parameter register at entry (only the
+ * lower 32 bits for 'i' parameters, see dbrew_set_signature), and
+ * the path for the expected value gets specialized as if the parameter
+ * was static. If the check fails, see dbrew_config_expectfallback.
+ * Only parameters passed in general purpose registers are checked:
+ * floating point and stack parameters stay dynamic.
+ */
+void dbrew_config_expectpar(Rewriter* r, int par, uint64_t value)
+{
+    CaptureConfig* cc = cc_get(r);
+
+    assert((par >= 0) && (par < CC_MAXPARAM));
+    cc->par_expected[par] = true;
+    cc->par_expectedVal[par] = value;
+}
+
+/**
+ * Same as dbrew_config_expectpar for <size> bytes (4 or 8) of memory at
+ * address <addr>. On the speculated path, reading this memory via a known
+ * address returns the expected value as static. Writing to it via a known
+ * address ends the speculation; as with the stack, writes via unknown
+ * addresses are assumed not to alias.
+ */
+void dbrew_config_expectmem(Rewriter* r, uint64_t addr, int size,
+                            uint64_t value)
+{
+    CaptureConfig* cc = cc_get(r);
+    ExpectedMem* em;
+
+    assert((size == 4) || (size == 8));
+    cc->expectedMem = (ExpectedMem*) realloc(cc->expectedMem,
+                      sizeof(ExpectedMem) * (cc->expectedMemCount + 1));
+    em = cc->expectedMem + cc->expectedMemCount;
+    em->addr = addr;
+    em->size = size;
+    em->val = (size == 4) ? (uint32_t) value : value;
+    cc->expectedMemCount++;
+}
+
+static
+void addProfiled(CaptureConfig* cc, int par, uint64_t addr, int size)
+{
+    ProfiledValue* pv;
+
+    cc->profiled = (ProfiledValue*) realloc(cc->profiled,
+                   sizeof(ProfiledValue) * (cc->profiledCount + 1));
+    pv = cc->profiled + cc->profiledCount;
+    pv->par = par;
+    pv->reg = Reg_None;
+    pv->addr = addr;
+    pv->size = size;
+    cc->profiledCount++;
+}
+
+/**
+ * For tiered rewriting (see dbrew_rewrite_tiered), observe values of
+ * parameter <par> at function entry. Only for integer parameters passed
+ * in registers.
+ */
+void dbrew_config_profilepar(Rewriter* r, int par)
+{
+    CaptureConfig* cc = cc_get(r);
+
+    assert((par >= 0) && (par < CC_MAXPARAM));
+    addProfiled(cc, par, 0, 8);
+}
+
+// same as dbrew_config_profilepar for <size> bytes (4 or 8) at <addr>
+void dbrew_config_profilemem(Rewriter* r, uint64_t addr, int size)
+{
+    CaptureConfig* cc = cc_get(r);
+
+    assert((size == 4) || (size == 8));
+    addProfiled(cc, -1, addr, size);
+}
+
+/**
+ * Declare <len> bytes of memory at <addr> as read-only, e.g. a lookup
+ * table or a configuration struct. Values loaded from there are static
+ * if the address is known, independent of how it was calculated.
+ * Overlapping or adjacent ranges get merged.
+ */
+void dbrew_config_staticmem(Rewriter* r, uint64_t addr, uint64_t len)
+{
+    CaptureConfig* cc = cc_get(r);
+    uint64_t start = addr, end = addr + len;
+    int i, j;
+
+    if (len == 0) return;
+
+    // first range overlapping/adjacent to new range, or after it
+    for(i = 0; i < cc->staticMemCount; i++)
+        if (cc->staticMem[i].end >= start) break;
+    // ranges up to j (exclusive) get merged
+    for(j = i; j < cc->staticMemCount; j++) {
+        if (cc->staticMem[j].start > end) break;
+        if (cc->staticMem[j].start < start) start = cc->staticMem[j].start;
+        if (cc->staticMem[j].end > end) end = cc->staticMem[j].end;
+    }
+    if (j == i) {
+        // no merge: insert at i
+        cc->staticMem = (StaticMem*) realloc(cc->staticMem,
+                        sizeof(StaticMem) * (cc->staticMemCount + 1));
+        memmove(cc->staticMem + i + 1, cc->staticMem + i,
+                sizeof(StaticMem) * (cc->staticMemCount - i));
+        cc->staticMemCount++;
+    }
+    else {
+        // replace merged ranges i .. j-1 by one
+        memmove(cc->staticMem + i + 1, cc->staticMem + j,
+                sizeof(StaticMem) * (cc->staticMemCount - j));
+        cc->staticMemCount -= j - i - 1;
+    }
+    cc->staticMem[i].start = start;
+    cc->staticMem[i].end = end;
+}
+
+/**
+ * Call <fn> before each access of captured code to memory starting within
+ * <len> bytes at <addr>, with address, size in bytes, and whether it is a
+ * write. Accesses with known address outside the range get no overhead,
+ * others are checked inline. Stack accesses via %rsp and accesses with
+ * segment override are not reported. Replaces any previous hook; if <fn>
+ * is 0, no hook is called.
+ */
+void dbrew_config_memaccess_hook(Rewriter* r, uint64_t addr, uint64_t len,
+                                 DBrewMemHook fn)
+{
+    CaptureConfig* cc = cc_get(r);
+
+    cc->memHook = (len > 0) ? fn : 0;
+    cc->memHookStart = addr;
+    cc->memHookEnd = addr + len;
+}
+
+/**
+ * If a guard for expected values fails, by default the original function
+ * is called. With <capture> set, a generic version of the function is
+ * captured instead and used as fallback.
+ */
+void dbrew_config_expectfallback(Rewriter* r, bool capture)
+{
+    CaptureConfig* cc = cc_get(r);
+    cc->expectFallbackCapture = capture;
+}
+
 void dbrew_config_par_setname(Rewriter* c, int par, char* name)
 {
     CaptureConfig* cc = cc_get(c);
@@ -164,11 +412,101 @@ void dbrew_config_par_setname(Rewriter* c, int par, char* name)
  * Brute force approach to prohibit loop unrolling.
  */
 void dbrew_config_force_unknown(Rewriter* r, int depth)
+{
+    dbrew_config_force_unknown_range(r, depth, depth);
+}
+
+/**
+ * Same as dbrew_config_force_unknown, for all call depths in the
+ * range [from, to]. A negative <to> means no upper bound, e.g.
+ * (2, -1) forces results to unknown at any depth >= 2.
+ */
+void dbrew_config_force_unknown_range(Rewriter* r, int from, int to)
+{
+    CaptureConfig* cc = cc_get(r);
+    DepthRange* dr;
+
+    assert(from >= 0);
+    assert((to < 0) || (to >= from));
+    cc->force_unknown = (DepthRange*) realloc(cc->force_unknown,
+                        sizeof(DepthRange) * (cc->force_unknownCount + 1));
+    dr = cc->force_unknown + cc->force_unknownCount;
+    dr->from = from;
+    dr->to = to;
+    cc->force_unknownCount++;
+}
+
+/**
+ * Controlled loop unrolling as alternative to dbrew_config_force_unknown.
+ * When emulation reaches a code address again in the same call frame with
+ * static values changed (e.g. a loop induction variable), after <factor>
+ * such visits these values are made dynamic: the following loop iterations
+ * are captured only once, as rolled loop. Independent of <factor>, this
+ * happens already when the code captured for this loop since its first
+ * visit may exceed <budget> bytes (no budget if <budget> is 0). Code size
+ * is estimated as upper bound per captured instruction, counting
+ * instructions captured by all parallel capture workers. A <factor> of 0
+ * disables it.
+ */
+void dbrew_config_unroll(Rewriter* r, int factor, int budget)
+{
+    CaptureConfig* cc = cc_get(r);
+
+    assert(factor >= 0);
+    assert(budget >= 0);
+    cc->unrollFactor = factor;
+    cc->unrollBudget = budget;
+}
+
+/**
+ * Explore pending paths of the function to rewrite with <workers> threads
+ * in parallel, each with its own emulator state. For large functions with
+ * many paths, this reduces rewriting latency. 0 means sequential.
+ */
+void dbrew_config_parallel(Rewriter* r, int workers)
+{
+    CaptureConfig* cc = cc_get(r);
+
+    assert(workers >= 0);
+    cc->parallelWorkers = workers;
+}
+
+/**
+ * Lazy capturing: on conditional branches with dynamic condition, only the
+ * direction taken in the trace gets captured. For the other direction, a
+ * stub is generated which calls back into the rewriter on first execution.
+ * The path then gets captured with the runtime values of dynamic registers,
+ * and the stub is patched to jump to the new code. Paths never executed
+ * do not cost rewriting time and code size. Paths are only captured
+ * lazily outside of inlined calls. When capacities (see
+ * dbrew_set_capture_capacity) run out, a stub continues in the original
+ * code instead. Stubs refer to the capture state of the last rewrite:
+ * not supported with dbrew_rewrite_async, dbrew_rewrite_batch,
+ * dbrew_rewrite_tiered and dbrew_install, which keep previous code callable.
+ */
+void dbrew_config_lazy(Rewriter* r, bool lazy)
+{
+    CaptureConfig* cc = cc_get(r);
+    cc->lazyCapture = lazy;
+}
+
+/**
+ * Check profitability of rewriting before generating code. Along the path
+ * of the trace (directions of conditional branches as taken with the
+ * given parameter values), the number of captured instructions is compared
+ * with the number of original instructions emulated. If the rewritten
+ * code is expected to execute more instructions, or the code size is
+ * estimated to be larger than <sizeBudget> bytes (no limit if 0), no code
+ * gets generated and rewriting returns the original function.
+ * The estimates and decision are available via dbrew_get_stats.
+ */
+void dbrew_config_profitability(Rewriter* r, bool check, int sizeBudget)
 {
     CaptureConfig* cc = cc_get(r);
 
-    assert((depth >= 0) && (depth < CC_MAXCALLDEPTH));
-    cc->force_unknown[depth] = true;
+    assert(sizeBudget >= 0);
+    cc->checkProfit = check;
+    cc->sizeBudget = sizeBudget;
 }
 
 void dbrew_config_returnfp(Rewriter* r)
@@ -20,9 +20,12 @@
 #include "dbrew.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
 
 #include "buffers.h"
 #include "common.h"
@@ -32,6 +35,7 @@
 #include "emulate.h"
 #include "engine.h"
 #include "generate.h"
+#include "install.h"
 
 /**
  * Functions which may be used in code to be rewritten
@@ -65,6 +69,9 @@ Rewriter* dbrew_new(void)
 
 void dbrew_free(Rewriter* r)
 {
+    dbrew_rewrite_wait(r);
+    dbrew_uninstall(r);
+    releasePatchSites(r);
     freeRewriter(r);
 }
 
@@ -80,6 +87,7 @@ void dbrew_decode_print(Rewriter* r, uint64_t f, int count)
     int decoded = 0;
 
     r->decBBCount = 0;
+    memset(r->decBBHash, 0, sizeof(DBB*) << BB_HASH_BITS);
     while(decoded < count) {
         dbb = dbrew_decode(r, f + decoded);
         decoded += dbb->size;
@@ -118,9 +126,20 @@ void dbrew_set_capture_capacity(Rewriter* r,
     r->capCodeCapacity = codeCapacity;
 }
 
+void dbrew_set_stack_size(Rewriter* r, int size)
+{
+    // keeps the emulated stack pointer 16-byte aligned at start
+    assert((size > 0) && (size % 16 == 0));
+    dbrew_rewrite_wait(r);
+    r->emuStackSize = size;
+    freeEmuState(r);
+}
+
 
 void dbrew_set_function(Rewriter* rewriter, uint64_t f)
 {
+    dbrew_rewrite_wait(rewriter);
+    dbrew_uninstall(rewriter);
     rewriter->func = f;
 
     // reset all decoding/state
@@ -143,6 +162,31 @@ void dbrew_optverbose(Rewriter* r, bool v)
     r->showOptSteps = v;
 }
 
+/**
+ * Make code generated by <r> known to the perf profiler: with <perfMap>,
+ * symbols get appended to /tmp/perf-<pid>.map (for perf report), with
+ * <jitDump>, code gets written to /tmp/jit-<pid>.dump (for perf annotate,
+ * after "perf inject --jit"). Each captured BB is a symbol "dbrew:<name>",
+ * using function names set with dbrew_config_function_setname.
+ */
+void dbrew_set_perf_output(Rewriter* r, bool perfMap, bool jitDump)
+{
+    r->perfMap = perfMap;
+    r->perfJitDump = jitDump;
+}
+
+/**
+ * Register code generated by <r> with GDB via its JIT interface, as
+ * in-memory object file with symbols (see dbrew_set_perf_output), call
+ * frame information to unwind through rewritten code, and a line table
+ * mapping to the original instructions. Lines are offsets (plus 1) to
+ * the lowest original address, given in the file name "dbrew@<addr>".
+ */
+void dbrew_set_gdb_jit(Rewriter* r, bool enable)
+{
+    r->gdbJit = enable;
+}
+
 uint64_t dbrew_generated_code(Rewriter* r)
 {
     return r->generatedCodeAddr;
@@ -157,13 +201,31 @@ int dbrew_generated_size(Rewriter* r)
 //-----------------------------------------------------------------
 // convenience functions, using defaults
 
-Rewriter* defaultRewriter = 0;
+// one default rewriter per thread, freed on thread exit
+static __thread Rewriter* defaultRewriter = 0;
+static pthread_key_t defaultRewriterKey;
+static pthread_once_t defaultRewriterOnce = PTHREAD_ONCE_INIT;
+
+static
+void freeDefaultRewriter(void* r)
+{
+    dbrew_free((Rewriter*) r);
+}
+
+static
+void createDefaultRewriterKey(void)
+{
+    pthread_key_create(&defaultRewriterKey, freeDefaultRewriter);
+}
 
 static
 Rewriter* getDefaultRewriter(void)
 {
-    if (!defaultRewriter)
+    if (!defaultRewriter) {
         defaultRewriter = dbrew_new();
+        pthread_once(&defaultRewriterOnce, createDefaultRewriterKey);
+        pthread_setspecific(defaultRewriterKey, defaultRewriter);
+    }
 
     return defaultRewriter;
 }
@@ -201,6 +263,383 @@ uint64_t dbrew_rewrite(Rewriter* r, ...)
     return r->generatedCodeAddr;
 }
 
+/**
+ * Same as dbrew_rewrite, with parameter values given in <argv> according
+ * to the signature set with dbrew_set_signature (6 integers without)
+ */
+uint64_t dbrew_rewrite_argv(Rewriter* r, DBrewArg* argv)
+{
+    uint64_t par[CC_MAXPARAM];
+    int count = (r->cc && (r->cc->parCount > 0)) ? r->cc->parCount : 6;
+
+    for(int i = 0; i < count; i++) {
+        ParType t = (r->cc && (r->cc->parCount > 0)) ? r->cc->par_type[i]
+                                                    : PT_Long;
+        par[i] = 0;
+        switch(t) {
+        case PT_Float:  memcpy(par + i, &(argv[i].f), sizeof(float)); break;
+        case PT_Double: memcpy(par + i, &(argv[i].d), sizeof(double)); break;
+        case PT_Int:    par[i] = (uint32_t) argv[i].i; break;
+        default:        par[i] = (uint64_t) argv[i].i; break;
+        }
+    }
+
+    emulateAndCapture(r, par, false);
+    runOptsOnCaptured(r);
+    generateBinaryFromCaptured(r);
+
+    return r->generatedCodeAddr;
+}
+
+/**
+ * Rewrite the configured function for <nsets> sets of parameters <args>,
+ * e.g. for different values of parameters configured as static. Decoded
+ * code and configuration are shared, and all variants are generated into
+ * the code storage of <r> (see dbrew_set_capture_capacity for its size).
+ * Returns an array with the entry points of the variants, to be released
+ * with free(). With a signature, at most 6 parameters can be given, with
+ * floating point values as bit patterns. Not supported with lazy capturing.
+ */
+uint64_t* dbrew_rewrite_batch(Rewriter* r, int nsets, uint64_t args[][6])
+{
+    uint64_t* entry = (uint64_t*) malloc(sizeof(uint64_t) * nsets);
+
+    assert((r->cc == 0) || !r->cc->lazyCapture);
+    assert((r->cc == 0) || (r->cc->parCount <= 6));
+    dbrew_rewrite_wait(r);
+
+    for(int i = 0; i < nsets; i++) {
+        emulateAndCapture(r, args[i], i > 0);
+        runOptsOnCaptured(r);
+        generateBinaryFromCaptured(r);
+        entry[i] = r->generatedCodeAddr;
+    }
+
+    return entry;
+}
+
+// stub: "jmp *2(%rip)", 2 padding bytes, 8-byte aligned target slot
+#define STUB_SIZE 16
+#define STUB_SLOT 8
+
+static
+void* asyncWorker(void* arg)
+{
+    Rewriter* r = (Rewriter*) arg;
+    uint64_t* slot = (uint64_t*) (r->stubStorage->buf + STUB_SLOT);
+
+    emulateAndCapture(r, r->asyncPar, false);
+    runOptsOnCaptured(r);
+    generateBinaryFromCaptured(r);
+
+    // callers may jump via the slot concurrently: aligned stores are atomic
+    if (r->generatedCodeAddr)
+        __atomic_store_n(slot, r->generatedCodeAddr, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+// get stub of <r> for asynchronous rewriting, jumping via its slot
+static
+uint8_t* getStub(Rewriter* r)
+{
+    uint8_t* stub;
+
+    if (r->stubStorage == 0) {
+        r->stubStorage = initCodeStorage(STUB_SIZE);
+        stub = useCodeStorage(r->stubStorage, STUB_SIZE);
+        stub[0] = 0xFF;
+        stub[1] = 0x25; // jmp *disp32(%rip)
+        *(int32_t*)(stub + 2) = STUB_SLOT - 6;
+        stub[6] = 0xCC;
+        stub[7] = 0xCC;
+    }
+    return r->stubStorage->buf;
+}
+
+/**
+ * Start rewriting the configured function in a background thread and
+ * return a stub immediately. Calling the stub executes the original
+ * function until rewriting is finished, then the rewritten code.
+ * The stub address is stable: it is the same for all asynchronous rewrites
+ * using <r> and is valid until dbrew_free(). Until dbrew_rewrite_wait()
+ * returns, <r> must not be used otherwise.
+ * Code of a previous rewrite may still be executed by other threads: it
+ * is kept until dbrew_free(), which requires that no thread executes code
+ * of <r> anymore. Not supported with lazy capturing: stubs of retired code
+ * would capture into the state of the new rewrite.
+ */
+uint64_t dbrew_rewrite_async(Rewriter* r, ...)
+{
+    va_list argptr;
+    uint8_t* stub;
+    uint64_t* slot;
+    bool published;
+
+    assert((r->cc == 0) || !r->cc->lazyCapture);
+    dbrew_rewrite_wait(r);
+    dbrew_uninstall(r);
+
+    va_start(argptr, r);
+    readParameters(r, argptr, r->asyncPar);
+    va_end(argptr);
+
+    published = (r->stubStorage != 0);
+    stub = getStub(r);
+    slot = (uint64_t*) (stub + STUB_SLOT);
+
+    // go back to original, and generate into fresh storage: callers may
+    // still execute code reached via the slot before
+    __atomic_store_n(slot, r->func, __ATOMIC_RELEASE);
+    if (published)
+        retireGenerated(r);
+
+    if (pthread_create(&(r->asyncThread), 0, asyncWorker, r) == 0)
+        r->asyncActive = true;
+    else
+        asyncWorker(r); // no thread available: rewrite synchronously
+
+    return (uint64_t) stub;
+}
+
+/* Tiered rewriting
+ *
+ * The first tier is rewritten code with value profiling at entry (see
+ * genProfile). A background thread checks the profile periodically. Once
+ * profiled values were observed unchanged for a threshold of calls, the
+ * function gets rewritten again with these values expected (guarded, with
+ * the generic version as fallback), appended to the code of the first
+ * tier which may still be executing. The stub switches to the new code.
+ */
+
+// check interval of tiering thread in microseconds
+#define TIER_INTERVAL 1000
+
+// re-specialize with stable profiled values, return true if done
+static
+bool tierPromote(Rewriter* r)
+{
+    CaptureConfig* cc = r->cc;
+    uint64_t* slot = (uint64_t*) (r->stubStorage->buf + STUB_SLOT);
+    int stable = 0;
+
+    // second tier gets appended: includes guards and a generic version.
+    // Not enough space left: stay with the first tier
+    if (r->cs->fullsize - r->cs->used < 2 * r->generatedCodeSize)
+        return true;
+
+    for(int i = 0; i < cc->profiledCount; i++) {
+        ProfiledValue* pv = cc->profiled + i;
+        uint64_t count, val;
+
+        // concurrent updates by first tier: a mismatch only is a bad guess
+        count = __atomic_load_n(r->profRec + 2 * i + 1, __ATOMIC_RELAXED);
+        val = __atomic_load_n(r->profRec + 2 * i, __ATOMIC_RELAXED);
+        if (count < (uint64_t) r->tierThreshold) continue;
+
+        if (pv->par >= 0)
+            dbrew_config_expectpar(r, pv->par, val);
+        else
+            dbrew_config_expectmem(r, pv->addr, pv->size, val);
+        stable++;
+    }
+    if (stable == 0) return false;
+
+    dbrew_config_expectfallback(r, true);
+    r->genProfile = false;
+    emulateAndCapture(r, r->asyncPar, true);
+    runOptsOnCaptured(r);
+    generateBinaryFromCaptured(r);
+    if (r->generatedCodeAddr) {
+        __atomic_store_n(slot, r->generatedCodeAddr, __ATOMIC_RELEASE);
+        __atomic_store_n(&(r->tierPromoted), true, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+static
+void* tierWorker(void* arg)
+{
+    Rewriter* r = (Rewriter*) arg;
+    struct timespec ts = { 0, TIER_INTERVAL * 1000 };
+
+    while(!__atomic_load_n(&(r->tierStop), __ATOMIC_ACQUIRE)) {
+        if (tierPromote(r)) break;
+        nanosleep(&ts, 0);
+    }
+    return 0;
+}
+
+/**
+ * Tiered rewriting: rewrite the configured function with profiling of
+ * values configured with dbrew_config_profilepar/profilemem, and return a
+ * stub jumping to this first tier. In the background, once a profiled
+ * value was observed unchanged in <threshold> consecutive calls, the
+ * function gets re-specialized with stable values as expected values
+ * (see dbrew_config_expectpar), and the stub switches to this code.
+ * Expected values stay in the configuration of <r>.
+ * Both tiers must fit into code storage: if the remaining space is not
+ * twice the size of the first tier, the function is not promoted.
+ * As with dbrew_rewrite_async, <r> must not be used otherwise until
+ * dbrew_rewrite_wait(), which stops profile checking, and code of previous
+ * rewrites is kept until dbrew_free(). Not supported with lazy capturing.
+ */
+uint64_t dbrew_rewrite_tiered(Rewriter* r, int threshold, ...)
+{
+    va_list argptr;
+    CaptureConfig* cc;
+    uint8_t* stub;
+    uint64_t* slot;
+    bool published;
+
+    assert(threshold > 0);
+    dbrew_rewrite_wait(r);
+    dbrew_uninstall(r);
+    cc = r->cc;
+    assert((cc == 0) || !cc->lazyCapture);
+
+    va_start(argptr, threshold);
+    readParameters(r, argptr, r->asyncPar);
+    va_end(argptr);
+
+    // as with dbrew_rewrite_async: original until first tier is generated
+    published = (r->stubStorage != 0);
+    stub = getStub(r);
+    slot = (uint64_t*) (stub + STUB_SLOT);
+    __atomic_store_n(slot, r->func, __ATOMIC_RELEASE);
+    if (published)
+        retireGenerated(r);
+
+    if (cc) {
+        for(int i = 0; i < cc->profiledCount; i++)
+            if (cc->profiled[i].par >= 0)
+                cc->profiled[i].reg = parRegister(cc, cc->profiled[i].par);
+    }
+    r->genProfile = true;
+    r->tierPromoted = false;
+    emulateAndCapture(r, r->asyncPar, false);
+    runOptsOnCaptured(r);
+    generateBinaryFromCaptured(r);
+    r->genProfile = false;
+    __atomic_store_n(slot, r->generatedCodeAddr, __ATOMIC_RELEASE);
+
+    // nothing to profile, or fallback to original: no second tier
+    if ((r->profRec == 0) || (r->generatedCodeAddr == r->func))
+        return (uint64_t) stub;
+
+    r->tierThreshold = threshold;
+    r->tierStop = false;
+    if (pthread_create(&(r->asyncThread), 0, tierWorker, r) == 0)
+        r->asyncActive = true;
+
+    return (uint64_t) stub;
+}
+
+// is code of the second tier used (see dbrew_rewrite_tiered)?
+bool dbrew_rewrite_promoted(Rewriter* r)
+{
+    return __atomic_load_n(&(r->tierPromoted), __ATOMIC_ACQUIRE);
+}
+
+// wait for a rewrite started with dbrew_rewrite_async() to finish, or
+// stop checking for promotion started with dbrew_rewrite_tiered()
+void dbrew_rewrite_wait(Rewriter* r)
+{
+    if (!r->asyncActive) return;
+
+    __atomic_store_n(&(r->tierStop), true, __ATOMIC_RELEASE);
+    pthread_join(r->asyncThread, 0);
+    r->asyncActive = false;
+    r->tierStop = false;
+}
+
+// time stamp counter ticks per nanosecond, calibrated on first use
+static double ticksPerNs = 1.0;
+static pthread_once_t calibrateOnce = PTHREAD_ONCE_INIT;
+
+static
+void calibrateTicks(void)
+{
+    struct timespec t1, t2;
+    uint64_t start, ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    start = statsTicks();
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        ns = (t2.tv_sec - t1.tv_sec) * 1000000000ul + t2.tv_nsec - t1.tv_nsec;
+    } while(ns < 1000000);
+    ticksPerNs = (double) (statsTicks() - start) / ns;
+}
+
+/**
+ * Get statistics of rewrites done with <r> into <stats>: time spent in
+ * the rewriting phases, and counters for work done. Counters are cheap
+ * and always on. With parallel capture workers, decoding time is summed
+ * up over threads. Lazy capturing adds to capture and generate phases.
+ */
+void dbrew_get_stats(Rewriter* r, DBrewStats* stats)
+{
+    dbrew_rewrite_wait(r);
+    pthread_once(&calibrateOnce, calibrateTicks);
+
+    *stats = r->stats;
+    stats->decodeTime = stats->decodeTime / ticksPerNs;
+    stats->captureTime = stats->captureTime / ticksPerNs;
+    stats->optTime = stats->optTime / ticksPerNs;
+    stats->generateTime = stats->generateTime / ticksPerNs;
+}
+
+void dbrew_reset_stats(Rewriter* r)
+{
+    dbrew_rewrite_wait(r);
+    memset(&(r->stats), 0, sizeof(DBrewStats));
+}
+
+/**
+ * Enable instrumentation of code generated afterwards: each generated BB
+ * atomically increments an execution counter on entry.
+ */
+void dbrew_set_counters(Rewriter* r, bool enable)
+{
+    r->genCounters = enable;
+}
+
+/**
+ * Copy up to <max> execution counters of instrumented BBs of the current
+ * rewrite into <c>, in capture order. The first is the entry BB.
+ * Returns the number of instrumented BBs (may be larger than <max>).
+ */
+int dbrew_get_counters(Rewriter* r, DBrewCounter* c, int max)
+{
+    int n = 0;
+
+    dbrew_rewrite_wait(r);
+    pthread_mutex_lock(r->captureLock);
+    for(int i = 0; i < r->capBBCount; i++) {
+        CBB* cbb = r->capBB + i;
+        if (cbb->counter == 0) continue;
+        if (n < max) {
+            c[n].addr = cbb->dec_addr;
+            c[n].esID = cbb->esID;
+            c[n].count = __atomic_load_n(cbb->counter, __ATOMIC_RELAXED);
+        }
+        n++;
+    }
+    pthread_mutex_unlock(r->captureLock);
+    return n;
+}
+
+// set execution counters of the current rewrite to 0
+void dbrew_reset_counters(Rewriter* r)
+{
+    pthread_mutex_lock(r->captureLock);
+    for(int i = 0; i < r->capBBCount; i++)
+        if (r->capBB[i].counter)
+            __atomic_store_n(r->capBB[i].counter, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(r->captureLock);
+}
+
 uint64_t dbrew_rewrite_func(uint64_t f, ...)
 {
     Rewriter* r;
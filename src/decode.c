@@ -59,6 +59,8 @@ Instr* nextInstr(Rewriter* r, uint64_t a, int len)
     i->dst.type = OT_None;
     i->src.type = OT_None;
     i->src2.type = OT_None;
+    i->origAddr = a;
+    i->cfaOffset = 0;
 
     return i;
 }
@@ -1503,7 +1505,8 @@ void decode(Rewriter* r, DContext* cxt, ValType vt, bool* exit)
 
         case 4:
             // jmp* r/m64: absolute indirect
-            assert(cxt->rex == 0);
+            // REX.B/REX.X only extend register numbers (e.g. jmp* %r11)
+            assert((cxt->rex & REX_MASK_W) == 0);
             opOverwriteType(&o1, VT_64);
             addUnaryOp(r, cxt, IT_JMPI, &o1);
             *exit = true;
@@ -1530,22 +1533,57 @@ void decode(Rewriter* r, DContext* cxt, ValType vt, bool* exit)
     }
 }
 
+// return already decoded BB starting at <f>, 0 if not found.
+// Parallel capture workers call this without holding the capture lock
+static
+DBB* findDecodedBB(Rewriter* r, uint64_t f)
+{
+    DBB* dbb;
+
+    dbb = __atomic_load_n(&(r->decBBHash[hashBB(f, 0)]), __ATOMIC_ACQUIRE);
+    for(; dbb; dbb = dbb->nextHash)
+        if (dbb->addr == f) return dbb;
+
+    return 0;
+}
+
 // decode the basic block starting at f (automatically triggered by emulator)
 DBB* dbrew_decode(Rewriter* r, uint64_t f)
 {
     DContext cxt;
     ValType vt;
-    int i, old_icount;
+    int old_icount;
     bool exitLoop;
     DBB* dbb;
+    DBB** head;
+    uint64_t start;
 
     if (f == 0) return 0; // nothing to decode
+    if (r->shared) {
+        // parallel capture worker: use decoded BBs of shared rewriter,
+        // only decoding of a new BB needs the capture lock
+        if (r->shared->decBB) {
+            dbb = findDecodedBB(r->shared, f);
+            if (dbb) {
+                statsAdd(r, dbbHits, 1);
+                return dbb;
+            }
+        }
+        lockShared(r);
+        dbb = dbrew_decode(r->shared, f);
+        unlockShared(r);
+        return dbb;
+    }
     if (r->decBB == 0) initRewriter(r);
 
+    start = statsTicks();
     // already decoded?
-    for(i = 0; i < r->decBBCount; i++)
-        if (r->decBB[i].addr == f) return &(r->decBB[i]);
-
+    dbb = findDecodedBB(r, f);
+    if (dbb) {
+        statsAdd(r, dbbHits, 1);
+        statsAdd(r, decodeTime, statsTicks() - start);
+        return dbb;
+    }
 
     // start decoding of new BB beginning at f
     assert(r->decBBCount < r->decBBCapacity);
@@ -1583,9 +1621,18 @@ DBB* dbrew_decode(Rewriter* r, uint64_t f)
     dbb->count = r->decInstrCount - old_icount;
     dbb->size = cxt.off;
 
+    statsAdd(r, dbbCount, 1);
+    statsAdd(r, instrDecoded, dbb->count);
+    statsAdd(r, decodeTime, statsTicks() - start);
+
     if (r->showDecoding)
         dbrew_print_decoded(dbb);
 
+    // publish for lookups only after decoding is done
+    head = &(r->decBBHash[hashBB(f, 0)]);
+    dbb->nextHash = *head;
+    __atomic_store_n(head, dbb, __ATOMIC_RELEASE);
+
     return dbb;
 }
 
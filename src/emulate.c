@@ -58,6 +58,7 @@
 void initMetaState(MetaState* ms, CaptureState cs)
 {
     ms->cState = cs;
+    ms->indir = 0;
     ms->range = 0;
     ms->parDep = 0;
 }
@@ -117,7 +118,7 @@ EmuValue staticEmuValue(uint64_t v, ValType t)
 void resetEmuState(EmuState* es)
 {
     int i;
-    static Reg calleeSave[] = {
+    static const Reg calleeSave[] = {
         Reg_BP, Reg_BX, Reg_12, Reg_13, Reg_14, Reg_15, Reg_None };
 
     es->parent = 0;
@@ -132,10 +133,8 @@ void resetEmuState(EmuState* es)
         initMetaState(&(es->flag_state[i]), CS_DEAD);
     }
 
-    for(i=0; i< es->stackSize; i++)
-        es->stack[i] = 0;
-    for(i=0; i< es->stackSize; i++)
-        initMetaState(&(es->stackState[i]), CS_DEAD);
+    memset(es->stack, 0, es->stackSize);
+    memset(es->stackState, CS_DEAD, es->stackSize);
 
     // use real addresses for now
     es->stackStart = (uint64_t) es->stack;
@@ -150,6 +149,28 @@ void resetEmuState(EmuState* es)
     initMetaState(&(es->reg_state[Reg_IP]), CS_STATIC);
 
     es->depth = 0;
+    es->expectedMemCount = 0;
+    es->expectedMem = 0;
+    es->staticMemCount = 0;
+    es->staticMem = 0;
+    es->staticBudget = 0;
+    es->staticBytes = 0;
+    es->runtimePath = false;
+    es->cmpReg = Reg_None;
+}
+
+static
+void initEmuStateFields(EmuState* es)
+{
+    es->depth = 0;
+    es->expectedMemCount = 0;
+    es->expectedMem = 0;
+    es->staticMemCount = 0;
+    es->staticMem = 0;
+    es->staticBudget = 0;
+    es->staticBytes = 0;
+    es->runtimePath = false;
+    es->cmpReg = Reg_None;
 }
 
 EmuState* allocEmuState(int size)
@@ -159,7 +180,33 @@ EmuState* allocEmuState(int size)
     es = (EmuState*) malloc(sizeof(EmuState));
     es->stackSize = size;
     es->stack = (uint8_t*) malloc(size);
-    es->stackState = (MetaState*) malloc(sizeof(MetaState) * size);
+    es->stackState = (uint8_t*) malloc(size);
+
+    // return stack is allocated on first call
+    es->retStackCapacity = 0;
+    es->ret_stack = 0;
+    initEmuStateFields(es);
+
+    return es;
+}
+
+// allocate an EmuState for saving from arena <a>, with return stack for
+// call depth <depth>. Freed by resetting the arena
+static
+EmuState* allocSavedEmuState(Arena* a, int size, int depth)
+{
+    EmuState* es;
+
+    es = (EmuState*) allocArena(a, sizeof(EmuState));
+    es->stackSize = size;
+    es->stack = (uint8_t*) allocArena(a, 2 * (size_t) size);
+    es->stackState = es->stack + size;
+
+    es->retStackCapacity = depth;
+    es->ret_stack = 0;
+    if (depth > 0)
+        es->ret_stack = (uint64_t*) allocArena(a, sizeof(uint64_t) * depth);
+    initEmuStateFields(es);
 
     return es;
 }
@@ -170,10 +217,54 @@ void freeEmuState(Rewriter* r)
 
     free(r->es->stack);
     free(r->es->stackState);
+    free(r->es->ret_stack);
     free(r->es);
     r->es = 0;
 }
 
+// per stack byte: CaptureState in lower bits, indirections above
+#define STACK_CS_BITS  3
+#define STACK_CS_MASK  ((1 << STACK_CS_BITS) - 1)
+#define STACK_INDIR_MAX (255 >> STACK_CS_BITS)
+_Static_assert(CS_Max <= STACK_CS_MASK + 1, "CaptureState needs 3 bits");
+
+static
+CaptureState stackCState(EmuState* es, uint64_t off)
+{
+    return (CaptureState) (es->stackState[off] & STACK_CS_MASK);
+}
+
+// remaining indirections of a CS_STATIC2 stack byte, 0 otherwise
+static
+int stackIndir(EmuState* es, uint64_t off)
+{
+    return es->stackState[off] >> STACK_CS_BITS;
+}
+
+// set capture state of <len> stack bytes at offset <off> to <ms>.
+// Only capture state and indirections are kept per byte
+void setStackState(EmuState* es, uint64_t off, int len, MetaState* ms)
+{
+    int indir = 0;
+
+    assert(off + len <= (uint64_t) es->stackSize);
+    // saturate: limited to 31 indirections on stack
+    if (ms->cState == CS_STATIC2)
+        indir = (ms->indir > STACK_INDIR_MAX) ? STACK_INDIR_MAX : ms->indir;
+    memset(es->stackState + off, ms->cState | (indir << STACK_CS_BITS), len);
+}
+
+// capture state as compared between EmuStates
+static
+CaptureState csNormalized(CaptureState cs)
+{
+    // CS_STATIC2 is equivalent to CS_STATIC
+    if (cs == CS_STATIC2) return CS_STATIC;
+    // handle DEAD equal to DYNAMIC (no need to distinguish)
+    if (cs == CS_DEAD) return CS_DYNAMIC;
+    return cs;
+}
+
 // are the capture states of a memory resource from different EmuStates equal?
 // this is required for compatibility of generated code points, and
 // compatibility is needed to be able to jump between such code points
@@ -181,13 +272,8 @@ static
 bool csIsEqual(EmuState* es1, CaptureState s1, uint64_t v1,
                EmuState* es2, CaptureState s2, uint64_t v2)
 {
-    // normalize meta states: CS_STATIC2 is equivalent to CS_STATIC
-    if (s1 == CS_STATIC2) s1 = CS_STATIC;
-    if (s2 == CS_STATIC2) s2 = CS_STATIC;
-    // handle DEAD equal to DYNAMIC (no need to distinguish)
-    if (s1 == CS_DEAD) s1 = CS_DYNAMIC;
-    if (s2 == CS_DEAD) s2 = CS_DYNAMIC;
-
+    s1 = csNormalized(s1);
+    s2 = csNormalized(s2);
     if (s1 != s2) return false;
 
     switch(s1) {
@@ -207,6 +293,27 @@ bool csIsEqual(EmuState* es1, CaptureState s1, uint64_t v1,
     return true;
 }
 
+// are known value ranges of dynamic values equal?
+// generated code may rely on a range (e.g. for jump table bounds)
+static
+bool rangeIsEqual(MetaState* ms1, MetaState* ms2)
+{
+    if (!msIsDynamic(*ms1)) return true;
+    if ((ms1->range == 0) || (ms2->range == 0))
+        return (ms1->range == ms2->range);
+
+    assert(ms1->range->type == NT_Const);
+    assert(ms2->range->type == NT_Const);
+    return (ms1->range->ival == ms2->range->ival);
+}
+
+// remaining indirections of a CS_STATIC2 value (0: unlimited, or other)
+static
+int staticIndir(CaptureState cs, int indir)
+{
+    return (cs == CS_STATIC2) ? indir : 0;
+}
+
 // states are equal if metainformation is equal and static data is the same
 static
 bool esIsEqual(EmuState* es1, EmuState* es2)
@@ -218,6 +325,11 @@ bool esIsEqual(EmuState* es1, EmuState* es2)
         if (!csIsEqual(es1, es1->reg_state[i].cState, es1->reg[i],
                        es2, es2->reg_state[i].cState, es2->reg[i]))
             return false;
+        if (!rangeIsEqual(&(es1->reg_state[i]), &(es2->reg_state[i])))
+            return false;
+        if (staticIndir(es1->reg_state[i].cState, es1->reg_state[i].indir) !=
+            staticIndir(es2->reg_state[i].cState, es2->reg_state[i].indir))
+            return false;
     }
 
     // same state for flag registers?
@@ -230,19 +342,25 @@ bool esIsEqual(EmuState* es1, EmuState* es2)
     // for equality, must be at same call depth
     if (es1->depth != es2->depth) return false;
 
+    // same speculation on memory values?
+    if ((es1->expectedMem != es2->expectedMem) ||
+        (es1->expectedMemCount != es2->expectedMemCount)) return false;
+
     // Stack
     // all known data has to be the same
     if (es1->stackSize < es2->stackSize) {
         int diff = es2->stackSize - es1->stackSize;
         // stack of es2 is larger: bottom should not be static
         for(i = 0; i < diff; i++) {
-            if (msIsStatic(es2->stackState[i]))
+            if (csIsStatic(stackCState(es2, i)))
                 return false;
         }
         // check for equal state at byte granularity
         for(i = 0; i < es1->stackSize; i++) {
-            if (!csIsEqual(es1, es1->stackState[i].cState, es1->stack[i],
-                           es2, es2->stackState[i+diff].cState, es2->stack[i+diff]))
+            if (!csIsEqual(es1, stackCState(es1, i), es1->stack[i],
+                           es2, stackCState(es2, i+diff), es2->stack[i+diff]))
+                return false;
+            if (stackIndir(es1, i) != stackIndir(es2, i+diff))
                 return false;
         }
     }
@@ -251,13 +369,15 @@ bool esIsEqual(EmuState* es1, EmuState* es2)
         int diff = es1->stackSize - es2->stackSize;
         // bottom of es1 should not be static
         for(i = 0; i < diff; i++) {
-            if (msIsStatic(es1->stackState[i]))
+            if (csIsStatic(stackCState(es1, i)))
                 return false;
         }
         // check for equal state at byte granularity
         for(i = 0; i < es2->stackSize; i++) {
-            if (!csIsEqual(es1, es1->stackState[i+diff].cState, es1->stack[i+diff],
-                           es2, es2->stackState[i].cState, es2->stack[i]))
+            if (!csIsEqual(es1, stackCState(es1, i+diff), es1->stack[i+diff],
+                           es2, stackCState(es2, i), es2->stack[i]))
+                return false;
+            if (stackIndir(es1, i+diff) != stackIndir(es2, i))
                 return false;
         }
     }
@@ -265,6 +385,62 @@ bool esIsEqual(EmuState* es1, EmuState* es2)
     return true;
 }
 
+static
+uint64_t hashMix(uint64_t h, uint64_t v)
+{
+    return (h ^ v) * 0x100000001B3ul;
+}
+
+// hash of static content, consistent with esIsEqual: equal states get the
+// same hash. Value ranges are not covered, and only static stack bytes
+// (keyed by offset from stack top) as stack bottoms may differ in size
+static
+uint32_t hashEmuState(EmuState* es)
+{
+    uint64_t h = 0xCBF29CE484222325ul;
+    CaptureState cs;
+    int i;
+
+    for(i = Reg_AX; i <= Reg_15; i++) {
+        cs = csNormalized(es->reg_state[i].cState);
+        h = hashMix(h, cs);
+        if ((cs == CS_STATIC) || (cs == CS_STACKRELATIVE))
+            h = hashMix(h, es->reg[i]);
+        h = hashMix(h, staticIndir(es->reg_state[i].cState,
+                                   es->reg_state[i].indir));
+    }
+    for(i = 0; i < FT_Max; i++) {
+        cs = csNormalized(es->flag_state[i].cState);
+        h = hashMix(h, cs);
+        if (cs == CS_STATIC)
+            h = hashMix(h, es->flag[i]);
+    }
+    h = hashMix(h, es->depth);
+    h = hashMix(h, (uint64_t) es->expectedMem);
+    h = hashMix(h, es->expectedMemCount);
+
+    for(i = 0; i < es->stackSize; i++) {
+        if (!csIsStatic(stackCState(es, i))) continue;
+        h = hashMix(h, ((uint64_t) (es->stackSize - i) << 16) |
+                       (es->stack[i] << 8) | stackIndir(es, i));
+    }
+
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+// make sure that return stack of <es> can hold <depth> entries
+static
+void ensureRetStack(EmuState* es, int depth)
+{
+    if (depth <= es->retStackCapacity) return;
+
+    if (es->retStackCapacity == 0) es->retStackCapacity = 8;
+    while(es->retStackCapacity < depth)
+        es->retStackCapacity *= 2;
+    es->ret_stack = (uint64_t*) realloc(es->ret_stack,
+                                        sizeof(uint64_t) * es->retStackCapacity);
+}
+
 static
 void copyEmuState(EmuState* dst, EmuState* src)
 {
@@ -290,14 +466,10 @@ void copyEmuState(EmuState* dst, EmuState* src)
         int diff = dst->stackSize - src->stackSize;
 
         dst->stackStart = src->stackStart - diff;
-        for(i = 0; i < diff; i++) {
-            initMetaState(&(dst->stackState[i]), CS_DEAD);
-            dst->stack[i] = 0;
-        }
-        for(i = 0; i < src->stackSize; i++) {
-            dst->stack[i+diff] = src->stack[i];
-            dst->stackState[i+diff] = src->stackState[i];
-        }
+        memset(dst->stack, 0, diff);
+        memset(dst->stackState, CS_DEAD, diff);
+        memcpy(dst->stack + diff, src->stack, src->stackSize);
+        memcpy(dst->stackState + diff, src->stackState, src->stackSize);
     }
     else {
         // stack to restore is larger than at destination:
@@ -306,25 +478,37 @@ void copyEmuState(EmuState* dst, EmuState* src)
         assert(src->stackAccessed - src->stackStart >= diff);
 
         dst->stackStart = src->stackStart + diff;
-        for(i = 0; i < dst->stackSize; i++) {
-            dst->stack[i] = src->stack[i+diff];
-            dst->stackState[i] = src->stackState[i+diff];
-        }
+        memcpy(dst->stack, src->stack + diff, dst->stackSize);
+        memcpy(dst->stackState, src->stackState + diff, dst->stackSize);
     }
     assert(dst->stackTop == dst->stackStart + dst->stackSize);
 
+    // only copy the part of the return stack actually in use
     dst->depth = src->depth;
+    ensureRetStack(dst, src->depth);
     for(i = 0; i < src->depth; i++)
         dst->ret_stack[i] = src->ret_stack[i];
+
+    dst->expectedMemCount = src->expectedMemCount;
+    dst->expectedMem = src->expectedMem;
+    dst->staticMemCount = src->staticMemCount;
+    dst->staticMem = src->staticMem;
+    dst->staticBudget = src->staticBudget;
+    dst->staticBytes = src->staticBytes;
+    dst->runtimePath = src->runtimePath;
+
+    dst->cmpReg = src->cmpReg;
+    dst->cmpVal = src->cmpVal;
 }
 
 static
-EmuState* cloneEmuState(EmuState* src)
+EmuState* cloneEmuState(Arena* a, EmuState* src)
 {
     EmuState* dst;
 
     // allocate only stack space that was accessed in source
-    dst = allocEmuState(src->stackTop - src->stackAccessed);
+    dst = allocSavedEmuState(a, src->stackTop - src->stackAccessed,
+                             src->depth);
     copyEmuState(dst, src);
 
     // remember that we cloned dst from src
@@ -333,35 +517,181 @@ EmuState* cloneEmuState(EmuState* src)
     return dst;
 }
 
+// DEAD and DYNAMIC are handled equal when comparing states. If a value
+// is DYNAMIC in <es> but DEAD in the equal state <saved>, make it DYNAMIC
+// there: code emulated from <saved> later may read it
+static
+void mergeDeadState(EmuState* saved, EmuState* es)
+{
+    for(int i = Reg_AX; i <= Reg_15; i++) {
+        if ((saved->reg_state[i].cState == CS_DEAD) &&
+            (es->reg_state[i].cState == CS_DYNAMIC))
+            saved->reg_state[i] = es->reg_state[i];
+    }
+    for(int i = 0; i < FT_Max; i++) {
+        if ((saved->flag_state[i].cState == CS_DEAD) &&
+            (es->flag_state[i].cState == CS_DYNAMIC))
+            saved->flag_state[i] = es->flag_state[i];
+    }
+}
+
+// parallel capture: lock of hash bucket <b> of saved states. Needed for
+// comparing with (and updating) saved states of the bucket, and copying
+// from them. Lock order: capture lock before bucket lock
+static
+void lockSavedStates(Rewriter* r, int b)
+{
+    if (r->shared)
+        pthread_mutex_lock(r->savedStateLock + b);
+}
+
+static
+void unlockSavedStates(Rewriter* r, int b)
+{
+    if (r->shared)
+        pthread_mutex_unlock(r->savedStateLock + b);
+}
+
+static
+int savedStateBucket(EmuState* es)
+{
+    return es->hash & ((1 << ES_HASH_BITS) - 1);
+}
+
+// search bucket chain starting at <es> for a state equal to the current
+// one of <r>, with <hash>. Updates <last> to the last state visited
+static
+EmuState* findSavedState(Rewriter* r, EmuState* es, uint32_t hash,
+                         EmuState** last)
+{
+    for(; es; es = es->nextSaved) {
+        *last = es;
+        if (es->hash != hash) continue;
+        statsAdd(r, esCompares, 1);
+        if (esIsEqual(r->es, es)) {
+            mergeDeadState(es, r->es);
+            statsAdd(r, esHits, 1);
+            return es;
+        }
+    }
+    return 0;
+}
+
 // checks current state against already saved states, and returns an ID
-// (which is the index in the saved state list of the rewriter)
+// (which is the index in the saved state list of the rewriter).
+// Only states in the same hash bucket get compared, without capture lock
 int saveEmuState(Rewriter* r)
 {
+    Rewriter* s = sharedRewriter(r);
+    uint32_t hash = hashEmuState(r->es);
+    int b = hash & ((1 << ES_HASH_BITS) - 1);
+    EmuState *saved, *last = 0;
     int i;
 
-    printf("Saving current emulator state: ");
-    //printStaticEmuState(r->es, -1);
-    for(i = 0; i < r->savedStateCount; i++) {
-        //printf("Check ES %d\n", i);
-        //printStaticEmuState(r->savedState[i], i);
-        if (esIsEqual(r->es, r->savedState[i])) {
-            printf("already existing, esID %d\n", i);
-            return i;
-        }
+    lockSavedStates(r, b);
+    saved = findSavedState(r, s->savedStateHash[b], hash, &last);
+    unlockSavedStates(r, b);
+    if (saved) {
+        printf("Saving current emulator state: already existing, esID %d\n",
+               saved->esID);
+        return saved->esID;
+    }
+
+    // not found: saving a new state needs the capture lock. Another
+    // worker may have saved an equal state in the meantime
+    lockShared(r);
+    lockSavedStates(r, b);
+    saved = findSavedState(r, last ? last->nextSaved : s->savedStateHash[b],
+                           hash, &last);
+    if (saved) {
+        unlockSavedStates(r, b);
+        unlockShared(r);
+        printf("Saving current emulator state: already existing, esID %d\n",
+               saved->esID);
+        return saved->esID;
     }
-    printf("new with esID %d\n", i);
-    assert(i < SAVEDSTATE_MAX);
-    r->savedState[i] = cloneEmuState(r->es);
-    r->savedStateCount++;
+
+    i = s->savedStateCount;
+    statsAdd(r, esCount, 1);
+    if (i == s->savedStateCapacity) {
+        s->savedStateCapacity = i ? 2 * i : 20;
+        s->savedState = (EmuState**) realloc(s->savedState,
+                                             sizeof(EmuState*) * s->savedStateCapacity);
+    }
+    saved = cloneEmuState(s->arena, r->es);
+    // states of parallel capture workers also derive from main state
+    saved->parent = s->es;
+    saved->esID = i;
+    saved->hash = hash;
+    saved->nextSaved = 0;
+    if (last)
+        last->nextSaved = saved;
+    else
+        s->savedStateHash[b] = saved;
+    s->savedState[i] = saved;
+    s->savedStateCount++;
+    unlockSavedStates(r, b);
+    unlockShared(r);
+    printf("Saving current emulator state: new with esID %d\n", i);
 
     return i;
 }
 
 void restoreEmuState(Rewriter* r, int esID)
 {
-    assert((esID >= 0) && (esID < r->savedStateCount));
-    assert(r->savedState[esID] != 0);
-    copyEmuState(r->es, r->savedState[esID]);
+    Rewriter* s = sharedRewriter(r);
+    EmuState* saved;
+
+    lockShared(r);
+    assert((esID >= 0) && (esID < s->savedStateCount));
+    saved = s->savedState[esID];
+    unlockShared(r);
+    assert(saved != 0);
+
+    lockSavedStates(r, savedStateBucket(saved));
+    copyEmuState(r->es, saved);
+    unlockSavedStates(r, savedStateBucket(saved));
+}
+
+// continue in original code with state <es> at call depth 0: set values
+// known in <es> into registers <reg>, flags <flag>, and the real stack
+// with stack pointer <rsp> (mapped to the emulated stack pointer), including
+// the red zone of 128 bytes below
+void materializeEmuState(EmuState* es, uint64_t* reg, bool* flag, uint64_t rsp)
+{
+    uint64_t sp = es->reg[Reg_SP];
+    uint64_t low = es->stackAccessed;
+    int i, o;
+
+    assert(es->depth == 0);
+    assert(es->reg_state[Reg_SP].cState == CS_STACKRELATIVE);
+    for(i = Reg_AX; i <= Reg_15; i++) {
+        if (i == Reg_SP) continue;
+        if (msIsStatic(es->reg_state[i]))
+            reg[i] = es->reg[i];
+        else if (es->reg_state[i].cState == CS_STACKRELATIVE)
+            reg[i] = rsp + (es->reg[i] - sp);
+    }
+    for(i = 0; i < FT_Max; i++)
+        if (msIsStatic(es->flag_state[i]))
+            flag[i] = es->flag[i];
+
+    if (low < sp - 128) low = sp - 128;
+    for(o = low - es->stackStart; o < es->stackSize; o++) {
+        uint8_t* p = (uint8_t*) (rsp + (es->stackStart + o - sp));
+
+        if (csIsStatic(stackCState(es, o))) {
+            *p = es->stack[o];
+            continue;
+        }
+        // stack pointers (e.g. a saved frame pointer) are 8 bytes
+        if ((stackCState(es, o) == CS_STACKRELATIVE) &&
+            (o + 8 <= es->stackSize) &&
+            (stackCState(es, o + 7) == CS_STACKRELATIVE)) {
+            *(uint64_t*)p = rsp + (*(uint64_t*)(es->stack + o) - sp);
+            o += 7;
+        }
+    }
 }
 
 static
@@ -426,7 +756,7 @@ void printEmuState(EmuState* es)
             printf("   %016lx ", (uint64_t) (es->stackStart + o));
             for(oo = o; oo < o+8 && oo <= spMax; oo++) {
                 printf(" %s%02x %c", (oo == spOff) ? "*" : " ", es->stack[oo],
-                       captureState2Char(es->stackState[oo].cState));
+                       captureState2Char(stackCState(es, oo)));
             }
             printf("\n");
         }
@@ -447,10 +777,15 @@ void printStaticEmuState(EmuState* es, int esID)
     c = 0;
     for(i=Reg_AX; i<=Reg_15; i++) {
         if (es->reg_state[i].cState == CS_DEAD) continue;
-        if (es->reg_state[i].cState == CS_DYNAMIC) continue;
+        if ((es->reg_state[i].cState == CS_DYNAMIC) &&
+            (es->reg_state[i].range == 0)) continue;
 
         if (c>0) printf(", ");
         switch(es->reg_state[i].cState) {
+        case CS_DYNAMIC:
+            printf("%%%s (<= %d)", regName(i, OT_Reg64),
+                   es->reg_state[i].range->ival);
+            break;
         case CS_STATIC:
         case CS_STATIC2:
             printf("%%%s (0x%lx)", regName(i, OT_Reg64), es->reg[i]);
@@ -485,7 +820,7 @@ void printStaticEmuState(EmuState* es, int esID)
     cc = 0;
     c = 0;
     for(i = 0; i < es->stackSize; i++) {
-        if (!msIsStatic(es->stackState[i])) {
+        if (!csIsStatic(stackCState(es, i))) {
             c = 0;
             continue;
         }
@@ -547,6 +882,19 @@ CaptureState combineState4Flags(CaptureState s1, CaptureState s2)
     return s;
 }
 
+// indirection limit when combining <ms1> and <ms2> into a CS_STATIC2
+// value: the smaller one of the CS_STATIC2 inputs
+static
+int combineIndir(MetaState* ms1, MetaState* ms2)
+{
+    int i1 = (ms1->cState == CS_STATIC2) ? ms1->indir : 0;
+    int i2 = (ms2->cState == CS_STATIC2) ? ms2->indir : 0;
+
+    if (i1 == 0) return i2;
+    if ((i2 == 0) || (i1 < i2)) return i1;
+    return i2;
+}
+
 //---------------------------------------------------------------
 // Functions to find/allocate new (captured) basic blocks (CBBs).
 // A CBB is keyed by a function address and world state ID
@@ -561,21 +909,36 @@ void resetCapturing(Rewriter* r)
 
     r->capBBCount = 0;
     r->capInstrCount = 0;
+    r->capturedTotal = 0;
     r->currentCapBB = 0;
 
     r->capStackTop = -1;
+    r->capJTCount = 0;
+    r->loopHeaderCount = 0;
+    r->genOrderCount = 0;
+    // saved states and expressions of previous capturing are freed
     r->savedStateCount = 0;
+    memset(r->savedStateHash, 0, sizeof(EmuState*) << ES_HASH_BITS);
+    memset(r->capBBHash, 0, sizeof(CBB*) << BB_HASH_BITS);
+    resetArena(r->arena);
+    r->guardFallback = 0;
+
+    for(int i = 0; i < r->workerInstrCount; i++)
+        free(r->workerInstr[i]);
+    r->workerInstrCount = 0;
 }
 
-// return 0 if not found
+// return 0 if not found. Parallel capture workers call this without
+// holding the capture lock
 static
 CBB *findCaptureBB(Rewriter* r, uint64_t f, int esID)
 {
-    int i;
+    CBB* bb;
 
-    for(i = 0; i < r->capBBCount; i++)
-        if ((r->capBB[i].dec_addr == f) && (r->capBB[i].esID == esID))
-            return &(r->capBB[i]);
+    bb = __atomic_load_n(&(r->capBBHash[hashBB(f, esID)]), __ATOMIC_ACQUIRE);
+    for(; bb; bb = bb->nextHash)
+        if ((bb->dec_addr == f) && (bb->esID == esID))
+            return bb;
 
     return 0;
 }
@@ -583,26 +946,59 @@ CBB *findCaptureBB(Rewriter* r, uint64_t f, int esID)
 // allocate a BB structure to collect instructions for capturing
 CBB* getCaptureBB(Rewriter* r, uint64_t f, int esID)
 {
+    Rewriter* s = sharedRewriter(r);
+    CBB** head;
     CBB* bb;
 
     // already captured?
-    bb = findCaptureBB(r, f, esID);
-    if (bb) return bb;
+    bb = findCaptureBB(s, f, esID);
+    if (bb) {
+        statsAdd(r, cbbHits, 1);
+        return bb;
+    }
+
+    lockShared(r);
+    // check again: another worker may have added it meanwhile
+    bb = findCaptureBB(s, f, esID);
+    if (bb == 0) {
+        // start capturing of new BB beginning at f
+        bb = newCaptureBB(r, f, esID);
+        head = &(s->capBBHash[hashBB(f, esID)]);
+        bb->nextHash = *head;
+        __atomic_store_n(head, bb, __ATOMIC_RELEASE);
+    }
+    else
+        statsAdd(r, cbbHits, 1);
+    unlockShared(r);
+
+    return bb;
+}
+
+// allocate a new CBB without checking for an existing one with same ID.
+// CBBs not reached by emulation (e.g. guards) use esID -1
+CBB* newCaptureBB(Rewriter* r, uint64_t f, int esID)
+{
+    Rewriter* s = sharedRewriter(r);
+    CBB* bb;
 
-    // start capturing of new BB beginning at f
-    assert(r->capBBCount < r->capBBCapacity);
-    bb = &(r->capBB[r->capBBCount]);
-    r->capBBCount++;
+    lockShared(r);
+    assert(s->capBBCount < s->capBBCapacity);
+    bb = &(s->capBB[s->capBBCount]);
+    s->capBBCount++;
+    unlockShared(r);
+    statsAdd(r, cbbCount, 1);
     bb->dec_addr = f;
     bb->esID = esID;
     bb->fc = config_find_function(r, f);
 
     bb->count = 0;
     bb->instr = 0; // updated on first instruction added
+    bb->origCount = 0;
     bb->nextBranch = 0;
     bb->nextFallThrough = 0;
     bb->endType = IT_None;
     bb->preferBranch = false;
+    bb->claimed = false;
 
     bb->size = -1; // size of 0 could be valid
     bb->addr1 = 0;
@@ -610,15 +1006,23 @@ CBB* getCaptureBB(Rewriter* r, uint64_t f, int esID)
     bb->genJcc8 = false;
     bb->genJump = false;
 
+    bb->jtIndex = Reg_None;
+    bb->jtFirst = 0;
+    bb->jtCount = 0;
+    bb->jtAddr = 0;
+    bb->lazyAddr = 0;
+    bb->counter = 0;
+
     return bb;
 }
 
 char* cbb_prettyName(CBB* bb)
 {
-    static char buf[100];
+    static __thread char buf[100];
     int off;
 
-    if ((bb->fc == 0) || (bb->fc->func > bb->dec_addr))
+    if ((bb->fc == 0) || (bb->fc->name == 0) ||
+        (bb->fc->func > bb->dec_addr))
         off = sprintf(buf, "0x%lx", bb->dec_addr);
     else if (bb->fc->func == bb->dec_addr)
         off = sprintf(buf, "%s", bb->fc->name);
@@ -632,20 +1036,30 @@ char* cbb_prettyName(CBB* bb)
 
 int pushCaptureBB(Rewriter* r, CBB* bb)
 {
-    assert(r->capStackTop + 1 < CAPTURESTACK_LEN);
+    if (r->capStackTop + 1 == r->capStackCapacity) {
+        r->capStackCapacity = r->capStackCapacity ? 2 * r->capStackCapacity : 20;
+        r->capStack = (CBB**) realloc(r->capStack,
+                                      sizeof(CBB*) * r->capStackCapacity);
+    }
     r->capStackTop++;
     r->capStack[r->capStackTop] = bb;
 
     return r->capStackTop;
 }
 
-CBB* popCaptureBB(Rewriter* r)
+CBB* popCaptureBB(Rewriter* r, InstrType endType)
 {
     CBB* bb = r->currentCapBB;
     assert(r->capStack[r->capStackTop] == bb);
     r->capStackTop--;
     r->currentCapBB = 0;
 
+    // parallel capture: other workers check endType (see nextCaptureBB),
+    // the lock also publishes the captured instructions
+    lockShared(r);
+    bb->endType = endType;
+    unlockShared(r);
+
     return bb;
 }
 
@@ -677,7 +1091,12 @@ void capture(Rewriter* r, Instr* instr)
         assert(cbb->count == 0);
     }
     copyInstr(newInstr, instr);
+    newInstr->origAddr = r->capOrigAddr;
+    newInstr->cfaOffset = r->capCfaOffset;
     cbb->count++;
+    __atomic_add_fetch(&(sharedRewriter(r)->capturedTotal), 1,
+                       __ATOMIC_RELAXED);
+    statsAdd(r, instrCaptured, 1);
 }
 
 
@@ -764,7 +1183,8 @@ void setFlagsAdd(EmuState* es, EmuValue* v1, EmuValue* v2)
     d = v1->val;
     s = v2->val;
     r = d + s;
-    cc = (r & (~d | s)) | (~d & s);
+    // carry out of each bit position
+    cc = (d & s) | ((d | s) & ~r);
 
     es->flag[FT_Parity] = PARITY(r & 0xff);
     switch(v1->type) {
@@ -790,6 +1210,24 @@ void setFlagsAdd(EmuState* es, EmuValue* v1, EmuValue* v2)
     }
 }
 
+// set flags for INC/DEC of v: as for "v + 1" / "v - 1", but carry unchanged
+static
+void setFlagsIncDec(EmuState* es, EmuValue* v, bool isInc)
+{
+    bool carry = es->flag[FT_Carry];
+    MetaState carryState = es->flag_state[FT_Carry];
+    EmuValue one = *v;
+
+    one.val = 1;
+    initMetaState(&(one.state), CS_STATIC);
+    if (isInc)
+        setFlagsAdd(es, v, &one);
+    else
+        setFlagsSub(es, v, &one);
+    es->flag[FT_Carry] = carry;
+    es->flag_state[FT_Carry] = carryState;
+}
+
 // for bitwise operations: And, Xor, Or
 static
 CaptureState setFlagsBit(EmuState* es, InstrType it,
@@ -873,7 +1311,7 @@ CaptureState getStackState(EmuState* es, EmuValue* off)
         if (off->val >= (uint64_t) es->stackSize) cs = CS_DEAD;
         if (off->val < es->stackAccessed - es->stackStart) cs = CS_DEAD;
         else
-            return es->stackState[off->val].cState;
+            return stackCState(es, off->val);
     }
     return cs;
 }
@@ -903,12 +1341,14 @@ void getStackValue(EmuState* es, EmuValue* v, EmuValue* off)
     if (off->state.cState == CS_STATIC) {
         state = getStackState(es, off);
         for(i=1; i<count; i++)
-            state = combineState(state, es->stackState[off->val + i].cState, 1);
+            state = combineState(state, stackCState(es, off->val + i), 1);
     }
     else
         state = CS_DYNAMIC;
 
     initMetaState(&(v->state), state);
+    if (state == CS_STATIC2)
+        v->state.indir = stackIndir(es, off->val);
 }
 
 
@@ -917,7 +1357,7 @@ void setStackValue(EmuState* es, EmuValue* v, EmuValue* off)
 {
     uint32_t* a32;
     uint64_t* a64;
-    int i, count;
+    int count;
 
     switch(v->type) {
     case VT_32:
@@ -935,10 +1375,8 @@ void setStackValue(EmuState* es, EmuValue* v, EmuValue* off)
     default: assert(0);
     }
 
-    if (off->state.cState == CS_STATIC) {
-        for(i=0; i<count; i++)
-            es->stackState[off->val + i] = v->state;
-    }
+    if (off->state.cState == CS_STATIC)
+        setStackState(es, off->val, count, &(v->state));
 
     if (es->stackStart + off->val < es->stackAccessed)
         es->stackAccessed = es->stackStart + off->val;
@@ -952,12 +1390,62 @@ void getRegValue(EmuValue* v, EmuState* es, Reg r, ValType t)
     v->state = es->reg_state[r];
 }
 
+// on a speculated path, return the expected value overlapping
+// <size> bytes at static address <a> (0 if none)
+static
+ExpectedMem* findExpectedMem(EmuState* es, uint64_t a, int size)
+{
+    for(int i = 0; i < es->expectedMemCount; i++) {
+        ExpectedMem* em = es->expectedMem + i;
+        if ((a < em->addr + em->size) && (a + size > em->addr))
+            return em;
+    }
+    return 0;
+}
+
+// is [a, a+size) within memory declared read-only? (binary search)
+static
+bool isStaticMem(EmuState* es, uint64_t a, int size)
+{
+    int lo = 0, hi = es->staticMemCount - 1;
+
+    while(lo <= hi) {
+        int mid = (lo + hi) / 2;
+        StaticMem* sm = es->staticMem + mid;
+
+        if (a >= sm->end)
+            lo = mid + 1;
+        else if (a < sm->start)
+            hi = mid - 1;
+        else
+            return (a + size <= sm->end);
+    }
+    return false;
+}
+
+// account <size> bytes loaded as static via a CS_STATIC2 address.
+// Returns false if over budget: the load has to be dynamic
+static
+bool useStaticBudget(EmuState* es, int size)
+{
+    if ((es->staticBudget == 0) || (es->staticBytes == 0)) return true;
+
+    // parallel workers share the counter
+    if (__atomic_add_fetch(es->staticBytes, size, __ATOMIC_RELAXED) <=
+        es->staticBudget)
+        return true;
+    __atomic_sub_fetch(es->staticBytes, size, __ATOMIC_RELAXED);
+    return false;
+}
+
 static
 void getMemValue(EmuValue* v, EmuValue* addr, EmuState* es, ValType t,
                  bool shouldBeStack)
 {
     EmuValue off;
+    ExpectedMem* em;
     int isOnStack;
+    int size = (t == VT_8) ? 1 : (t == VT_32) ? 4 : 8;
 
     isOnStack = getStackOffset(es, addr, &off);
     if (isOnStack) {
@@ -967,11 +1455,44 @@ void getMemValue(EmuValue* v, EmuValue* addr, EmuState* es, ValType t,
     }
 
     assert(!shouldBeStack);
+
+    // speculation on memory value: known if fully covered
+    if ((es->expectedMemCount > 0) && msIsStatic(addr->state)) {
+        em = findExpectedMem(es, addr->val, size);
+        if (em && (addr->val >= em->addr) &&
+            (addr->val + size <= em->addr + em->size)) {
+            initMetaState(&(v->state), CS_STATIC);
+            v->type = t;
+            v->val = em->val >> (8 * (addr->val - em->addr));
+            if (size < 8)
+                v->val &= (1ul << (8 * size)) - 1;
+            return;
+        }
+    }
     initMetaState(&(v->state), CS_DYNAMIC);
-    // explicit request to make memory access result static
-    if (addr->state.cState == CS_STATIC2) v->state.cState = CS_STATIC2;
+    // explicit request to make memory access result static: with the
+    // last indirection allowed, further loads via the result are dynamic
+    if ((addr->state.cState == CS_STATIC2) && useStaticBudget(es, size)) {
+        if (addr->state.indir == 1)
+            v->state.cState = CS_STATIC;
+        else {
+            v->state.cState = CS_STATIC2;
+            if (addr->state.indir > 1)
+                v->state.indir = addr->state.indir - 1;
+        }
+    }
+    // declared read-only memory
+    else if (msIsStatic(addr->state) && isStaticMem(es, addr->val, size))
+        v->state.cState = CS_STATIC;
 
     v->type = t;
+    // a dynamic address may be invalid on paths not taken at runtime (e.g.
+    // a null pointer at the end of a list): the loaded value is dynamic
+    if (!msIsStatic(addr->state) && !es->runtimePath) {
+        assert(!msIsStatic(v->state));
+        v->val = 0;
+        return;
+    }
     switch(t) {
     case VT_8:  v->val = *(uint8_t*) addr->val; break;
     case VT_32: v->val = *(uint32_t*) addr->val; break;
@@ -1043,6 +1564,13 @@ void setMemValue(EmuValue* v, EmuValue* addr, EmuState* es, ValType t,
 
     assert(!shouldBeStack);
 
+    // writing memory with expected value: end speculation on memory
+    if ((es->expectedMemCount > 0) && msIsStatic(addr->state) &&
+        findExpectedMem(es, addr->val, (t == VT_32) ? 4 : 8)) {
+        es->expectedMemCount = 0;
+        es->expectedMem = 0;
+    }
+
     switch(t) {
     case VT_32:
         a32 = (uint32_t*) addr->val;
@@ -1064,6 +1592,7 @@ void addRegToValue(EmuValue* v, EmuState* es, Reg r, int scale)
 {
     if (r == Reg_None) return;
 
+    v->state.indir = combineIndir(&(v->state), &(es->reg_state[r]));
     v->state.cState = combineState(v->state.cState,
                                    es->reg_state[r].cState, 0);
     v->val += scale * es->reg[r];
@@ -1210,6 +1739,63 @@ void applyStaticToInd(Operand* o, EmuState* es)
 
 // capture processing for instruction types
 
+// capture a data movement. There is no store of an immediate not fitting
+// into sign-extended 32bit: use two stores of 32bit halves instead
+static
+void captureStore(Rewriter* r, Instr* i)
+{
+    Operand dst, imm;
+    uint64_t v = i->src.val;
+
+    if (!opIsInd(&(i->dst)) || (i->src.type != OT_Imm64) ||
+        ((int64_t) v == (int64_t) (int32_t) v)) {
+        capture(r, i);
+        return;
+    }
+
+    dst = i->dst;
+    dst.type = OT_Ind32;
+    imm.type = OT_Imm32;
+    imm.val = (uint32_t) v;
+    initBinaryInstr(i, IT_MOV, VT_32, &dst, &imm);
+    capture(r, i);
+    dst.val += 4;
+    imm.val = (uint32_t) (v >> 32);
+    initBinaryInstr(i, IT_MOV, VT_32, &dst, &imm);
+    capture(r, i);
+}
+
+// is <o> a memory operand not on the stack?
+static
+bool isNonStackMem(EmuState* es, Operand* o)
+{
+    EmuValue addr, off;
+
+    if (!opIsInd(o) || (o->seg != OSO_None)) return false;
+    getOpAddr(&addr, es, o);
+    return !getStackOffset(es, &addr, &off);
+}
+
+// operand to use for static source value <v> from <src>: an immediate,
+// or <src> itself if the value needs 64bit (no such encoding). Then,
+// registers and stack get updated; other memory still holds the value
+static
+Operand* getStaticSrcOp(Rewriter* r, EmuState* es, Operand* src, EmuValue* v)
+{
+    Operand* o = getImmOp(v->type, v->val);
+    Instr i;
+
+    if ((o->type != OT_Imm64) || ((int64_t) v->val == (int32_t) v->val))
+        return o;
+
+    if (!isNonStackMem(es, src)) {
+        initBinaryInstr(&i, IT_MOV, v->type, src, o);
+        applyStaticToInd(&(i.dst), es);
+        captureStore(r, &i);
+    }
+    return src;
+}
+
 // both MOV and MOVSX (sign extend 32->64)
 static
 void captureMov(Rewriter* r, Instr* orig, EmuState* es, EmuValue* res)
@@ -1232,13 +1818,14 @@ void captureMov(Rewriter* r, Instr* orig, EmuState* es, EmuValue* res)
     initBinaryInstr(&i, orig->type, orig->vtype, &(orig->dst), o);
     applyStaticToInd(&(i.dst), es);
     applyStaticToInd(&(i.src), es);
-    capture(r, &i);
+    captureStore(r, &i);
 }
 
 static
 void captureCMov(Rewriter* r, Instr* orig, EmuState* es,
                  EmuValue* res, MetaState cState, bool cond)
 {
+    EmuValue v;
     Instr i;
 
     // data movement from orig->src to orig->dst, value is res
@@ -1254,22 +1841,38 @@ void captureCMov(Rewriter* r, Instr* orig, EmuState* es,
                             &(orig->dst), &(orig->src));
             captureMov(r, &i, es, res);
         }
+        else if (opValType(&(orig->dst)) == VT_32) {
+            // no move, but 32bit destination register is zero-extended
+            getOpValue(&v, es, &(orig->dst));
+            if (!msIsStatic(v.state)) {
+                initBinaryInstr(&i, IT_MOV, VT_32,
+                                &(orig->dst), &(orig->dst));
+                capture(r, &i);
+            }
+        }
         return;
     }
     // condition state is unknown
 
     if (res->state.cState == CS_DEAD) return;
 
-    if (msIsStatic(res->state)) {
+    if (msIsStatic(res->state) && !isNonStackMem(es, &(orig->src))) {
         // we need to be prepared that there may be a move happening
         // need to update source with known value as it may be moved
         initBinaryInstr(&i, IT_MOV, res->type,
                         &(orig->src), getImmOp(res->type, res->val));
-        applyStaticToInd(&(i.src), es);
+        applyStaticToInd(&(i.dst), es);
         capture(r, &i);
+    }
+    // resulting value becomes unknown, even if source was static
+    initMetaState(&(res->state), CS_DYNAMIC);
 
-        // resulting value becomes unknown, even if source was static
-        initMetaState(&(res->state), CS_DYNAMIC);
+    // destination keeps its value if there is no move: update if static
+    getOpValue(&v, es, &(orig->dst));
+    if (msIsStatic(v.state)) {
+        initBinaryInstr(&i, IT_MOV, v.type,
+                        &(orig->dst), getImmOp(v.type, v.val));
+        capture(r, &i);
     }
     initBinaryInstr(&i, orig->type, orig->vtype, &(orig->dst), &(orig->src));
     applyStaticToInd(&(i.src), es);
@@ -1324,11 +1927,14 @@ void captureBinaryOp(Rewriter* r, Instr* orig, EmuState* es, EmuValue* res)
     Instr i;
     Operand *o;
 
+    // result is not bound any longer by a previous range check
+    res->state.range = 0;
+
     if (res->state.cState == CS_DEAD) return;
 
     if (msIsStatic(res->state)) {
         // force results to become unknown?
-        if (r->cc->force_unknown[es->depth]) {
+        if (config_force_unknown(r, es->depth)) {
             initMetaState(&(res->state), CS_DYNAMIC);
         }
         else {
@@ -1339,7 +1945,7 @@ void captureBinaryOp(Rewriter* r, Instr* orig, EmuState* es, EmuValue* res)
         initBinaryInstr(&i, IT_MOV, res->type,
                         &(orig->dst), getImmOp(res->type, res->val));
         applyStaticToInd(&(i.dst), es);
-        capture(r, &i);
+        captureStore(r, &i);
         return;
     }
 
@@ -1348,11 +1954,10 @@ void captureBinaryOp(Rewriter* r, Instr* orig, EmuState* es, EmuValue* res)
     getOpValue(&opval, es, &(orig->dst));
     if (keepsCaptureState(es, &(orig->dst)) && msIsStatic(opval.state)) {
 
-        // - instead of adding src to 0, we can move the src to dst
-        // - instead of multiply src with 1, move
+        // - instead of multiply src with 1, move (flags are static then)
+        // - adding to 0 cannot be replaced: ZF/SF/PF depend on src
         // TODO: mulitply with 0: here too late, state of result gets static
-        if (((orig->type == IT_ADD) && (opval.val == 0)) ||
-            ((orig->type == IT_IMUL) && (opval.val == 1))) {
+        if ((orig->type == IT_IMUL) && (opval.val == 1)) {
             initBinaryInstr(&i, IT_MOV, opval.type,
                             &(orig->dst), &(orig->src));
             applyStaticToInd(&(i.dst), es);
@@ -1371,15 +1976,20 @@ void captureBinaryOp(Rewriter* r, Instr* orig, EmuState* es, EmuValue* res)
     if (msIsStatic(opval.state)) {
         // if 1st source (=src) is known/constant and a reg, make it immediate
 
-        if (((orig->type == IT_ADD) && (opval.val == 0)) ||
-            ((orig->type == IT_SHL) && (opval.val == 0)) ||
+        if (((orig->type == IT_SHL) && (opval.val == 0)) ||
             ((orig->type == IT_SHR) && (opval.val == 0)) ||
             ((orig->type == IT_SAR) && (opval.val == 0)) ||
             ((orig->type == IT_IMUL) && (opval.val == 1))) {
-            // adding 0 / multiplying with 1 changes nothing...
+            // shifting by 0 / multiplying with 1 changes nothing...
+            // ...apart from zero-extending a 32bit destination register
+            if (orig->dst.type == OT_Reg32) {
+                initBinaryInstr(&i, IT_MOV, VT_32,
+                                &(orig->dst), &(orig->dst));
+                capture(r, &i);
+            }
             return;
         }
-        o = getImmOp(opval.type, opval.val);
+        o = getStaticSrcOp(r, es, &(orig->src), &opval);
     }
     initBinaryInstr(&i, orig->type, res->type, &(orig->dst), o);
     applyStaticToInd(&(i.dst), es);
@@ -1393,6 +2003,9 @@ void captureUnaryOp(Rewriter* r, Instr* orig, EmuState* es, EmuValue* res)
 {
     Instr i;
 
+    // result is not bound any longer by a previous range check
+    res->state.range = 0;
+
     if (msIsStatic(res->state)) return;
 
     initUnaryInstr(&i, orig->type, &(orig->dst));
@@ -1407,7 +2020,7 @@ void captureLea(Rewriter* r, Instr* orig, EmuState* es, EmuValue* res)
 
     assert(opIsReg(&(orig->dst)));
     if (msIsStatic(res->state)) {
-        if (r->cc->force_unknown[es->depth]) {
+        if (config_force_unknown(r, es->depth)) {
             // force results to become unknown => load value into dest
 
             initMetaState(&(res->state), CS_DYNAMIC);
@@ -1419,6 +2032,21 @@ void captureLea(Rewriter* r, Instr* orig, EmuState* es, EmuValue* res)
     }
     initBinaryInstr(&i, IT_LEA, orig->vtype, &(orig->dst), &(orig->src));
     applyStaticToInd(&(i.src), es);
+    if ((int64_t) i.src.val != (int32_t) i.src.val) {
+        // displacement too large: load static registers with values instead
+        Reg reg[2] = { orig->src.reg, orig->src.ireg };
+        Instr ri;
+
+        for(int j = 0; j < 2; j++) {
+            if ((reg[j] == Reg_None) || ((j == 1) && (orig->src.scale == 0)))
+                continue;
+            if (!msIsStatic(es->reg_state[reg[j]])) continue;
+            initBinaryInstr(&ri, IT_MOV, VT_64, getRegOp(VT_64, reg[j]),
+                            getImmOp(VT_64, es->reg[reg[j]]));
+            capture(r, &ri);
+        }
+        initBinaryInstr(&i, IT_LEA, orig->vtype, &(orig->dst), &(orig->src));
+    }
     capture(r, &i);
 }
 
@@ -1432,8 +2060,9 @@ void captureCmp(Rewriter* r, Instr* orig, EmuState* es, CaptureState cs)
     if (csIsStatic(cs)) return;
 
     getOpValue(&opval, es, &(orig->dst));
-    if (msIsStatic(opval.state)) {
-        // cannot replace dst with imm: no such encoding => update dst
+    if (msIsStatic(opval.state) && !isNonStackMem(es, &(orig->dst))) {
+        // cannot replace dst with imm: no such encoding => update dst.
+        // Memory apart from stack still holds the static value
         initBinaryInstr(&i, IT_MOV, opval.type,
                         &(orig->dst), getImmOp(opval.type, opval.val));
         capture(r, &i);
@@ -1442,7 +2071,7 @@ void captureCmp(Rewriter* r, Instr* orig, EmuState* es, CaptureState cs)
     o = &(orig->src);
     getOpValue(&opval, es, &(orig->src));
     if (msIsStatic(opval.state))
-        o = getImmOp(opval.type, opval.val);
+        o = getStaticSrcOp(r, es, &(orig->src), &opval);
 
     initBinaryInstr(&i, IT_CMP, orig->vtype, &(orig->dst), o);
     applyStaticToInd(&(i.dst), es);
@@ -1453,10 +2082,23 @@ void captureCmp(Rewriter* r, Instr* orig, EmuState* es, CaptureState cs)
 static
 void captureTest(Rewriter* r, Instr* orig, EmuState* es, CaptureState cs)
 {
+    EmuValue opval;
     Instr i;
+    Operand* o[2] = { &(orig->dst), &(orig->src) };
 
     if (csIsStatic(cs)) return;
 
+    // no immediate with 'test r/m,r': update static registers and stack
+    for(int j = 0; j < 2; j++) {
+        getOpValue(&opval, es, o[j]);
+        if (msIsStatic(opval.state) && !isNonStackMem(es, o[j])) {
+            initBinaryInstr(&i, IT_MOV, opval.type,
+                            o[j], getImmOp(opval.type, opval.val));
+            applyStaticToInd(&(i.dst), es);
+            captureStore(r, &i);
+        }
+    }
+
     initBinaryInstr(&i, IT_TEST, orig->vtype, &(orig->dst), &(orig->src));
     applyStaticToInd(&(i.dst), es);
     applyStaticToInd(&(i.src), es);
@@ -1545,6 +2187,42 @@ void capturePassThrough(Rewriter* r, Instr* orig, EmuState* es)
     capture(r, &i);
 }
 
+// maximal number of entries for jump tables we capture
+#define JUMPTABLE_MAX 1024
+
+// if the conditional jump <it> checks an unsigned upper bound for the
+// register compared just before, return the bound and on which path it holds
+static
+bool getJccBound(EmuState* es, InstrType it,
+                 uint64_t* bound, bool* onBranch)
+{
+    if (es->cmpReg == Reg_None) return false;
+
+    switch(it) {
+    case IT_JA:  // not taken: reg <= val
+        *bound = es->cmpVal;
+        *onBranch = false;
+        break;
+    case IT_JBE: // taken: reg <= val
+        *bound = es->cmpVal;
+        *onBranch = true;
+        break;
+    case IT_JC:  // taken: reg < val
+        if (es->cmpVal == 0) return false;
+        *bound = es->cmpVal - 1;
+        *onBranch = true;
+        break;
+    case IT_JNC: // not taken: reg < val
+        if (es->cmpVal == 0) return false;
+        *bound = es->cmpVal - 1;
+        *onBranch = false;
+        break;
+    default:
+        return false;
+    }
+    return (*bound < JUMPTABLE_MAX);
+}
+
 // this ends a captured BB, queuing new paths to be traced
 static
 void captureJcc(Rewriter* r, InstrType it,
@@ -1552,29 +2230,50 @@ void captureJcc(Rewriter* r, InstrType it,
                 bool didBranch)
 {
     CBB *cbb, *cbbBR, *cbbFT;
-    int esID;
+    EmuState* es = r->es;
+    int esID, esIDBR, esIDFT;
+    uint64_t bound;
+    bool boundOnBranch, lazy;
 
     // do not end BB and assume jump fixed?
     if (r->cc->branches_known) return;
 
-    cbb = popCaptureBB(r);
-    cbb->endType = it;
+    cbb = popCaptureBB(r, it);
     // use observed behavior from trace as hint for code generation
     cbb->preferBranch = didBranch;
 
     esID = saveEmuState(r);
-    cbbFT = getCaptureBB(r, fallthroughTarget, esID);
-    cbbBR = getCaptureBB(r, branchTarget, esID);
+    esIDBR = esID;
+    esIDFT = esID;
+    if (getJccBound(es, it, &bound, &boundOnBranch)) {
+        // on one path, the value range of the compared register is known
+        // (we may use it later as index into a jump table)
+        lockShared(r);
+        es->reg_state[es->cmpReg].range = expr_newConst(sharedRewriter(r)->arena, (int) bound);
+        unlockShared(r);
+        if (boundOnBranch)
+            esIDBR = saveEmuState(r);
+        else
+            esIDFT = saveEmuState(r);
+    }
+    cbbFT = getCaptureBB(r, fallthroughTarget, esIDFT);
+    cbbBR = getCaptureBB(r, branchTarget, esIDBR);
     cbb->nextFallThrough = cbbFT;
     cbb->nextBranch = cbbBR;
 
-    // entry pushed last will be processed first
+    // entry pushed last will be processed first.
+    // with lazy capturing, the path not taken stays a stub for now. Only
+    // outside of inlined calls: a stub may need to continue in original
+    // code, without return addresses pushed (see lazyCompile)
+    lazy = r->cc->lazyCapture && (es->depth == 0);
     if (didBranch) {
-        pushCaptureBB(r, cbbFT);
+        if (!lazy)
+            pushCaptureBB(r, cbbFT);
         pushCaptureBB(r, cbbBR);
     }
     else {
-        pushCaptureBB(r, cbbBR);
+        if (!lazy)
+            pushCaptureBB(r, cbbBR);
         pushCaptureBB(r, cbbFT);
     }
     // current CBB should be closed.
@@ -1582,6 +2281,373 @@ void captureJcc(Rewriter* r, InstrType it,
     assert(r->currentCapBB == 0);
 }
 
+// indirect jump via jump table with dynamic index: if the range of the
+// index is known from a previous bound check, this ends a captured BB
+// with all table entries as targets. Returns the target to continue with,
+// or 0 if not applicable
+static
+uint64_t captureJumpTable(Rewriter* r, Instr* orig, EmuState* es)
+{
+    Operand* o = &(orig->dst);
+    MetaState* ms;
+    uint64_t* table;
+    Operand idx;
+    Instr i;
+    Rewriter* s;
+    CBB *cbb, *target;
+    int esID, k, count;
+
+    // only for "jmp *table(,%idx,8)" with known table address
+    if ((o->seg != OSO_None) || (o->scale != 8)) return 0;
+    if ((o->reg != Reg_None) && !msIsStatic(es->reg_state[o->reg]))
+        return 0;
+    ms = &(es->reg_state[o->ireg]);
+    if (!msIsDynamic(*ms) || (ms->range == 0)) return 0;
+
+    table = (uint64_t*) (o->val + ((o->reg != Reg_None) ? es->reg[o->reg] : 0));
+    count = ms->range->ival + 1;
+
+    // lazy capturing at runtime: too many targets for capacities left
+    if (!captureCapacityLeft(r, count)) {
+        captureDefer(r, orig->addr);
+        return orig->addr;
+    }
+
+    // the bound may only be checked for the lower 32 bits of the index:
+    // clear upper bits if not done by the last captured instruction
+    cbb = r->currentCapBB;
+    setRegOp(&idx, VT_32, o->ireg);
+    if ((cbb->count == 0) ||
+        ((cbb->instr[cbb->count - 1].type != IT_MOV) &&
+         (cbb->instr[cbb->count - 1].type != IT_LEA)) ||
+        !opIsEqual(&(cbb->instr[cbb->count - 1].dst), &idx)) {
+        initBinaryInstr(&i, IT_MOV, VT_32, &idx, &idx);
+        capture(r, &i);
+    }
+
+    cbb = popCaptureBB(r, IT_JMPI);
+    cbb->jtIndex = o->ireg;
+    cbb->jtCount = count;
+
+    // all targets are traced with same state, the index still being dynamic
+    esID = saveEmuState(r);
+    lockShared(r);
+    s = sharedRewriter(r);
+    cbb->jtFirst = s->capJTCount;
+    if (s->capJTCount + count > s->capJTCapacity) {
+        while(s->capJTCount + count > s->capJTCapacity)
+            s->capJTCapacity = s->capJTCapacity ? 2 * s->capJTCapacity : 64;
+        s->capJT = (CBB**) realloc(s->capJT, sizeof(CBB*) * s->capJTCapacity);
+    }
+    s->capJTCount += count;
+    for(k = count - 1; k >= 0; k--) {
+        target = getCaptureBB(r, table[k], esID);
+        s->capJT[cbb->jtFirst + k] = target;
+        pushCaptureBB(r, target);
+    }
+    unlockShared(r);
+    assert(r->currentCapBB == 0);
+
+    return table[0];
+}
+
+// Lazy capturing at runtime (see lazyCompile) must not run out of
+// capacities. Paths get stopped early instead, leaving stubs for CBBs not
+// captured. Margins are for instructions of one decoded BB
+#define CAPLIMIT_INSTRS 200
+
+bool captureCapacityLeft(Rewriter* r, int bbs)
+{
+    if (!r->capLimited) return true;
+    // no stubs within inlined calls (see captureJcc)
+    if (r->es->depth > 0) return true;
+
+    return (r->capBBCount + bbs + 2 <= r->capBBCapacity) &&
+           (r->capInstrCount + CAPLIMIT_INSTRS <= r->capInstrCapacity) &&
+           (r->decBBCount + 1 < r->decBBCapacity) &&
+           (r->decInstrCount + CAPLIMIT_INSTRS <= r->decInstrCapacity);
+}
+
+// the new CBB gets the current state. An empty current CBB starting at
+// <addr> is left uncaptured itself: it will be captured with its own state
+void captureDefer(Rewriter* r, uint64_t addr)
+{
+    CBB *cbb = r->currentCapBB;
+    int esID;
+
+    if ((cbb->count == 0) && (cbb->dec_addr == addr)) {
+        assert(r->capStack[r->capStackTop] == cbb);
+        r->capStackTop--;
+        r->currentCapBB = 0;
+        return;
+    }
+    esID = saveEmuState(r);
+    cbb = popCaptureBB(r, IT_JMP);
+    cbb->nextFallThrough = getCaptureBB(r, addr, esID);
+}
+
+// controlled loop unrolling (see dbrew_config_unroll)
+
+// return loop header candidate at <addr>, 0 if none
+static
+LoopHeader* findLoopHeader(Rewriter* r, uint64_t addr)
+{
+    for(int i = 0; i < r->loopHeaderCount; i++)
+        if (r->loopHeader[i].addr == addr)
+            return r->loopHeader + i;
+
+    return 0;
+}
+
+static
+LoopHeader* getLoopHeader(Rewriter* r, uint64_t addr)
+{
+    LoopHeader* lh = findLoopHeader(r, addr);
+
+    if (lh) return lh;
+
+    if (r->loopHeaderCount == r->loopHeaderCapacity) {
+        r->loopHeaderCapacity = r->loopHeaderCapacity ?
+                                    2 * r->loopHeaderCapacity : 20;
+        r->loopHeader = (LoopHeader*) realloc(r->loopHeader,
+                                sizeof(LoopHeader) * r->loopHeaderCapacity);
+    }
+    lh = r->loopHeader + r->loopHeaderCount;
+    r->loopHeaderCount++;
+    lh->addr = addr;
+    lh->visits = 0;
+    lh->esID = -1;
+    lh->capturedStart = 0;
+
+    return lh;
+}
+
+// are <es1> and <es2> in the same call frame (i.e. at same call depth,
+// coming from same call sites)?
+static
+bool esIsSameFrame(EmuState* es1, EmuState* es2)
+{
+    if (es1->depth != es2->depth) return false;
+    for(int i = 0; i < es1->depth; i++)
+        if (es1->ret_stack[i] != es2->ret_stack[i]) return false;
+
+    return true;
+}
+
+// are flags overwritten before being read in the decoded BB at <addr>?
+static
+bool flagsDeadAt(Rewriter* r, uint64_t addr)
+{
+    DBB* dbb = dbrew_decode(r, addr);
+
+    for(int i = 0; i < dbb->count; i++) {
+        InstrType it = dbb->instr[i].type;
+
+        switch(it) {
+        case IT_ADD: case IT_SUB: case IT_CMP: case IT_TEST:
+        case IT_AND: case IT_OR: case IT_XOR:
+            return true;
+
+        case IT_MOV: case IT_MOVSX: case IT_MOVZX: case IT_LEA:
+        case IT_NOP: case IT_PUSH: case IT_POP:
+            continue;
+
+        default:
+            // conservative for any other instruction
+            return false;
+        }
+    }
+    return false;
+}
+
+// make static values of <es> dynamic which are static in <prev>, too,
+// but with a different value, by loading them into registers/stack.
+// Differing flags only are allowed if <flagsDead>.
+// Only checks with <doCapture> false.
+// Returns number of values changed, or -1 if this is not possible
+static
+int generalizeState(Rewriter* r, EmuState* es, EmuState* prev,
+                    bool flagsDead, bool doCapture)
+{
+    Instr i;
+    Operand o;
+    int count = 0, size;
+
+    for(Reg reg = Reg_AX; reg <= Reg_15; reg++) {
+        MetaState* ms = &(es->reg_state[reg]);
+        MetaState* msPrev = &(prev->reg_state[reg]);
+
+        if ((ms->cState == CS_STACKRELATIVE) ||
+            (msPrev->cState == CS_STACKRELATIVE)) {
+            // stack has to be at same position
+            if ((ms->cState != msPrev->cState) ||
+                (es->reg[reg] != prev->reg[reg]))
+                return -1;
+            continue;
+        }
+        if (!msIsStatic(*ms) || !msIsStatic(*msPrev)) continue;
+        if (es->reg[reg] == prev->reg[reg]) continue;
+
+        count++;
+        if (!doCapture) continue;
+        setRegOp(&o, VT_64, reg);
+        initBinaryInstr(&i, IT_MOV, VT_64, &o, getImmOp(VT_64, es->reg[reg]));
+        capture(r, &i);
+        initMetaState(ms, CS_DYNAMIC);
+    }
+
+    // we cannot load flags, but do not need to if they are dead
+    for(int f = 0; f < FT_Max; f++) {
+        if (!msIsStatic(es->flag_state[f]) ||
+            !msIsStatic(prev->flag_state[f])) continue;
+        if (es->flag[f] == prev->flag[f]) continue;
+        if (!flagsDead) return -1;
+
+        if (doCapture)
+            initMetaState(&(es->flag_state[f]), CS_DEAD);
+    }
+
+    // stack: in aligned 4-byte chunks, starting from top
+    size = (es->stackSize < prev->stackSize) ? es->stackSize : prev->stackSize;
+    for(int off = 4; off <= size; off += 4) {
+        uint8_t* v = es->stack + es->stackSize - off;
+        uint8_t* vPrev = prev->stack + prev->stackSize - off;
+        int so = es->stackSize - off, soPrev = prev->stackSize - off;
+        bool changed = false;
+
+        for(int b = 0; b < 4; b++) {
+            if (csIsStatic(stackCState(es, so + b)) &&
+                csIsStatic(stackCState(prev, soPrev + b)) &&
+                (v[b] != vPrev[b]))
+                changed = true;
+        }
+        if (!changed) continue;
+        // whole chunk is loaded
+        for(int b = 0; b < 4; b++)
+            if (!csIsStatic(stackCState(es, so + b))) return -1;
+
+        count++;
+        if (!doCapture) continue;
+        o.type = OT_Ind32;
+        o.reg = Reg_SP;
+        o.ireg = Reg_None;
+        o.scale = 0;
+        o.val = es->stackTop - off - es->reg[Reg_SP];
+        o.seg = OSO_None;
+        initBinaryInstr(&i, IT_MOV, VT_32, &o,
+                        getImmOp(VT_32, *(uint32_t*)v));
+        capture(r, &i);
+        memset(es->stackState + so, CS_DYNAMIC, 4);
+    }
+
+    return count;
+}
+
+// called when starting to emulate the decoded BB at <addr>.
+// If reached again within the same call frame with changed static values
+// often enough (a loop header), these values are made dynamic and the
+// current CBB ends with a jump to a CBB at <addr> with the generalized
+// state. Return true in this case: a new CBB has to be opened
+static
+bool checkLoopHeader(Rewriter* r, uint64_t addr)
+{
+    CaptureConfig* cc = r->cc;
+    Rewriter* s = sharedRewriter(r);
+    LoopHeader* lh;
+    EmuState* prev;
+    CBB *cbb, *next;
+    int esID, prevID;
+    long codeSize;
+    bool overBudget, flagsDead;
+
+    // only targets of backward branches are candidates
+    lh = findLoopHeader(s, addr);
+    if (lh == 0) return false;
+
+    esID = saveEmuState(r);
+    prevID = lh->esID;
+    lh->esID = esID;
+    lh->visits++;
+    if (prevID < 0) return false;
+    if (!esIsSameFrame(r->es, s->savedState[prevID])) {
+        lh->visits = 1;
+        lh->capturedStart = capturedCount(r);
+        return false;
+    }
+    if (esID == prevID) return false;
+
+    // budget: upper bound of code size for this loop since its first
+    // visit, captured by all workers
+    codeSize = (long) (capturedCount(r) - lh->capturedStart) *
+               instrCodeBound(r);
+    overBudget = (cc->unrollBudget > 0) && (codeSize > cc->unrollBudget);
+    if ((lh->visits <= cc->unrollFactor) && !overBudget) return false;
+
+    prev = s->savedState[prevID];
+    flagsDead = flagsDeadAt(r, addr);
+    // saved states in the same bucket may get updated by other workers
+    lockSavedStates(r, savedStateBucket(prev));
+    if (generalizeState(r, r->es, prev, flagsDead, false) <= 0) {
+        unlockSavedStates(r, savedStateBucket(prev));
+        return false;
+    }
+
+    if (r->showEmuSteps)
+        printf("Rolling loop at 0x%lx after %d visits\n", addr, lh->visits);
+
+    generalizeState(r, r->es, prev, flagsDead, true);
+    unlockSavedStates(r, savedStateBucket(prev));
+    esID = saveEmuState(r);
+    lh->esID = esID;
+
+    cbb = popCaptureBB(r, IT_JMP);
+    next = getCaptureBB(r, addr, esID);
+    cbb->nextFallThrough = next;
+    pushCaptureBB(r, next);
+
+    return true;
+}
+
+// if decoded BB <dbb> ends with a direct backward branch, its target is
+// a loop header candidate. The header was visited once before already
+void noteLoopHeader(Rewriter* r, DBB* dbb)
+{
+    Instr* instr;
+    LoopHeader* lh;
+
+    if ((r->cc == 0) || (r->cc->unrollFactor == 0)) return;
+    if (dbb->count == 0) return;
+
+    instr = dbb->instr + dbb->count - 1;
+    if ((instr->type != IT_JMP) && !instrIsJcc(instr->type)) return;
+    if ((instr->dst.type != OT_Imm64) || (instr->dst.val > instr->addr))
+        return;
+
+    lockShared(r);
+    lh = getLoopHeader(sharedRewriter(r), instr->dst.val);
+    if (lh->visits == 0) {
+        // the first iteration is being captured
+        lh->visits = 1;
+        lh->capturedStart = capturedCount(r);
+    }
+    unlockShared(r);
+}
+
+bool captureLoopHeader(Rewriter* r, uint64_t addr)
+{
+    bool res;
+
+    if ((r->cc == 0) || (r->cc->unrollFactor == 0)) return false;
+    if (r->currentCapBB == 0) return false;
+
+    // loop headers are shared between parallel capture workers
+    lockShared(r);
+    res = checkLoopHeader(r, addr);
+    unlockShared(r);
+
+    return res;
+}
+
 
 //----------------------------------------------------------
 // Emulator for instruction types
@@ -1594,6 +2660,11 @@ uint64_t emulateInstr(Rewriter* r, EmuState* es, Instr* instr)
     EmuValue vres, v1, v2, addr;
     CaptureState cs;
     ValType vt;
+    int indir;
+
+    // bound information from a compare only valid for a directly following Jcc
+    if (!instrIsJcc(instr->type))
+        es->cmpReg = Reg_None;
 
     if (instr->ptLen > 0) {
         // memory addressing in captured instructions depends on emu state
@@ -1631,7 +2702,9 @@ uint64_t emulateInstr(Rewriter* r, EmuState* es, Instr* instr)
         }
 
         cs = combineState(v1.state.cState, v2.state.cState, 0);
+        indir = combineIndir(&(v1.state), &(v2.state));
         initMetaState(&(v1.state), cs);
+        v1.state.indir = indir;
         // for capture we need state of original dst, do it before setting dst
         captureBinaryOp(r, instr, es, &v1);
         setOpValue(&v1, es, &(instr->dst));
@@ -1640,7 +2713,6 @@ uint64_t emulateInstr(Rewriter* r, EmuState* es, Instr* instr)
     case IT_CALL:
         // TODO: keep call. For now, we always inline
         getOpValue(&v1, es, &(instr->dst));
-        assert(es->depth < MAX_CALLDEPTH);
         assert(msIsStatic(v1.state)); // call target must be known
 
         // push address of instruction after CALL onto stack
@@ -1651,6 +2723,7 @@ uint64_t emulateInstr(Rewriter* r, EmuState* es, Instr* instr)
         v2.val = instr->addr + instr->len;
         setMemValue(&v2, &addr, es, VT_64, 1);
 
+        ensureRetStack(es, es->depth + 1);
         es->ret_stack[es->depth++] = v2.val;
 
         if (r->addInliningHints) {
@@ -1679,7 +2752,7 @@ uint64_t emulateInstr(Rewriter* r, EmuState* es, Instr* instr)
     case IT_CLTQ:
         switch(instr->vtype) {
         case VT_32:
-            es->reg[Reg_AX] = (int32_t) (int16_t) es->reg[Reg_AX];
+            es->reg[Reg_AX] = (uint32_t) (int32_t) (int16_t) es->reg[Reg_AX];
             break;
         case VT_64:
             es->reg[Reg_AX] = (int64_t) (int32_t) es->reg[Reg_AX];
@@ -1694,11 +2767,11 @@ uint64_t emulateInstr(Rewriter* r, EmuState* es, Instr* instr)
         switch(instr->vtype) {
         case VT_64:
             // sign-extend eax to edx:eax
-            es->reg[Reg_DX] = (es->reg[Reg_AX] & (1<<30)) ? ((uint32_t)-1) : 0;
+            es->reg[Reg_DX] = (es->reg[Reg_AX] & (1u<<31)) ? ((uint32_t)-1) : 0;
             break;
         case VT_128:
             // sign-extend rax to rdx:rax
-            es->reg[Reg_DX] = (es->reg[Reg_AX] & (1ul<<62)) ? ((uint64_t)-1) : 0;
+            es->reg[Reg_DX] = (es->reg[Reg_AX] & (1ul<<63)) ? ((uint64_t)-1) : 0;
             break;
         default: assert(0);
         }
@@ -1728,8 +2801,21 @@ uint64_t emulateInstr(Rewriter* r, EmuState* es, Instr* instr)
         assert(opValType(&(instr->src)) == opValType(&(instr->dst)));
         getOpValue(&v1, es, &(instr->src));
         captureCMov(r, instr, es, &v1, es->flag_state[ft], cond);
-        // FIXME? if cond state unknown, set destination state always to unknown
-        if (cond == true) setOpValue(&v1, es, &(instr->dst));
+        if (!msIsStatic(es->flag_state[ft])) {
+            // condition unknown: destination becomes unknown
+            if (cond == false) {
+                getOpValue(&v2, es, &(instr->dst));
+                v1.val = v2.val;
+            }
+            initMetaState(&(v1.state), CS_DYNAMIC);
+            setOpValue(&v1, es, &(instr->dst));
+        }
+        else if (cond == true) setOpValue(&v1, es, &(instr->dst));
+        else if (opValType(&(instr->dst)) == VT_32) {
+            // 32bit destination register is zero-extended even without move
+            getOpValue(&v2, es, &(instr->dst));
+            setOpValue(&v2, es, &(instr->dst));
+        }
         break;
     }
 
@@ -1746,10 +2832,18 @@ uint64_t emulateInstr(Rewriter* r, EmuState* es, Instr* instr)
         }
         cs = setFlagsSub(es, &v1, &v2);
         captureCmp(r, instr, es, cs);
+
+        // compare of unknown register with constant: may be a bound check
+        if (opIsGPReg(&(instr->dst)) && ((vt == VT_32) || (vt == VT_64)) &&
+            msIsDynamic(v1.state) && msIsStatic(v2.state)) {
+            es->cmpReg = instr->dst.reg;
+            es->cmpVal = (vt == VT_32) ? (uint32_t) v2.val : v2.val;
+        }
         break;
 
     case IT_DEC:
         getOpValue(&v1, es, &(instr->dst));
+        setFlagsIncDec(es, &v1, false);
         switch(instr->dst.type) {
         case OT_Reg32:
         case OT_Ind32:
@@ -1775,19 +2869,36 @@ uint64_t emulateInstr(Rewriter* r, EmuState* es, Instr* instr)
         assert(v1.type == v2.type);
         switch(instr->src.type) {
         case OT_Reg32:
-        case OT_Ind32:
+        case OT_Ind32: {
+            int64_t p = (int64_t) (int32_t) v1.val * (int32_t) v2.val;
             vres.type = VT_32;
-            vres.val = (uint64_t) ((int32_t) v1.val * (int32_t) v2.val);
+            vres.val = (uint32_t) p;
+            // carry/overflow: result does not fit into destination
+            es->flag[FT_Carry] = (p != (int32_t) p);
             break;
+        }
 
         case OT_Reg64:
-        case OT_Ind64:
+        case OT_Ind64: {
+            __int128 p = (__int128) (int64_t) v1.val * (int64_t) v2.val;
             vres.type = VT_64;
-            vres.val = (uint64_t) ((int64_t) v1.val * (int64_t) v2.val);
+            vres.val = (uint64_t) p;
+            es->flag[FT_Carry] = (p != (int64_t) p);
             break;
+        }
 
         default:assert(0);
         }
+        es->flag[FT_Overflow] = es->flag[FT_Carry];
+        // multiplication with static 0 or 1 always fits, and is not
+        // captured as IMUL: flags are static
+        if ((msIsStatic(v1.state) && (v1.val <= 1)) ||
+            (msIsStatic(v2.state) && (v2.val <= 1)))
+            cs = CS_STATIC;
+        else
+            cs = combineState4Flags(v1.state.cState, v2.state.cState);
+        initMetaState(&(es->flag_state[FT_Carry]), cs);
+        initMetaState(&(es->flag_state[FT_Overflow]), cs);
 
         // optimization: multiply with static 0 results in static 0
         if ((msIsStatic(v1.state) && (v1.val == 0)) ||
@@ -1843,6 +2954,7 @@ uint64_t emulateInstr(Rewriter* r, EmuState* es, Instr* instr)
     }
     case IT_INC:
         getOpValue(&v1, es, &(instr->dst));
+        setFlagsIncDec(es, &v1, true);
         switch(instr->dst.type) {
         case OT_Reg32:
         case OT_Ind32:
@@ -1909,24 +3021,30 @@ uint64_t emulateInstr(Rewriter* r, EmuState* es, Instr* instr)
         return instr->addr + instr->len;
 
     case IT_JBE:
-        if (msIsDynamic(es->flag_state[FT_Carry]) ||
-            msIsDynamic(es->flag_state[FT_Zero])) {
-            captureJcc(r, IT_JLE, instr->dst.val, instr->addr + instr->len,
-                        es->flag[FT_Carry] || es->flag[FT_Zero]);
-        }
-        if ((es->flag[FT_Carry] == true) ||
-            (es->flag[FT_Zero] == true)) return instr->dst.val;
-        return instr->addr + instr->len;
-
-    case IT_JA:
-        if (msIsDynamic(es->flag_state[FT_Carry]) ||
-            msIsDynamic(es->flag_state[FT_Zero])) {
-            captureJcc(r, IT_JG, instr->dst.val, instr->addr + instr->len,
-                       !es->flag[FT_Carry] && !es->flag[FT_Zero]);
-        }
-        if ((es->flag[FT_Carry] == false) &&
-            (es->flag[FT_Zero] == false)) return instr->dst.val;
+    case IT_JA: {
+        // carry is kept by INC/DEC, so capture states of carry and zero
+        // flag may differ: if one is static, the other one alone decides
+        bool cf = es->flag[FT_Carry], zf = es->flag[FT_Zero];
+        bool cfDynamic = msIsDynamic(es->flag_state[FT_Carry]);
+        bool zfDynamic = msIsDynamic(es->flag_state[FT_Zero]);
+        bool cond = cf || zf;
+        InstrType it = IT_None;
+
+        if (cfDynamic && zfDynamic) it = IT_JBE;
+        else if (cfDynamic && !zf)  it = IT_JC;
+        else if (zfDynamic && !cf)  it = IT_JZ;
+
+        if (instr->type == IT_JA) {
+            cond = !cond;
+            if (it == IT_JBE) it = IT_JA;
+            else if (it == IT_JC) it = IT_JNC;
+            else if (it == IT_JZ) it = IT_JNZ;
+        }
+        if (it != IT_None)
+            captureJcc(r, it, instr->dst.val, instr->addr + instr->len, cond);
+        if (cond) return instr->dst.val;
         return instr->addr + instr->len;
+    }
 
     case IT_JS:
         if (msIsDynamic(es->flag_state[FT_Sign])) {
@@ -1960,25 +3078,31 @@ uint64_t emulateInstr(Rewriter* r, EmuState* es, Instr* instr)
         if (es->flag[FT_Parity] == false) return instr->dst.val;
         return instr->addr + instr->len;
 
-    case IT_JLE:
+    case IT_JLE: {
+        bool cond = es->flag[FT_Zero] ||
+                    (es->flag[FT_Sign] != es->flag[FT_Overflow]);
         if (msIsDynamic(es->flag_state[FT_Zero]) ||
-            msIsDynamic(es->flag_state[FT_Sign])) {
+            msIsDynamic(es->flag_state[FT_Sign]) ||
+            msIsDynamic(es->flag_state[FT_Overflow])) {
             captureJcc(r, IT_JLE, instr->dst.val, instr->addr + instr->len,
-                        es->flag[FT_Zero] || es->flag[FT_Sign]);
+                       cond);
         }
-        if ((es->flag[FT_Zero] == true) ||
-            (es->flag[FT_Sign] == true)) return instr->dst.val;
+        if (cond) return instr->dst.val;
         return instr->addr + instr->len;
+    }
 
-    case IT_JG:
+    case IT_JG: {
+        bool cond = !es->flag[FT_Zero] &&
+                    (es->flag[FT_Sign] == es->flag[FT_Overflow]);
         if (msIsDynamic(es->flag_state[FT_Zero]) ||
-            msIsDynamic(es->flag_state[FT_Sign])) {
+            msIsDynamic(es->flag_state[FT_Sign]) ||
+            msIsDynamic(es->flag_state[FT_Overflow])) {
             captureJcc(r, IT_JG, instr->dst.val, instr->addr + instr->len,
-                       !es->flag[FT_Zero] && !es->flag[FT_Sign]);
+                       cond);
         }
-        if ((es->flag[FT_Zero] == false) &&
-            (es->flag[FT_Sign] == false)) return instr->dst.val;
+        if (cond) return instr->dst.val;
         return instr->addr + instr->len;
+    }
 
     case IT_JL:
         if (msIsDynamic(es->flag_state[FT_Sign]) ||
@@ -2016,6 +3140,10 @@ uint64_t emulateInstr(Rewriter* r, EmuState* es, Instr* instr)
                 // in memory to be constant: follow resolved PLT entries
                 v1.state.cState = CS_STATIC;
             }
+            else {
+                uint64_t target = captureJumpTable(r, instr, es);
+                if (target != 0) return target;
+            }
             break;
         default: assert(0);
         }
@@ -2104,6 +3232,11 @@ uint64_t emulateInstr(Rewriter* r, EmuState* es, Instr* instr)
 
     case IT_NEG:
         getOpValue(&v1, es, &(instr->dst));
+        // flags as for "0 - v1"
+        v2 = v1;
+        v2.val = 0;
+        initMetaState(&(v2.state), CS_STATIC);
+        setFlagsSub(es, &v2, &v1);
         switch(instr->dst.type) {
         case OT_Reg32:
         case OT_Ind32:
@@ -2220,6 +3353,7 @@ uint64_t emulateInstr(Rewriter* r, EmuState* es, Instr* instr)
 
         default: assert(0);
         }
+        v1.state.indir = combineIndir(&(v1.state), &(v2.state));
         v1.state.cState = combineState(v1.state.cState, v2.state.cState, 0);
         captureBinaryOp(r, instr, es, &v1);
         setOpValue(&v1, es, &(instr->dst));
@@ -2257,6 +3391,7 @@ uint64_t emulateInstr(Rewriter* r, EmuState* es, Instr* instr)
         default: assert(0);
         }
 
+        v1.state.indir = combineIndir(&(v1.state), &(v2.state));
         v1.state.cState = combineState(v1.state.cState, v2.state.cState, 0);
         // for capturing we need state of original dst, do before setting dst
         captureBinaryOp(r, instr, es, &v1);
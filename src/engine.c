@@ -29,13 +29,17 @@
 #include "emulate.h"
 #include "decode.h"
 #include "generate.h"
+#include "perf.h"
+#include "gdbjit.h"
 #include "expr.h"
 
+// chunk size of per-rewrite arena (grows by further chunks if needed)
+#define ARENA_CHUNKSIZE (64 * 1024)
 
 Rewriter* allocRewriter(void)
 {
     Rewriter* r;
-    int i;
+    pthread_mutexattr_t attr;
 
     r = (Rewriter*) malloc(sizeof(Rewriter));
 
@@ -48,31 +52,90 @@ Rewriter* allocRewriter(void)
     r->decBBCount = 0;
     r->decBBCapacity = 0;
     r->decBB = 0;
+    r->decBBHash = (DBB**) calloc(1 << BB_HASH_BITS, sizeof(DBB*));
 
     r->capInstrCount = 0;
     r->capInstrCapacity = 0;
     r->capInstr = 0;
+    r->capturedTotal = 0;
 
     r->capBBCount = 0;
     r->capBBCapacity = 0;
     r->capBB = 0;
+    r->capBBHash = (CBB**) calloc(1 << BB_HASH_BITS, sizeof(CBB*));
     r->currentCapBB = 0;
+    r->capLimited = false;
+
+    // grow on demand
     r->capStackTop = -1;
+    r->capStackCapacity = 0;
+    r->capStack = 0;
+
+    r->capJTCount = 0;
+    r->capJTCapacity = 0;
+    r->capJT = 0;
+
+    r->loopHeaderCount = 0;
+    r->loopHeaderCapacity = 0;
+    r->loopHeader = 0;
+
     r->genOrderCount = 0;
+    r->genOrderCapacity = 0;
+    r->genOrder = 0;
 
     r->savedStateCount = 0;
-    for(i=0; i< SAVEDSTATE_MAX; i++)
-        r->savedState[i] = 0;
+    r->savedStateCapacity = 0;
+    r->savedState = 0;
+    r->savedStateHash = (EmuState**) calloc(1 << ES_HASH_BITS,
+                                            sizeof(EmuState*));
+    r->savedStateLock = (pthread_mutex_t*) malloc(sizeof(pthread_mutex_t) *
+                                                  (1 << ES_HASH_BITS));
+    for(int i = 0; i < (1 << ES_HASH_BITS); i++)
+        pthread_mutex_init(r->savedStateLock + i, 0);
+
+    r->shared = 0;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    r->captureLock = (pthread_mutex_t*) malloc(sizeof(pthread_mutex_t));
+    pthread_mutex_init(r->captureLock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    r->captureCond = (pthread_cond_t*) malloc(sizeof(pthread_cond_t));
+    pthread_cond_init(r->captureCond, 0);
+    r->busyWorkers = 0;
+    r->workerInstrCount = 0;
+    r->workerInstr = 0;
 
     r->capCodeCapacity = 0;
+    r->emuStackSize = 0;
     r->cs = 0;
+    r->stubStorage = 0;
+    r->retiredCount = 0;
+    r->retiredCapacity = 0;
+    r->retired = 0;
+    r->asyncActive = false;
+    r->installed = false;
+    r->installSize = 0;
+    r->installStorage = 0;
+    r->patchedFunc = 0;
+    r->patchedFallback = 0;
+    r->guardFallback = 0;
+    r->staticBytes = 0;
+    memset(&(r->stats), 0, sizeof(DBrewStats));
     r->generatedCodeAddr = 0;
     r->generatedCodeSize = 0;
+    r->genCounters = false;
+    r->dataStorage = 0;
+    r->memHookRec = 0;
+    r->genProfile = false;
+    r->profRec = 0;
+    r->tierThreshold = 0;
+    r->tierStop = false;
+    r->tierPromoted = false;
 
     r->cc = 0;
     r->es = 0;
 
-    r->ePool = 0;
+    r->arena = 0;
 
     // optimization passes
     r->addInliningHints = true;
@@ -82,6 +145,14 @@ Rewriter* allocRewriter(void)
     r->showDecoding = false;
     r->showEmuState = false;
     r->showEmuSteps = false;
+    r->perfMap = false;
+    r->perfJitDump = false;
+    r->capOrigAddr = 0;
+    r->capCfaOffset = 0;
+    r->gdbJit = false;
+    r->gdbJitCount = 0;
+    r->gdbJitCapacity = 0;
+    r->gdbJitEntry = 0;
 
     return r;
 }
@@ -101,6 +172,7 @@ void initRewriter(Rewriter* r)
         r->decBB = (DBB*) malloc(sizeof(DBB) * r->decBBCapacity);
     }
     r->decBBCount = 0;
+    memset(r->decBBHash, 0, sizeof(DBB*) << BB_HASH_BITS);
 
     if (r->capInstr == 0) {
         // default
@@ -115,6 +187,7 @@ void initRewriter(Rewriter* r)
         r->capBB = (CBB*) malloc(sizeof(CBB) * r->capBBCapacity);
     }
     r->capBBCount = 0;
+    memset(r->capBBHash, 0, sizeof(CBB*) << BB_HASH_BITS);
     r->currentCapBB = 0;
 
     if (r->cs == 0) {
@@ -124,13 +197,18 @@ void initRewriter(Rewriter* r)
     }
     if (r->cs) {
         r->cs->used = 0;
+        gdbJitUnregister(r);
+        if (r->dataStorage)
+            r->dataStorage->used = 0;
+        r->memHookRec = 0;
+        r->profRec = 0;
         // any previously generated code is invalid
         r->generatedCodeAddr = 0;
         r->generatedCodeSize = 0;
     }
 
-    if (r->ePool == 0)
-        r->ePool = expr_allocPool(1000);
+    if (r->arena == 0)
+        r->arena = initArena(ARENA_CHUNKSIZE);
 }
 
 void freeRewriter(Rewriter* r)
@@ -139,124 +217,491 @@ void freeRewriter(Rewriter* r)
 
     free(r->decInstr);
     free(r->decBB);
+    free(r->decBBHash);
     free(r->capInstr);
     free(r->capBB);
+    free(r->capBBHash);
+    free(r->capStack);
+    free(r->capJT);
+    free(r->loopHeader);
+    free(r->genOrder);
+    free(r->savedState);
+    free(r->savedStateHash);
+    for(int i = 0; i < (1 << ES_HASH_BITS); i++)
+        pthread_mutex_destroy(r->savedStateLock + i);
+    free(r->savedStateLock);
     free(r->cc);
+    for(int i = 0; i < r->workerInstrCount; i++)
+        free(r->workerInstr[i]);
+    free(r->workerInstr);
+    pthread_mutex_destroy(r->captureLock);
+    pthread_cond_destroy(r->captureCond);
+    free(r->captureLock);
+    free(r->captureCond);
 
     freeEmuState(r);
+    gdbJitUnregister(r);
+    free(r->gdbJitEntry);
     if (r->cs)
         freeCodeStorage(r->cs);
-    expr_freePool(r->ePool);
+    if (r->stubStorage)
+        freeCodeStorage(r->stubStorage);
+    if (r->installStorage)
+        freeCodeStorage(r->installStorage);
+    if (r->dataStorage)
+        freeCodeStorage(r->dataStorage);
+    for(int i = 0; i < r->retiredCount; i++)
+        freeCodeStorage(r->retired[i]);
+    free(r->retired);
+    freeArena(r->arena);
 
     free(r);
 }
 
 
+// keep <cs> until the rewriter is freed: other threads may still execute
+// code in it. Nothing to do if <cs> is 0
+void retireStorage(Rewriter* r, CodeStorage* cs)
+{
+    if (cs == 0) return;
+
+    if (r->retiredCount == r->retiredCapacity) {
+        r->retiredCapacity = r->retiredCapacity ? 2 * r->retiredCapacity : 4;
+        r->retired = (CodeStorage**) realloc(r->retired,
+                                    sizeof(CodeStorage*) * r->retiredCapacity);
+    }
+    r->retired[r->retiredCount++] = cs;
+}
+
+// code generated before may still be executing: let next rewrite use
+// fresh code and data storage. The generated code stays valid
+void retireGenerated(Rewriter* r)
+{
+    gdbJitUnregister(r);
+    retireStorage(r, r->cs);
+    retireStorage(r, r->dataStorage);
+    r->cs = 0;
+    r->dataStorage = 0;
+    r->memHookRec = 0;
+    r->profRec = 0;
+}
+
+
 //----------------------------------------------------------
 // Rewrite engine
 
-/**
- * Trace/emulate binary code of configured function and capture
- * instructions which need to be kept in the rewritten version.
- * This needs to keep track of the status of values stored in registers
- * (including flags) and on the stack.
- * Captured instructions are collected in multiple CBBs.
- *
- * See dbrew_emulate to see how to call this from a function
- * which acts almost as drop-in replacement (only one additional par).
- *
- * The state can be accessed as c->es afterwards (e.g. for the return
- * value of the emulated function)
- */
-// FIXME: this always assumes 5 parameters
-void vEmulateAndCapture(Rewriter* r, va_list args)
+// for parallel capture workers, most structures are shared
+Rewriter* sharedRewriter(Rewriter* r)
 {
-    // calling convention x86-64: parameters are stored in registers
-    // see https://en.wikipedia.org/wiki/X86_calling_conventions
-    static Reg parReg[6] = { Reg_DI, Reg_SI, Reg_DX, Reg_CX, Reg_8, Reg_9 };
+    return r->shared ? r->shared : r;
+}
 
-    int i, esID;
-    uint64_t par[6];
-    EmuState* es;
-    DBB *dbb;
-    CBB *cbb;
-    Instr* instr;
-    uint64_t bb_addr, nextbb_addr;
+void lockShared(Rewriter* r)
+{
+    if (r->shared)
+        pthread_mutex_lock(r->captureLock);
+}
 
-    par[0] = va_arg(args, uint64_t);
-    par[1] = va_arg(args, uint64_t);
-    par[2] = va_arg(args, uint64_t);
-    par[3] = va_arg(args, uint64_t);
-    par[4] = va_arg(args, uint64_t);
-    par[5] = va_arg(args, uint64_t);
+void unlockShared(Rewriter* r)
+{
+    if (r->shared)
+        pthread_mutex_unlock(r->captureLock);
+}
 
-    if (!r->es)
-        r->es = allocEmuState(1024);
-    resetEmuState(r->es);
-    es = r->es;
+int capturedCount(Rewriter* r)
+{
+    return __atomic_load_n(&(sharedRewriter(r)->capturedTotal),
+                           __ATOMIC_RELAXED);
+}
 
-    resetCapturing(r);
-    if (r->cs)
-        r->cs->used = 0;
+// Fibonacci hashing of BB address and esID into BB_HASH_BITS bits
+uint32_t hashBB(uint64_t addr, int esID)
+{
+    uint64_t h = (addr ^ ((uint64_t) esID << 32)) * 0x9E3779B97F4A7C15ul;
+    return (uint32_t) (h >> (64 - BB_HASH_BITS));
+}
 
-    for(i=0;i<6;i++) {
-        MetaState* ms = &(es->reg_state[parReg[i]]);
-        es->reg[parReg[i]] = par[i];
-        if (r->cc && (i<CC_MAXPARAM))
-            *ms = r->cc->par_state[i];
-        else
-            initMetaState(ms, CS_DYNAMIC);
+uint64_t statsTicks(void)
+{
+    return __builtin_ia32_rdtsc();
+}
+
+// add time since <start> to capture time, without time for decoding
+// (decodeTime was <decodeStart> at start). Parallel workers decode
+// concurrently: their decode time may sum up to more than elapsed
+static
+void addCaptureTime(Rewriter* r, uint64_t start, uint64_t decodeStart)
+{
+    uint64_t elapsed = statsTicks() - start;
+    uint64_t decode = r->stats.decodeTime - decodeStart;
+
+    if (elapsed > decode)
+        r->stats.captureTime += elapsed - decode;
+}
+
+// calling convention x86-64: parameters are stored in registers
+// see https://en.wikipedia.org/wiki/X86_calling_conventions
+static const Reg parReg[6] = { Reg_DI, Reg_SI, Reg_DX, Reg_CX, Reg_8, Reg_9 };
+
+// number of parameters: from signature, or 6 integer parameters
+static
+int parCount(CaptureConfig* cc)
+{
+    return (cc && (cc->parCount > 0)) ? cc->parCount : 6;
+}
+
+static
+ParType parType(CaptureConfig* cc, int p)
+{
+    return (cc && (cc->parCount > 0)) ? cc->par_type[p] : PT_Long;
+}
+
+static
+bool parIsFP(CaptureConfig* cc, int p)
+{
+    ParType t = parType(cc, p);
+    return (t == PT_Float) || (t == PT_Double);
+}
 
-        ms->parDep = expr_newPar(r->ePool, i,
-                                 r->cc ? r->cc->par_name[i] : 0);
+// register for parameter <p> according to calling convention. Returns
+// Reg_None for parameters on the stack, with offset to the stack pointer
+// at function entry in <stackOff>
+static
+Reg parLocation(CaptureConfig* cc, int p, int* stackOff)
+{
+    int intCount = 0, fpCount = 0, stackCount = 0;
+    Reg reg = Reg_None;
+
+    for(int i = 0; i <= p; i++) {
+        reg = Reg_None;
+        if (parIsFP(cc, i)) {
+            if (fpCount < 8) reg = Reg_X0 + fpCount++;
+        }
+        else {
+            if (intCount < 6) reg = parReg[intCount++];
+        }
+        if (reg == Reg_None) stackCount++;
     }
+    // above return address
+    *stackOff = 8 * stackCount;
+    return reg;
+}
 
-    es->reg[Reg_SP] = (uint64_t) (es->stackStart + es->stackSize);
-    initMetaState(&(es->reg_state[Reg_SP]), CS_STACKRELATIVE);
+// register of integer parameter <p>, Reg_None if on stack or FP
+Reg parRegister(CaptureConfig* cc, int p)
+{
+    int off;
 
-    // traverse all paths and generate CBBs
+    if (parIsFP(cc, p)) return Reg_None;
+    return parLocation(cc, p, &off);
+}
 
-    // push new CBB for c->func (as request to decode and emulate/capture
-    // starting at that address)
-    esID = saveEmuState(r);
-    cbb = getCaptureBB(r, r->func, esID);
-    // new CBB has to be first in this rewriter (we start with it in Pass 2)
-    assert(cbb = r->capBB);
-    pushCaptureBB(r, cbb);
-    assert(r->capStackTop == 0);
+static
+int stackParCount(CaptureConfig* cc)
+{
+    int off, count = 0;
 
-    // and start with this CBB
-    bb_addr = cbb->dec_addr;
-    r->currentCapBB = cbb;
-    if (r->addInliningHints) {
-        // hint: here starts a function, we can assume ABI calling conventions
-        Instr hintInstr;
-        initSimpleInstr(&hintInstr, IT_HINT_CALL);
-        capture(r, &hintInstr);
+    for(int i = 0; i < parCount(cc); i++)
+        if (parLocation(cc, i, &off) == Reg_None) count++;
+    return count;
+}
+
+// read parameters from variable argument list according to signature
+void readParameters(Rewriter* r, va_list args, uint64_t* par)
+{
+    for(int i = 0; i < parCount(r->cc); i++) {
+        switch(parType(r->cc, i)) {
+        case PT_Float: {
+            // promoted to double
+            float f = (float) va_arg(args, double);
+            par[i] = 0;
+            memcpy(par + i, &f, sizeof(float));
+            break;
+        }
+        case PT_Double: {
+            double d = va_arg(args, double);
+            memcpy(par + i, &d, sizeof(double));
+            break;
+        }
+        default:
+            par[i] = va_arg(args, uint64_t);
+            break;
+        }
     }
+}
 
-    if (r->showEmuSteps) {
-        printf("Processing BB (%s)\n", cbb_prettyName(cbb));
-        printStaticEmuState(es, cbb->esID);
+// the emulator passes through SSE instructions: for static floating
+// point parameters, load their values into the XMM registers at entry
+static
+void captureStaticFPPars(Rewriter* r)
+{
+    Operand scratch;
+    Instr i;
+    int off;
+
+    if (r->cc == 0) return;
+
+    setRegOp(&scratch, VT_64, Reg_11);
+    for(int p = 0; p < parCount(r->cc); p++) {
+        CaptureState s = r->cc->par_state[p].cState;
+        Reg reg = parLocation(r->cc, p, &off);
+
+        if (!parIsFP(r->cc, p) || (reg == Reg_None)) continue;
+        if ((s != CS_STATIC) && (s != CS_STATIC2)) continue;
+
+        initBinaryInstr(&i, IT_MOV, VT_64, &scratch,
+                        getImmOp(VT_64, r->es->reg[reg]));
+        capture(r, &i);
+        // movq %r11,%xmm
+        initSimpleInstr(&i, IT_MOVQ);
+        i.vtype = VT_64;
+        i.form = OF_2;
+        i.ptLen = 2;
+        i.ptPSet = PS_66;
+        i.ptOpc[0] = 0x0F;
+        i.ptOpc[1] = 0x6E;
+        i.ptEnc = OE_RM;
+        i.ptSChange = SC_None;
+        setRegOp(&(i.dst), VT_64, reg);
+        copyOperand(&(i.src), &scratch);
+        capture(r, &i);
     }
-    if (r->showEmuState) {
-        es->reg[Reg_IP] = bb_addr;
-        printEmuState(es);
+}
+
+// capture check of operand <o> against expected value <val> into
+// current CBB, using %r10 as scratch (free at function entry)
+static
+void captureExpectCheck(Rewriter* r, Operand* o, uint64_t val)
+{
+    Operand scratch;
+    Instr i;
+    int64_t v = (int64_t) val;
+
+    if ((opValType(o) == VT_32) || ((v > -(1l << 31)) && (v < (1l << 31)))) {
+        initBinaryInstr(&i, IT_CMP, opValType(o), o, getImmOp(opValType(o), val));
+        capture(r, &i);
+        return;
     }
+    setRegOp(&scratch, VT_64, Reg_10);
+    initBinaryInstr(&i, IT_MOV, VT_64, &scratch, getImmOp(VT_64, val));
+    capture(r, &i);
+    initBinaryInstr(&i, IT_CMP, VT_64, o, &scratch);
+    capture(r, &i);
+}
+
+// is parameter <p> expected to have a value (and not configured static)?
+static
+bool parIsExpected(CaptureConfig* cc, int p)
+{
+    CaptureState s = cc->par_state[p].cState;
+
+    return cc->par_expected[p] && (s != CS_STATIC) && (s != CS_STATIC2);
+}
+
+// open a new guard CBB following <prev> (0 for first)
+static
+CBB* newGuard(Rewriter* r, CBB* prev)
+{
+    CBB* guard = newCaptureBB(r, r->func, -1);
+
+    if (prev)
+        prev->nextFallThrough = guard;
+    guard->endType = IT_JNZ;
+    r->currentCapBB = guard;
+    // also for the fallback
+    if (prev == 0)
+        captureStaticFPPars(r);
+
+    return guard;
+}
+
+/**
+ * Speculation on expected values (see dbrew_config_expectpar/expectmem).
+ * Capture a chain of guard CBBs at function entry, one per expected value,
+ * each branching to a common fallback if the check fails. The fallback
+ * jumps to the original function, or is a generic version captured with
+ * emulator state <esID>. The emulator state gets switched to assume the
+ * expected values, and the CBB starting the speculated path is returned.
+ * Returns 0 if no values are expected.
+ */
+static
+CBB* captureGuards(Rewriter* r, int esID)
+{
+    CaptureConfig* cc = r->cc;
+    EmuState* es = r->es;
+    CBB *guard, *last, *fallback, *cbb;
+    Operand o, scratch;
+    uint64_t val;
+    Instr i;
+
+    if (cc == 0) return 0;
+
+    // guards are the first CBBs in this rewriter
+    guard = 0;
+    for(int p = 0; p < parCount(cc); p++) {
+        int off;
+        Reg reg = parLocation(cc, p, &off);
+
+        if (!parIsExpected(cc, p)) continue;
+        // only for parameters in general purpose registers, others
+        // stay dynamic without speculation
+        if ((reg == Reg_None) || parIsFP(cc, p)) continue;
+
+        guard = newGuard(r, guard);
+        // upper half of a 32-bit parameter is undefined: not compared
+        if (parType(cc, p) == PT_Int) {
+            setRegOp(&o, VT_32, reg);
+            val = (uint32_t) cc->par_expectedVal[p];
+        }
+        else {
+            setRegOp(&o, VT_64, reg);
+            val = cc->par_expectedVal[p];
+        }
+        captureExpectCheck(r, &o, val);
+
+        // speculated path: parameter known
+        es->reg[reg] = val;
+        es->reg_state[reg].cState = CS_STATIC;
+    }
+    setRegOp(&scratch, VT_64, Reg_11);
+    for(int m = 0; m < cc->expectedMemCount; m++) {
+        ExpectedMem* em = cc->expectedMem + m;
+
+        guard = newGuard(r, guard);
+        initBinaryInstr(&i, IT_MOV, VT_64, &scratch,
+                        getImmOp(VT_64, em->addr));
+        capture(r, &i);
+        o.type = (em->size == 4) ? OT_Ind32 : OT_Ind64;
+        o.reg = Reg_11;
+        o.ireg = Reg_None;
+        o.scale = 0;
+        o.val = 0;
+        o.seg = OSO_None;
+        captureExpectCheck(r, &o, em->val);
+    }
+    if (guard == 0) return 0;
+    last = guard;
+
+    if (cc->expectFallbackCapture) {
+        fallback = getCaptureBB(r, r->func, esID);
+        pushCaptureBB(r, fallback);
+    }
+    else {
+        // jump to original function
+        fallback = newCaptureBB(r, r->func, -1);
+        r->currentCapBB = fallback;
+        initBinaryInstr(&i, IT_MOV, VT_64, &scratch, getImmOp(VT_64, r->func));
+        capture(r, &i);
+        initUnaryInstr(&i, IT_JMPI, &scratch);
+        capture(r, &i);
+        fallback->endType = IT_JMPI;
+        // redirected to relocated prologue by dbrew_install
+        r->guardFallback = fallback;
+    }
+    r->currentCapBB = 0;
+    for(guard = r->capBB; guard; guard = guard->nextFallThrough)
+        guard->nextBranch = fallback;
 
+    // speculated path: memory known
+    es->expectedMemCount = cc->expectedMemCount;
+    es->expectedMem = cc->expectedMem;
+
+    cbb = getCaptureBB(r, r->func, saveEmuState(r));
+    last->nextFallThrough = cbb;
+
+    return cbb;
+}
+
+// get next CBB to capture from capture stack, 0 if all paths are captured
+static
+CBB* nextCaptureBB(Rewriter* r)
+{
+    Rewriter* s = r->shared;
+    CBB* cbb;
+
+    if (s == 0) {
+        while(r->capStackTop >= 0) {
+            cbb = r->capStack[r->capStackTop];
+            if (cbb->endType == IT_None) return cbb;
+            // cbb already handled; go to previous item on capture stack
+            r->capStackTop--;
+        }
+        return 0;
+    }
+
+    // parallel capture worker: hand over new paths to the shared stack,
+    // and take a path not yet claimed by another worker
+    lockShared(r);
+    for(int i = 0; i <= r->capStackTop; i++)
+        pushCaptureBB(s, r->capStack[i]);
+    r->capStackTop = -1;
+    // for a worker, busyWorkers tells whether it works on a path
+    if (r->busyWorkers > 0) {
+        r->busyWorkers = 0;
+        s->busyWorkers--;
+    }
+    pthread_cond_broadcast(r->captureCond);
+
+    while(1) {
+        while(s->capStackTop >= 0) {
+            cbb = s->capStack[s->capStackTop];
+            s->capStackTop--;
+            if ((cbb->endType != IT_None) || cbb->claimed) continue;
+
+            cbb->claimed = true;
+            r->busyWorkers = 1;
+            s->busyWorkers++;
+            unlockShared(r);
+            pushCaptureBB(r, cbb);
+            return cbb;
+        }
+        // other workers may still find new paths
+        if (s->busyWorkers == 0) break;
+        pthread_cond_wait(r->captureCond, r->captureLock);
+    }
+    unlockShared(r);
+
+    return 0;
+}
+
+// offset of the canonical frame address (stack pointer before calling
+// the rewritten function) from the stack pointer in generated code, where
+// inlined calls do not push return addresses. 0 if unknown
+static
+int cfaOffset(Rewriter* r, EmuState* es)
+{
+    uint64_t entrySP = es->stackTop;
+
+    if (es->reg_state[Reg_SP].cState != CS_STACKRELATIVE) return 0;
+    if (stackParCount(r->cc) > 0)
+        entrySP -= 8 * (1 + stackParCount(r->cc));
+
+    return (int) (entrySP - es->reg[Reg_SP]) - 8 * es->depth + 8;
+}
+
+// emulate and capture CBBs from the capture stack until all paths are
+// captured. With <single>, return after finishing the current CBB
+static
+void captureCBBs(Rewriter* r, bool single)
+{
+    EmuState* es = r->es;
+    DBB *dbb;
+    CBB *cbb;
+    Instr* instr;
+    uint64_t bb_addr, nextbb_addr;
+    int i;
+
+    bb_addr = r->currentCapBB ? r->currentCapBB->dec_addr : 0;
     while(1) {
         if (r->currentCapBB == 0) {
+            if (single) return;
+
             // open next yet-to-be-processed CBB
-            while(r->capStackTop >= 0) {
-                cbb = r->capStack[r->capStackTop];
-                if (cbb->endType == IT_None) break;
-                // cbb already handled; go to previous item on capture stack
-                r->capStackTop--;
-            }
+            cbb = nextCaptureBB(r);
             // all paths captured?
-            if (r->capStackTop < 0) break;
+            if (cbb == 0) break;
+
 
-            assert(cbb != 0);
             assert(cbb->count == 0); // should have no instructions yet
             restoreEmuState(r, cbb->esID);
             bb_addr = cbb->dec_addr;
@@ -273,9 +718,20 @@ void vEmulateAndCapture(Rewriter* r, va_list args)
             }
         }
 
+        // loop header? then current CBB may end with jump to a CBB
+        // with generalized state (see dbrew_config_unroll)
+        if (captureLoopHeader(r, bb_addr)) continue;
+
+        // lazy capturing at runtime: leave rest of path for a stub
+        if (r->currentCapBB && !captureCapacityLeft(r, 2)) {
+            captureDefer(r, bb_addr);
+            continue;
+        }
+
         // decode and process instructions starting at bb_addr.
         // note: multiple original BBs may be combined into one CBB
         dbb = dbrew_decode(r, bb_addr);
+        noteLoopHeader(r, dbb);
         for(i = 0; i < dbb->count; i++) {
             instr = dbb->instr + i;
 
@@ -287,6 +743,14 @@ void vEmulateAndCapture(Rewriter* r, va_list args)
             // for RIP-relative accesses
             es->reg[Reg_IP] = instr->addr + instr->len;
 
+            // for profitability estimation
+            if (r->currentCapBB)
+                r->currentCapBB->origCount++;
+
+            // debug info for instructions captured
+            r->capOrigAddr = instr->addr;
+            r->capCfaOffset = cfaOffset(r, es);
+
             nextbb_addr = emulateInstr(r, es, instr);
 
             if (r->showEmuState) {
@@ -300,20 +764,207 @@ void vEmulateAndCapture(Rewriter* r, va_list args)
         if (i == dbb->count) {
             // fall through at end of BB
             nextbb_addr = instr->addr + instr->len;
+            statsAdd(r, instrEmulated, i);
         }
+        else
+            statsAdd(r, instrEmulated, i + 1);
         if (es->depth < 0) {
             // finish this path
             assert(instr->type == IT_RET);
             captureRet(r, instr, es);
 
             // go to next path to trace
-            cbb = popCaptureBB(r);
-            cbb->endType = IT_RET;
+            popCaptureBB(r, IT_RET);
         }
         bb_addr = nextbb_addr;
     }
 }
 
+static
+void* captureWorker(void* arg)
+{
+    captureCBBs((Rewriter*) arg, false);
+    return 0;
+}
+
+// explore paths pending on the capture stack with <workers> threads
+static
+void captureParallel(Rewriter* r, int workers)
+{
+    Rewriter* w = (Rewriter*) malloc(sizeof(Rewriter) * workers);
+    pthread_t* t = (pthread_t*) malloc(sizeof(pthread_t) * workers);
+
+    r->workerInstr = (Instr**) realloc(r->workerInstr,
+                        sizeof(Instr*) * (r->workerInstrCount + workers));
+    r->busyWorkers = 0;
+    for(int i = 0; i < workers; i++) {
+        // copy configuration (sharing the capture lock), use own state
+        // for capturing
+        w[i] = *r;
+        w[i].shared = r;
+        w[i].es = allocEmuState(r->es->stackSize);
+        w[i].capInstr = (Instr*) malloc(sizeof(Instr) * r->capInstrCapacity);
+        w[i].capInstrCount = 0;
+        w[i].currentCapBB = 0;
+        w[i].capStackTop = -1;
+        w[i].capStackCapacity = 0;
+        w[i].capStack = 0;
+        w[i].busyWorkers = 0;
+        r->workerInstr[r->workerInstrCount++] = w[i].capInstr;
+    }
+    for(int i = 0; i < workers; i++)
+        pthread_create(&t[i], 0, captureWorker, &w[i]);
+    for(int i = 0; i < workers; i++) {
+        pthread_join(t[i], 0);
+        freeEmuState(&w[i]);
+        free(w[i].capStack);
+    }
+    free(t);
+    free(w);
+}
+
+/**
+ * Trace/emulate binary code of configured function and capture
+ * instructions which need to be kept in the rewritten version.
+ * This needs to keep track of the status of values stored in registers
+ * (including flags) and on the stack.
+ * Captured instructions are collected in multiple CBBs.
+ *
+ * See dbrew_emulate to see how to call this from a function
+ * which acts almost as drop-in replacement (only one additional par).
+ *
+ * The state can be accessed as c->es afterwards (e.g. for the return
+ * value of the emulated function)
+ */
+void vEmulateAndCapture(Rewriter* r, va_list args)
+{
+    uint64_t par[CC_MAXPARAM];
+
+    readParameters(r, args, par);
+    emulateAndCapture(r, par, false);
+}
+
+void emulateAndCapture(Rewriter* r, uint64_t* par, bool appendCode)
+{
+    int i, esID;
+    EmuState* es;
+    CBB *cbb;
+    uint64_t start, decodeStart;
+
+    // the original entry gets decoded, and generated code overwritten
+    dbrew_uninstall(r);
+
+    start = statsTicks();
+    decodeStart = r->stats.decodeTime;
+
+    if (!r->es) {
+        if (r->emuStackSize == 0) r->emuStackSize = 1024;
+        r->es = allocEmuState(r->emuStackSize);
+    }
+    resetEmuState(r->es);
+    es = r->es;
+
+    if (r->cc) {
+        es->staticMemCount = r->cc->staticMemCount;
+        es->staticMem = r->cc->staticMem;
+        es->staticBudget = r->cc->staticBudget;
+        es->runtimePath = r->cc->branches_known;
+    }
+    r->staticBytes = 0;
+    es->staticBytes = &(r->staticBytes);
+
+    resetCapturing(r);
+    // fresh storage after retireGenerated
+    if ((r->cs == 0) && (r->capCodeCapacity > 0))
+        r->cs = initCodeStorage(r->capCodeCapacity);
+    // with <appendCode>, code generated before stays valid
+    if (r->cs && !appendCode) {
+        r->cs->used = 0;
+        gdbJitUnregister(r);
+        if (r->dataStorage)
+            r->dataStorage->used = 0;
+        r->memHookRec = 0;
+        r->profRec = 0;
+    }
+
+    es->reg[Reg_SP] = es->stackTop;
+    if (stackParCount(r->cc) > 0) {
+        // stack parameters are above the return address
+        es->reg[Reg_SP] -= 8 * (1 + stackParCount(r->cc));
+        es->stackAccessed = es->reg[Reg_SP];
+    }
+    initMetaState(&(es->reg_state[Reg_SP]), CS_STACKRELATIVE);
+    r->capOrigAddr = r->func;
+    r->capCfaOffset = 8;
+
+    for(i = 0; i < parCount(r->cc); i++) {
+        MetaState ms;
+        int off;
+        Reg reg = parLocation(r->cc, i, &off);
+
+        if (r->cc)
+            ms = r->cc->par_state[i];
+        else
+            initMetaState(&ms, CS_DYNAMIC);
+        ms.parDep = expr_newPar(r->arena, i, r->cc ? r->cc->par_name[i] : 0);
+
+        if (reg != Reg_None) {
+            es->reg[reg] = par[i];
+            es->reg_state[reg] = ms;
+            continue;
+        }
+        off += es->reg[Reg_SP] - es->stackStart;
+        *(uint64_t*)(es->stack + off) = par[i];
+        setStackState(es, off, 8, &ms);
+    }
+
+    // traverse all paths and generate CBBs
+
+    // push new CBB for c->func (as request to decode and emulate/capture
+    // starting at that address)
+    esID = saveEmuState(r);
+    // with expected values, guards come first and we start with the
+    // speculated path
+    cbb = captureGuards(r, esID);
+    if (cbb == 0) {
+        cbb = getCaptureBB(r, r->func, esID);
+        // new CBB has to be first in this rewriter (we start with it in Pass 2)
+        assert(cbb == r->capBB);
+    }
+    pushCaptureBB(r, cbb);
+
+    // and start with this CBB
+    r->currentCapBB = cbb;
+    if (r->addInliningHints) {
+        // hint: here starts a function, we can assume ABI calling conventions
+        Instr hintInstr;
+        initSimpleInstr(&hintInstr, IT_HINT_CALL);
+        capture(r, &hintInstr);
+    }
+    if (cbb == r->capBB)
+        captureStaticFPPars(r);
+
+    if (r->showEmuSteps) {
+        printf("Processing BB (%s)\n", cbb_prettyName(cbb));
+        printStaticEmuState(es, cbb->esID);
+    }
+    if (r->showEmuState) {
+        es->reg[Reg_IP] = cbb->dec_addr;
+        printEmuState(es);
+    }
+
+    if ((r->cc == 0) || (r->cc->parallelWorkers == 0))
+        captureCBBs(r, false);
+    else {
+        // capture first CBB, then explore resulting paths in parallel
+        captureCBBs(r, true);
+        captureParallel(r, r->cc->parallelWorkers);
+    }
+
+    // time for decoding is accounted separately
+    addCaptureTime(r, start, decodeStart);
+}
+
 //----------------------------------------------------------
 // example optimization passes on captured instructions
 //
@@ -359,10 +1010,13 @@ void optPass(Rewriter* r, CBB* cbb)
 // apply optimization passes to instructions captured in vEmulateAndCapture
 void runOptsOnCaptured(Rewriter* r)
 {
+    uint64_t start = statsTicks();
+
     for(int i = 0; i < r->capBBCount; i++) {
         CBB* cbb = r->capBB + i;
         optPass(r, cbb);
     }
+    r->stats.optTime += statsTicks() - start;
 }
 
 
@@ -370,34 +1024,204 @@ void runOptsOnCaptured(Rewriter* r)
 // generate x86 code from instructions captured in vEmulateAndCapture
 //
 
-// result in c->rewrittenFunc/rewrittenSize
-void generateBinaryFromCaptured(Rewriter* r)
+// lazy capturing: record of a stub for a CBB not captured yet.
+// The stub jumps via <slot>, which initially points to the stub's
+// entry into lazyEntry, and gets patched to the generated CBB
+typedef struct _LazyStub {
+    uint64_t slot;
+    Rewriter* r;
+    CBB* cbb;
+} LazyStub;
+
+// jmp *slot(%rip); lea -128(%rsp),%rsp; push %rdi;
+// movabs $stub,%rdi; push %rax; movabs $lazyEntry,%rax; jmp *%rax
+#define LAZYSTUB_SIZE 35
+
+// jump via table, see generateJumpTableJump
+#define JTJUMP_SIZE 27
+
+void lazyEntry(void);
+
+// entry from stubs with %rdi = LazyStub and %rax/%rdi saved on stack below
+// the red zone. Saves all other registers, and jumps to the address
+// returned by lazyCompile with original register values
+__asm__(
+"    .pushsection .text\n"
+"    .globl lazyEntry\n"
+"    .type lazyEntry, @function\n"
+"lazyEntry:\n"
+"    pushfq\n"
+"    push %rcx\n    push %rdx\n    push %rsi\n    push %r8\n"
+"    push %r9\n     push %r10\n    push %r11\n    push %rbx\n"
+"    push %rbp\n    push %r12\n    push %r13\n    push %r14\n"
+"    push %r15\n"
+"    mov %rsp, %rbx\n"
+"    and $-16, %rsp\n"
+"    sub $256, %rsp\n"
+"    movdqa %xmm0, 0(%rsp)\n     movdqa %xmm1, 16(%rsp)\n"
+"    movdqa %xmm2, 32(%rsp)\n    movdqa %xmm3, 48(%rsp)\n"
+"    movdqa %xmm4, 64(%rsp)\n    movdqa %xmm5, 80(%rsp)\n"
+"    movdqa %xmm6, 96(%rsp)\n    movdqa %xmm7, 112(%rsp)\n"
+"    movdqa %xmm8, 128(%rsp)\n   movdqa %xmm9, 144(%rsp)\n"
+"    movdqa %xmm10, 160(%rsp)\n  movdqa %xmm11, 176(%rsp)\n"
+"    movdqa %xmm12, 192(%rsp)\n  movdqa %xmm13, 208(%rsp)\n"
+"    movdqa %xmm14, 224(%rsp)\n  movdqa %xmm15, 240(%rsp)\n"
+"    cld\n"
+"    mov %rbx, %rsi\n"
+"    call lazyCompile@PLT\n"
+"    movdqa 0(%rsp), %xmm0\n     movdqa 16(%rsp), %xmm1\n"
+"    movdqa 32(%rsp), %xmm2\n    movdqa 48(%rsp), %xmm3\n"
+"    movdqa 64(%rsp), %xmm4\n    movdqa 80(%rsp), %xmm5\n"
+"    movdqa 96(%rsp), %xmm6\n    movdqa 112(%rsp), %xmm7\n"
+"    movdqa 128(%rsp), %xmm8\n   movdqa 144(%rsp), %xmm9\n"
+"    movdqa 160(%rsp), %xmm10\n  movdqa 176(%rsp), %xmm11\n"
+"    movdqa 192(%rsp), %xmm12\n  movdqa 208(%rsp), %xmm13\n"
+"    movdqa 224(%rsp), %xmm14\n  movdqa 240(%rsp), %xmm15\n"
+"    mov %rbx, %rsp\n"
+"    pop %r15\n     pop %r14\n     pop %r13\n     pop %r12\n"
+"    pop %rbp\n     pop %rbx\n     pop %r11\n     pop %r10\n"
+"    pop %r9\n      pop %r8\n      pop %rsi\n     pop %rdx\n"
+"    pop %rcx\n"
+"    popfq\n"
+// target replaces saved %rax, return pops it and the stub's frame
+"    xchg %rax, (%rsp)\n"
+"    mov 8(%rsp), %rdi\n"
+"    ret $136\n"
+"    .size lazyEntry, .-lazyEntry\n"
+"    .popsection\n"
+);
+
+// registers as saved by lazyEntry, from lowest address (Reg_None: flags)
+static const Reg lazyReg[] = {
+    Reg_15, Reg_14, Reg_13, Reg_12, Reg_BP, Reg_BX, Reg_11, Reg_10,
+    Reg_9, Reg_8, Reg_SI, Reg_DX, Reg_CX, Reg_None, Reg_AX, Reg_DI
+};
+
+// bit positions in RFLAGS
+static const int lazyFlagBit[FT_Max] = {
+    [FT_Carry] = 0, [FT_Parity] = 2, [FT_Zero] = 6, [FT_Sign] = 7,
+    [FT_Overflow] = 11
+};
+
+static
+void generateLazyStub(Rewriter* r, CBB* cbb)
+{
+    uint8_t* buf = (uint8_t*) (cbb->addr2 + cbb->size);
+    LazyStub* ls = (LazyStub*) cbb->lazyAddr;
+
+    ls->slot = (uint64_t) (buf + 6);
+    ls->r = r;
+    ls->cbb = cbb;
+
+    // jmp *slot(%rip)
+    buf[0] = 0xFF;
+    buf[1] = 0x25;
+    *(int32_t*)(buf+2) = (int32_t) (cbb->lazyAddr - (uint64_t) (buf + 6));
+    // lea -128(%rsp),%rsp: do not touch the red zone
+    buf[6] = 0x48;
+    buf[7] = 0x8D;
+    buf[8] = 0x64;
+    buf[9] = 0x24;
+    buf[10] = 0x80;
+    buf[11] = 0x57; // push %rdi
+    buf[12] = 0x48; // movabs $stub,%rdi
+    buf[13] = 0xBF;
+    *(uint64_t*)(buf+14) = cbb->lazyAddr;
+    buf[22] = 0x50; // push %rax
+    buf[23] = 0x48; // movabs $lazyEntry,%rax
+    buf[24] = 0xB8;
+    *(uint64_t*)(buf+25) = (uint64_t) lazyEntry;
+    buf[33] = 0xFF; // jmp *%rax
+    buf[34] = 0xE0;
+}
+
+// jump to entry %idx of the table at <cbb->jtAddr> behind the code of <cbb>.
+// The table is addressed RIP-relative, with a scratch register saved below
+// the red zone; registers and flags are unchanged at the target:
+//   lea -128(%rsp),%rsp; push %s; push %s; lea table(%rip),%s;
+//   mov (%s,%idx,8),%s; mov %s,8(%rsp); pop %s; ret $128
+static
+void generateJumpTableJump(CBB* cbb)
+{
+    uint8_t* buf = (uint8_t*) (cbb->addr2 + cbb->size);
+    int idx = cbb->jtIndex - Reg_AX;
+    int s = (cbb->jtIndex == Reg_AX) ? 1 : 0; // %rcx or %rax
+    int o = 0;
+
+    buf[o++] = 0x48;
+    buf[o++] = 0x8D;
+    buf[o++] = 0x64;
+    buf[o++] = 0x24;
+    buf[o++] = 0x80;
+    buf[o++] = 0x50 + s;
+    buf[o++] = 0x50 + s;
+    buf[o++] = 0x48;
+    buf[o++] = 0x8D;
+    buf[o++] = 0x05 | (s << 3);
+    *(int32_t*)(buf + o) = (int32_t) (cbb->jtAddr - (uint64_t) (buf + o + 4));
+    o += 4;
+    buf[o++] = 0x48 | ((idx & 8) ? 2 : 0); // REX.W, REX.X for r8 - r15
+    buf[o++] = 0x8B;
+    buf[o++] = 0x04 | (s << 3); // SIB follows
+    buf[o++] = 0xC0 | ((idx & 7) << 3) | s; // scale 8
+    buf[o++] = 0x48;
+    buf[o++] = 0x89;
+    buf[o++] = 0x44 | (s << 3);
+    buf[o++] = 0x24;
+    buf[o++] = 0x08;
+    buf[o++] = 0x58 + s;
+    buf[o++] = 0xC2;
+    *(uint16_t*)(buf + o) = 128;
+    o += 2;
+    assert(o == JTJUMP_SIZE);
+}
+
+// generate code for CBBs reachable from <root> which have no code yet.
+// With <incremental>, already generated CBBs may be jump targets.
+// Returns end of code (without jump tables) in code storage
+static
+int generateCBBs(Rewriter* r, CBB* root, bool incremental)
 {
     CBB* cbb;
+    int codeEnd, usedStart;
 
     // Pass 1: generating code for BBs without linking them
 
     assert(r->capStackTop == -1);
-    // start with first CBB created
-    pushCaptureBB(r, r->capBB);
+    r->genOrderCount = 0;
+    pushCaptureBB(r, root);
     while(r->capStackTop >= 0) {
         cbb = r->capStack[r->capStackTop];
         r->capStackTop--;
         if (cbb->size >= 0) continue;
 
-        assert(r->genOrderCount < GENORDER_MAX);
+        // keep space for terminating 0 entry
+        if (r->genOrderCount + 1 >= r->genOrderCapacity) {
+            r->genOrderCapacity = r->genOrderCapacity ? 2 * r->genOrderCapacity : 20;
+            r->genOrder = (CBB**) realloc(r->genOrder,
+                                          sizeof(CBB*) * r->genOrderCapacity);
+        }
         r->genOrder[r->genOrderCount++] = cbb;
         generate(r, cbb);
+        r->stats.instrGenerated += cbb->count;
 
         if (instrIsJcc(cbb->endType)) {
             // FIXME: order according to branch preference
             pushCaptureBB(r, cbb->nextBranch);
             pushCaptureBB(r, cbb->nextFallThrough);
         }
+        else if (cbb->endType == IT_JMP) {
+            pushCaptureBB(r, cbb->nextFallThrough);
+        }
+        else if (cbb->endType == IT_JMPI) {
+            for(int j = cbb->jtCount - 1; j >= 0; j--)
+                pushCaptureBB(r, r->capJT[cbb->jtFirst + j]);
+        }
     }
 
     // Pass 2: determine trailing bytes needed for each BB
 
+    usedStart = r->cs->used;
     r->genOrder[r->genOrderCount] = 0;
     for(int i=0; i < r->genOrderCount; i++) {
         uint8_t* buf;
@@ -407,13 +1231,29 @@ void generateBinaryFromCaptured(Rewriter* r)
         buf = useCodeStorage(r->cs, cbb->size);
         cbb->addr2 = (uint64_t) buf;
         if (cbb->size > 0) {
-            assert(cbb->count>0);
             memcpy(buf, (char*)cbb->addr1, cbb->size);
         }
+        if (cbb->endType == IT_None) {
+            // not captured yet (lazy capturing)
+            useCodeStorage(r->cs, LAZYSTUB_SIZE);
+            continue;
+        }
+        if (cbb->jtCount > 0) {
+            useCodeStorage(r->cs, JTJUMP_SIZE);
+            continue;
+        }
+        if (cbb->endType == IT_JMP) {
+            if (cbb->nextFallThrough != r->genOrder[i+1]) {
+                cbb->genJump = true;
+                useCodeStorage(r->cs, 5);
+            }
+            continue;
+        }
         if (!instrIsJcc(cbb->endType)) continue;
 
+        // targets generated before may be far away
         diff = cbb->nextBranch->addr1 - (cbb->addr1 + cbb->size);
-        if ((diff > -120) && (diff < 120))
+        if (!incremental && (diff > -120) && (diff < 120))
             cbb->genJcc8 = true;
         useCodeStorage(r->cs, cbb->genJcc8 ? 2 : 6);
         if (cbb->nextFallThrough != r->genOrder[i+1]) {
@@ -422,6 +1262,21 @@ void generateBinaryFromCaptured(Rewriter* r)
         }
     }
 
+    // jump tables and stub records go after the code, aligned to 8 bytes
+    codeEnd = r->cs->used;
+    for(int i=0; i < r->genOrderCount; i++) {
+        cbb = r->genOrder[i];
+        if (cbb->endType == IT_None) {
+            useCodeStorage(r->cs, (8 - r->cs->used % 8) % 8);
+            cbb->lazyAddr = (uint64_t) useCodeStorage(r->cs, sizeof(LazyStub));
+            continue;
+        }
+        if (cbb->jtCount == 0) continue;
+
+        useCodeStorage(r->cs, (8 - r->cs->used % 8) % 8);
+        cbb->jtAddr = (uint64_t) useCodeStorage(r->cs, 8 * cbb->jtCount);
+    }
+
     // Pass 3: fill trailing bytes with jump instructions
 
     for(int i=0; i < r->genOrderCount; i++) {
@@ -430,11 +1285,26 @@ void generateBinaryFromCaptured(Rewriter* r)
         int diff;
 
         cbb = r->genOrder[i];
-        if (!instrIsJcc(cbb->endType)) continue;
+        if (cbb->endType == IT_None) {
+            generateLazyStub(r, cbb);
+            continue;
+        }
+        if (cbb->jtCount > 0) {
+            uint64_t* table = (uint64_t*) cbb->jtAddr;
+
+            for(int j = 0; j < cbb->jtCount; j++)
+                table[j] = r->capJT[cbb->jtFirst + j]->addr2;
+            generateJumpTableJump(cbb);
+            continue;
+        }
+        if (!instrIsJcc(cbb->endType) && !cbb->genJump) continue;
 
         buf = (uint8_t*) (cbb->addr2 + cbb->size);
         buf_addr = (uint64_t) buf;
-        if (cbb->genJcc8) {
+        if (!instrIsJcc(cbb->endType)) {
+            // unconditional jump only
+        }
+        else if (cbb->genJcc8) {
             diff = cbb->nextBranch->addr2 - (buf_addr + 2);
             assert((diff > -128) && (diff < 127));
 
@@ -494,16 +1364,254 @@ void generateBinaryFromCaptured(Rewriter* r)
         }
     }
 
+    r->stats.bytesGenerated += r->cs->used - usedStart;
+    perfRegisterCBBs(r, codeEnd);
+    gdbJitRegisterCBBs(r, codeEnd);
+    return codeEnd;
+}
+
+// rough average size of a generated instruction, for code size estimation
+#define EST_INSTR_BYTES 5
+
+// captured instructions which generate code
+static
+int cbbInstrCount(CBB* cbb)
+{
+    int n = 0;
+
+    for(int i = 0; i < cbb->count; i++)
+        if ((cbb->instr[i].type != IT_HINT_CALL) &&
+            (cbb->instr[i].type != IT_HINT_RET))
+            n++;
+    return n;
+}
+
+// profitability of captured code (see dbrew_config_profitability):
+// compare dynamic instruction counts on the path of the trace, and check
+// estimated code size against budget. Estimates are added to statistics
+static
+bool isProfitable(Rewriter* r)
+{
+    uint64_t origInstr = 0, rewInstr = 0, codeSize = 0;
+    bool* visited;
+    bool profitable;
+    CBB* cbb;
+
+    // path of the trace: follow directions observed in emulation,
+    // up to the first CBB visited again (a rolled loop)
+    visited = (bool*) calloc(r->capBBCount, sizeof(bool));
+    cbb = (r->capBBCount > 0) ? r->capBB : 0;
+    while(cbb && !visited[cbb - r->capBB]) {
+        visited[cbb - r->capBB] = true;
+        origInstr += cbb->origCount;
+        rewInstr += cbbInstrCount(cbb);
+        if (instrIsJcc(cbb->endType)) {
+            rewInstr++;
+            cbb = cbb->preferBranch ? cbb->nextBranch : cbb->nextFallThrough;
+        }
+        else if (cbb->endType == IT_JMP)
+            cbb = cbb->nextFallThrough;
+        else
+            cbb = 0; // return, jump table, or not captured yet
+    }
+    free(visited);
+
+    for(int i = 0; i < r->capBBCount; i++) {
+        cbb = r->capBB + i;
+        codeSize += EST_INSTR_BYTES * cbbInstrCount(cbb);
+        if (instrIsJcc(cbb->endType)) codeSize += 6;
+        else if (cbb->endType == IT_JMP) codeSize += 5;
+        else if (cbb->endType == IT_JMPI)
+            codeSize += JTJUMP_SIZE + 8 * cbb->jtCount;
+        else if (cbb->endType == IT_None) codeSize += LAZYSTUB_SIZE;
+    }
+
+    r->stats.estInstrOrig += origInstr;
+    r->stats.estInstrRewritten += rewInstr;
+    r->stats.estCodeSize += codeSize;
+
+    if ((r->cc == 0) || !r->cc->checkProfit) return true;
+
+    profitable = (rewInstr <= origInstr) &&
+                 ((r->cc->sizeBudget == 0) ||
+                  (codeSize <= (uint64_t) r->cc->sizeBudget));
+    if (r->showEmuSteps)
+        printf("Profitability: %lu instructions (original %lu), "
+               "%lu bytes (budget %d): %s\n",
+               rewInstr, origInstr, codeSize, r->cc->sizeBudget,
+               profitable ? "generating code" : "using original");
+    return profitable;
+}
+
+// result in c->rewrittenFunc/rewrittenSize
+void generateBinaryFromCaptured(Rewriter* r)
+{
+    int codeEnd;
+    uint64_t start;
+
+    if (!isProfitable(r)) {
+        r->stats.fallbacks++;
+        r->generatedCodeAddr = r->func;
+        r->generatedCodeSize = 0;
+        return;
+    }
+
+    start = statsTicks();
+
+    // start with first CBB created
+    codeEnd = generateCBBs(r, r->capBB, false);
+    r->stats.generateTime += statsTicks() - start;
+
     assert(r->cs != 0);
     assert(r->cs->used > 0);
 
     if (r->genOrderCount > 0) {
         int usedBefore = (r->genOrder[0]->addr2 - (uint64_t) r->cs->buf);
         r->generatedCodeAddr = r->genOrder[0]->addr2;
-        r->generatedCodeSize = r->cs->used - usedBefore;
+        // size without jump tables
+        r->generatedCodeSize = codeEnd - usedBefore;
     }
     else {
         r->generatedCodeAddr = 0;
         r->generatedCodeSize = 0;
     }
 }
+
+// upper bound of code storage used by generateCBBs for <cbb>: code in
+// pass 1 (instructions with hooks, counter, padding) copied in pass 2,
+// followed by trailing jumps or a stub, and a stub record or jump table
+int instrCodeBound(Rewriter* r)
+{
+    return (r->cc && r->cc->memHook) ? 15 + 80 : 15;
+}
+
+static
+int cbbCodeBound(Rewriter* r, CBB* cbb)
+{
+    return 2 * (40 + instrCodeBound(r) * cbb->count + 10) +
+           LAZYSTUB_SIZE + 8 + sizeof(LazyStub) + 8 * cbb->jtCount;
+}
+
+// code storage left for generating <root> and other CBBs without code?
+static
+bool lazyCodeFits(Rewriter* r, CBB* root)
+{
+    int size = cbbCodeBound(r, root);
+
+    for(int i = 0; i < r->capBBCount; i++)
+        if ((r->capBB[i].size < 0) && (r->capBB + i != root))
+            size += cbbCodeBound(r, r->capBB + i);
+
+    return size <= r->cs->fullsize - r->cs->used;
+}
+
+// capacities exhausted: continue in the original code at the start of
+// <cbb>, with values known in its state written into registers <regs>
+// (as saved by lazyEntry) and the stack. Stubs only exist at call depth 0,
+// so there are no return addresses of inlined calls to fake
+static
+uint64_t lazyFallback(Rewriter* r, CBB* cbb, uint64_t* regs)
+{
+    int n = sizeof(lazyReg) / sizeof(Reg);
+    uint64_t reg[Reg_Max];
+    bool flag[FT_Max];
+    // stack pointer at the stub: %rdi was pushed after skipping red zone
+    uint64_t rsp = (uint64_t) (regs + n) + 128;
+
+    restoreEmuState(r, cbb->esID);
+    for(int i = 0; i < n; i++) {
+        if (lazyReg[i] != Reg_None) {
+            reg[lazyReg[i]] = regs[i];
+            continue;
+        }
+        for(int f = 0; f < FT_Max; f++)
+            flag[f] = (regs[i] & (1ul << lazyFlagBit[f])) != 0;
+    }
+    materializeEmuState(r->es, reg, flag, rsp);
+    for(int i = 0; i < n; i++) {
+        if (lazyReg[i] != Reg_None) {
+            regs[i] = reg[lazyReg[i]];
+            continue;
+        }
+        for(int f = 0; f < FT_Max; f++) {
+            regs[i] &= ~(1ul << lazyFlagBit[f]);
+            if (flag[f]) regs[i] |= 1ul << lazyFlagBit[f];
+        }
+    }
+
+    if (r->showEmuSteps)
+        printf("Lazy capturing of BB (%s): capacities exhausted, "
+               "using original\n", cbb_prettyName(cbb));
+    r->stats.fallbacks++;
+    return cbb->dec_addr;
+}
+
+/**
+ * Called via lazyEntry from a stub on first execution of a path not
+ * captured yet. <regs> points to the register values saved by lazyEntry.
+ * Captures the path, starting with the runtime values of registers with
+ * dynamic state for the trace, and generates code for it. The stub gets
+ * patched to jump to this code, which is returned.
+ * Capturing stops early before running out of capacities, leaving stubs
+ * for the rest of the path. If nothing can be captured or code storage is
+ * too small, execution continues in the original code. The stub then
+ * keeps calling back, as the state must be made real on every execution.
+ */
+uint64_t lazyCompile(void* stub, uint64_t* regs)
+{
+    LazyStub* ls = (LazyStub*) stub;
+    Rewriter* r = ls->r;
+    CBB* cbb = ls->cbb;
+    EmuState* es;
+    uint64_t start, decodeStart, target;
+
+    pthread_mutex_lock(r->captureLock);
+    // another thread may have been first
+    if (cbb->endType == IT_None) {
+        es = r->es;
+        restoreEmuState(r, cbb->esID);
+        for(int i = 0; i < (int)(sizeof(lazyReg)/sizeof(Reg)); i++) {
+            if (lazyReg[i] == Reg_None) {
+                for(int f = 0; f < FT_Max; f++) {
+                    if (es->flag_state[f].cState != CS_DYNAMIC) continue;
+                    es->flag[f] = (regs[i] & (1ul << lazyFlagBit[f])) != 0;
+                }
+                continue;
+            }
+            if (es->reg_state[lazyReg[i]].cState == CS_DYNAMIC)
+                es->reg[lazyReg[i]] = regs[i];
+        }
+
+        if (r->showEmuSteps) {
+            printf("Lazy capturing of BB (%s)\n", cbb_prettyName(cbb));
+            printStaticEmuState(es, cbb->esID);
+        }
+        start = statsTicks();
+        decodeStart = r->stats.decodeTime;
+        r->currentCapBB = cbb;
+        pushCaptureBB(r, cbb);
+        r->capLimited = true;
+        captureCBBs(r, false);
+        r->capLimited = false;
+        addCaptureTime(r, start, decodeStart);
+        // code of stub gets replaced
+        if (cbb->endType != IT_None)
+            cbb->size = -1;
+    }
+    // captured, but no code yet?
+    if ((cbb->endType != IT_None) && (cbb->size < 0) &&
+        lazyCodeFits(r, cbb)) {
+        start = statsTicks();
+        generateCBBs(r, cbb, true);
+        r->stats.generateTime += statsTicks() - start;
+    }
+    if ((cbb->endType != IT_None) && (cbb->size >= 0)) {
+        __atomic_store_n(&(ls->slot), cbb->addr2, __ATOMIC_RELEASE);
+        target = ls->slot;
+    }
+    else
+        target = lazyFallback(r, cbb, regs);
+    pthread_mutex_unlock(r->captureLock);
+
+    return target;
+}
@@ -23,51 +23,30 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-ExprPool* expr_allocPool(int s)
-{
-    ExprPool* p;
-
-    p = (ExprPool*) malloc(sizeof(ExprPool) + s * sizeof(ExprNode));
-    p->size = s;
-    p->used = 0;
-    return p;
-}
-
-void expr_freePool(ExprPool* p)
-{
-    free(p);
-}
-
-ExprNode* expr_newNode(ExprPool* p, NodeType t)
+ExprNode* expr_newNode(Arena* a, NodeType t)
 {
     ExprNode* e;
 
-    assert(p && (p->used < p->size));
-    e = p->n + p->used;
-    e->p = p;
+    assert(a);
+    e = (ExprNode*) allocArena(a, sizeof(ExprNode));
     e->type = t;
+    e->left = 0;
+    e->right = 0;
 
-    p->used++;
     return e;
 }
 
-int expr_nodeIndex(ExprPool* p, ExprNode* n)
-{
-    assert(p && n && n->p == p);
-    return (int)(n - p->n);
-}
-
-ExprNode* expr_newConst(ExprPool* p, int val)
+ExprNode* expr_newConst(Arena* a, int val)
 {
-    ExprNode* e = expr_newNode(p, NT_Const);
+    ExprNode* e = expr_newNode(a, NT_Const);
     e->ival = val;
 
     return e;
 }
 
-ExprNode* expr_newPar(ExprPool* p, int no, char *n)
+ExprNode* expr_newPar(Arena* a, int no, char *n)
 {
-    ExprNode* e = expr_newNode(p, NT_Par);
+    ExprNode* e = expr_newNode(a, NT_Par);
     e->ival = no;
     if (n) {
         int i = 0;
@@ -83,20 +62,20 @@ ExprNode* expr_newPar(ExprPool* p, int no, char *n)
     return e;
 }
 
-ExprNode* expr_newScaled(ExprPool* p, int factor, ExprNode* exp)
+ExprNode* expr_newScaled(Arena* a, int factor, ExprNode* exp)
 {
-    ExprNode* e = expr_newNode(p, NT_Scaled);
+    ExprNode* e = expr_newNode(a, NT_Scaled);
     e->ival = factor;
-    e->left = expr_nodeIndex(p, exp);
+    e->left = exp;
 
     return e;
 }
 
-ExprNode* expr_newRef(ExprPool* p, uint64_t ptr, char* n, ExprNode* idx)
+ExprNode* expr_newRef(Arena* a, uint64_t ptr, char* n, ExprNode* idx)
 {
-    ExprNode* e = expr_newNode(p, NT_Ref);
+    ExprNode* e = expr_newNode(a, NT_Ref);
     e->ptr = ptr;
-    e->left = expr_nodeIndex(p, idx);
+    e->left = idx;
     if (n) {
         int i = 0;
         while(n[i] && (i < EN_NAMELEN-1)) {
@@ -111,11 +90,11 @@ ExprNode* expr_newRef(ExprPool* p, uint64_t ptr, char* n, ExprNode* idx)
     return e;
 }
 
-ExprNode* expr_newSum(ExprPool* p, ExprNode* left, ExprNode* right)
+ExprNode* expr_newSum(Arena* a, ExprNode* left, ExprNode* right)
 {
-    ExprNode* e = expr_newNode(p, NT_Sum);
-    e->left = expr_nodeIndex(p, left);
-    e->right = expr_nodeIndex(p, right);
+    ExprNode* e = expr_newNode(a, NT_Sum);
+    e->left = left;
+    e->right = right;
 
     return e;
 }
@@ -140,19 +119,19 @@ int appendExpr(char* b, ExprNode* e)
         else
             off = sprintf(b, "%lx", e->ptr);
         b[off] = '[';
-        off += appendExpr(b+off, e->p->n + e->left);
+        off += appendExpr(b+off, e->left);
         off += sprintf(b, "]");
         return off;
 
     case NT_Scaled:
         off =  sprintf(b, "%d * ", e->ival);
-        off += appendExpr(b+off, e->p->n + e->left);
+        off += appendExpr(b+off, e->left);
         return off;
 
     case NT_Sum:
-        off =  appendExpr(b, e->p->n + e->left);
+        off =  appendExpr(b, e->left);
         off += sprintf(b+off, " + ");
-        off += appendExpr(b+off, e->p->n + e->right);
+        off += appendExpr(b+off, e->right);
         return off;
 
     default: assert(0);
@@ -162,7 +141,7 @@ int appendExpr(char* b, ExprNode* e)
 
 char *expr_toString(ExprNode *e)
 {
-    static char buf[200];
+    static __thread char buf[200];
     int off;
     off = appendExpr(buf, e);
     assert(off < 200);
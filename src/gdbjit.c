@@ -0,0 +1,509 @@
+/**
+ * This file is part of DBrew, the dynamic binary rewriting library.
+ *
+ * (c) 2015-2016, Josef Weidendorfer <josef.weidendorfer@gmx.de>
+ *
+ * DBrew is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * DBrew is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with DBrew.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Registering generated code with GDB via its JIT interface.
+ *
+ * For each code generation, an in-memory ELF object is built with
+ *  - a symbol per generated CBB, named by cbb_prettyName
+ *  - call frame information (.eh_frame) for unwinding through rewritten
+ *    frames: the frame address is known from the emulated stack pointer
+ *  - a line table (.debug_line) mapping generated instructions back to
+ *    the original instructions: the "source file" is named after the
+ *    lowest original address, and lines are offsets to it plus 1
+ * GDB picks it up via a breakpoint in __jit_debug_register_code.
+ */
+
+#include "gdbjit.h"
+
+#include <elf.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffers.h"
+
+// GDB JIT interface, see "JIT Interface" in the GDB manual
+typedef enum {
+    JIT_NOACTION = 0,
+    JIT_REGISTER_FN,
+    JIT_UNREGISTER_FN
+} JitActions;
+
+struct _GdbJitEntry {
+    GdbJitEntry* next;
+    GdbJitEntry* prev;
+    const char* symfileAddr;
+    uint64_t symfileSize;
+};
+
+typedef struct _JitDescriptor {
+    uint32_t version;
+    uint32_t actionFlag;
+    GdbJitEntry* relevantEntry;
+    GdbJitEntry* firstEntry;
+} JitDescriptor;
+
+// names are given by the interface; weak, as other JITs linked into
+// the same program (e.g. LLVM) may define them too: one copy wins
+void __jit_debug_register_code(void);
+extern JitDescriptor __jit_debug_descriptor;
+
+__attribute__((noinline, weak))
+void __jit_debug_register_code(void)
+{
+    // GDB sets a breakpoint here: keep the call
+    __asm__ volatile("" ::: "memory");
+}
+
+__attribute__((weak))
+JitDescriptor __jit_debug_descriptor = { 1, JIT_NOACTION, 0, 0 };
+
+static pthread_mutex_t gdbJitLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// growing byte buffer for building sections
+typedef struct _ElfBuf {
+    uint8_t* data;
+    int size, capacity;
+} ElfBuf;
+
+static
+void bufPut(ElfBuf* b, const void* p, int len)
+{
+    if (b->size + len > b->capacity) {
+        b->capacity = 2 * (b->size + len) + 64;
+        b->data = (uint8_t*) realloc(b->data, b->capacity);
+    }
+    memcpy(b->data + b->size, p, len);
+    b->size += len;
+}
+
+static
+void bufPut8(ElfBuf* b, uint8_t v) { bufPut(b, &v, 1); }
+
+static
+void bufPut16(ElfBuf* b, uint16_t v) { bufPut(b, &v, 2); }
+
+static
+void bufPut32(ElfBuf* b, uint32_t v) { bufPut(b, &v, 4); }
+
+static
+void bufPut64(ElfBuf* b, uint64_t v) { bufPut(b, &v, 8); }
+
+static
+void bufPutStr(ElfBuf* b, const char* s) { bufPut(b, s, strlen(s) + 1); }
+
+static
+void bufPutULEB(ElfBuf* b, uint64_t v)
+{
+    do {
+        uint8_t byte = v & 0x7f;
+        v >>= 7;
+        bufPut8(b, v ? (byte | 0x80) : byte);
+    } while(v);
+}
+
+static
+void bufPutSLEB(ElfBuf* b, int64_t v)
+{
+    bool more = true;
+
+    while(more) {
+        uint8_t byte = v & 0x7f;
+        v >>= 7;
+        if (((v == 0) && !(byte & 0x40)) || ((v == -1) && (byte & 0x40)))
+            more = false;
+        bufPut8(b, more ? (byte | 0x80) : byte);
+    }
+}
+
+static
+void bufPatch32(ElfBuf* b, int off, uint32_t v)
+{
+    memcpy(b->data + off, &v, 4);
+}
+
+static
+void bufAlign(ElfBuf* b, int align, uint8_t fill)
+{
+    while(b->size % align) bufPut8(b, fill);
+}
+
+
+// DWARF constants used
+#define DW_CFA_advance_loc4     0x04
+#define DW_CFA_def_cfa          0x0c
+#define DW_CFA_def_cfa_offset   0x0e
+#define DW_CFA_offset           0x80
+#define DW_CFA_nop              0x00
+#define DW_EH_PE_absptr         0x00
+#define DW_REG_RSP              7
+#define DW_REG_RA               16
+
+#define DW_TAG_compile_unit     0x11
+#define DW_AT_name              0x03
+#define DW_AT_stmt_list         0x10
+#define DW_AT_low_pc            0x11
+#define DW_AT_high_pc           0x12
+#define DW_FORM_addr            0x01
+#define DW_FORM_data4           0x06
+#define DW_FORM_string          0x08
+
+#define DW_LNS_copy             1
+#define DW_LNS_advance_pc       2
+#define DW_LNS_advance_line     3
+#define DW_LNE_end_sequence     1
+#define DW_LNE_set_address      2
+
+// address of captured instruction <i> of <cbb> in final code
+static
+uint64_t instrAddr(CBB* cbb, int i)
+{
+    return cbb->addr2 + (cbb->instr[i].addr - cbb->addr1);
+}
+
+// .eh_frame with one CIE and one FDE covering [start,end)
+static
+void buildEhFrame(ElfBuf* b, Rewriter* r, uint64_t start, uint64_t end)
+{
+    int cieStart, fdeStart, cfa = 8;
+    uint64_t loc = start;
+
+    // CIE: at entry, frame address is rsp+8 with return address below
+    cieStart = b->size;
+    bufPut32(b, 0); // length, patched
+    bufPut32(b, 0); // CIE id
+    bufPut8(b, 1);  // version
+    bufPutStr(b, "zR");
+    bufPutULEB(b, 1);  // code alignment
+    bufPutSLEB(b, -8); // data alignment
+    bufPut8(b, DW_REG_RA);
+    bufPutULEB(b, 1);  // augmentation data
+    bufPut8(b, DW_EH_PE_absptr);
+    bufPut8(b, DW_CFA_def_cfa);
+    bufPutULEB(b, DW_REG_RSP);
+    bufPutULEB(b, 8);
+    bufPut8(b, DW_CFA_offset | DW_REG_RA);
+    bufPutULEB(b, 1);
+    bufAlign(b, 8, DW_CFA_nop);
+    bufPatch32(b, cieStart, b->size - cieStart - 4);
+
+    // FDE: frame address changes with stack pointer modifications
+    fdeStart = b->size;
+    bufPut32(b, 0); // length, patched
+    bufPut32(b, b->size - cieStart);
+    bufPut64(b, start);
+    bufPut64(b, end - start);
+    bufPutULEB(b, 0); // augmentation data
+    for(int i = 0; i < r->genOrderCount; i++) {
+        CBB* cbb = r->genOrder[i];
+
+        for(int j = 0; j < cbb->count; j++) {
+            Instr* instr = cbb->instr + j;
+            uint64_t a = instrAddr(cbb, j);
+
+            // unknown: keep previous rule
+            if ((instr->cfaOffset == 0) || (instr->cfaOffset == cfa))
+                continue;
+            bufPut8(b, DW_CFA_advance_loc4);
+            bufPut32(b, a - loc);
+            bufPut8(b, DW_CFA_def_cfa_offset);
+            bufPutULEB(b, instr->cfaOffset);
+            loc = a;
+            cfa = instr->cfaOffset;
+        }
+    }
+    bufAlign(b, 8, DW_CFA_nop);
+    bufPatch32(b, fdeStart, b->size - fdeStart - 4);
+
+    bufPut32(b, 0); // terminator
+}
+
+// .debug_abbrev and .debug_info: one compilation unit, for line table
+static
+void buildDebugInfo(ElfBuf* abbrev, ElfBuf* info, const char* name,
+                    uint64_t start, uint64_t end)
+{
+    bufPutULEB(abbrev, 1);
+    bufPutULEB(abbrev, DW_TAG_compile_unit);
+    bufPut8(abbrev, 0); // no children
+    bufPutULEB(abbrev, DW_AT_name);
+    bufPutULEB(abbrev, DW_FORM_string);
+    bufPutULEB(abbrev, DW_AT_low_pc);
+    bufPutULEB(abbrev, DW_FORM_addr);
+    bufPutULEB(abbrev, DW_AT_high_pc);
+    bufPutULEB(abbrev, DW_FORM_addr);
+    bufPutULEB(abbrev, DW_AT_stmt_list);
+    bufPutULEB(abbrev, DW_FORM_data4);
+    bufPutULEB(abbrev, 0);
+    bufPutULEB(abbrev, 0);
+    bufPutULEB(abbrev, 0);
+
+    bufPut32(info, 0); // length, patched
+    bufPut16(info, 2); // DWARF version
+    bufPut32(info, 0); // abbrev offset
+    bufPut8(info, 8);  // address size
+    bufPutULEB(info, 1);
+    bufPutStr(info, name);
+    bufPut64(info, start);
+    bufPut64(info, end);
+    bufPut32(info, 0); // offset in .debug_line
+    bufPatch32(info, 0, info->size - 4);
+}
+
+// .debug_line: generated instructions to offsets from original <base>
+static
+void buildDebugLine(ElfBuf* b, Rewriter* r, const char* name,
+                    uint64_t base, uint64_t end)
+{
+    static const uint8_t opLength[12] = { 0,1,1,1,1,0,0,0,1,0,0,1 };
+    int hdrLenOff;
+    int64_t line = 1;
+    uint64_t loc = 0;
+
+    bufPut32(b, 0); // length, patched
+    bufPut16(b, 2); // version
+    hdrLenOff = b->size;
+    bufPut32(b, 0); // header length, patched
+    bufPut8(b, 1);  // minimum instruction length
+    bufPut8(b, 1);  // default is_stmt
+    bufPut8(b, (uint8_t) -5); // line base
+    bufPut8(b, 14); // line range
+    bufPut8(b, 13); // opcode base
+    bufPut(b, opLength, 12);
+    bufPut8(b, 0);  // no include directories
+    bufPutStr(b, name);
+    bufPutULEB(b, 0); // directory, time, size
+    bufPutULEB(b, 0);
+    bufPutULEB(b, 0);
+    bufPut8(b, 0);  // end of file names
+    bufPatch32(b, hdrLenOff, b->size - hdrLenOff - 4);
+
+    for(int i = 0; i < r->genOrderCount; i++) {
+        CBB* cbb = r->genOrder[i];
+
+        for(int j = 0; j < cbb->count; j++) {
+            Instr* instr = cbb->instr + j;
+            uint64_t a = instrAddr(cbb, j);
+
+            if ((instr->len == 0) || (instr->origAddr < base)) continue;
+            if (loc == 0) {
+                bufPut8(b, 0);
+                bufPutULEB(b, 9);
+                bufPut8(b, DW_LNE_set_address);
+                bufPut64(b, a);
+            }
+            else {
+                bufPut8(b, DW_LNS_advance_pc);
+                bufPutULEB(b, a - loc);
+            }
+            bufPut8(b, DW_LNS_advance_line);
+            bufPutSLEB(b, (int64_t) (instr->origAddr - base + 1) - line);
+            bufPut8(b, DW_LNS_copy);
+            line = instr->origAddr - base + 1;
+            loc = a;
+        }
+    }
+    if (loc > 0) {
+        bufPut8(b, DW_LNS_advance_pc);
+        bufPutULEB(b, end - loc);
+        bufPut8(b, 0);
+        bufPutULEB(b, 1);
+        bufPut8(b, DW_LNE_end_sequence);
+    }
+    bufPatch32(b, 0, b->size - 4);
+}
+
+// section indexes
+enum { SEC_Null = 0, SEC_Text, SEC_Symtab, SEC_Strtab, SEC_EhFrame,
+       SEC_Abbrev, SEC_Info, SEC_Line, SEC_Shstrtab, SEC_Max };
+
+static
+void addSection(Elf64_Shdr* sh, ElfBuf* shstr, const char* name,
+                Elf64_Word type, Elf64_Xword flags)
+{
+    memset(sh, 0, sizeof(Elf64_Shdr));
+    sh->sh_name = shstr->size;
+    sh->sh_type = type;
+    sh->sh_flags = flags;
+    sh->sh_addralign = 1;
+    bufPutStr(shstr, name);
+}
+
+// build ELF object for code [start,end), return size
+static
+int buildElf(Rewriter* r, uint64_t start, uint64_t end, uint8_t** obj)
+{
+    ElfBuf sec[SEC_Max], elf;
+    Elf64_Shdr sh[SEC_Max];
+    Elf64_Ehdr eh;
+    Elf64_Sym sym;
+    uint64_t base = ~0ul;
+    char name[64];
+
+    memset(sec, 0, sizeof(sec));
+    memset(&elf, 0, sizeof(elf));
+
+    // lowest original address as base for line numbers
+    for(int i = 0; i < r->genOrderCount; i++)
+        for(int j = 0; j < r->genOrder[i]->count; j++)
+            if ((r->genOrder[i]->instr[j].origAddr > 0) &&
+                (r->genOrder[i]->instr[j].origAddr < base))
+                base = r->genOrder[i]->instr[j].origAddr;
+    if (base == ~0ul) base = r->func;
+    sprintf(name, "dbrew@0x%lx", base);
+
+    bufPut8(sec + SEC_Shstrtab, 0);
+    addSection(sh + SEC_Null, sec + SEC_Shstrtab, "", SHT_NULL, 0);
+    addSection(sh + SEC_Text, sec + SEC_Shstrtab, ".text",
+               SHT_NOBITS, SHF_ALLOC | SHF_EXECINSTR);
+    addSection(sh + SEC_Symtab, sec + SEC_Shstrtab, ".symtab", SHT_SYMTAB, 0);
+    addSection(sh + SEC_Strtab, sec + SEC_Shstrtab, ".strtab", SHT_STRTAB, 0);
+    addSection(sh + SEC_EhFrame, sec + SEC_Shstrtab, ".eh_frame",
+               SHT_PROGBITS, SHF_ALLOC);
+    addSection(sh + SEC_Abbrev, sec + SEC_Shstrtab, ".debug_abbrev",
+               SHT_PROGBITS, 0);
+    addSection(sh + SEC_Info, sec + SEC_Shstrtab, ".debug_info",
+               SHT_PROGBITS, 0);
+    addSection(sh + SEC_Line, sec + SEC_Shstrtab, ".debug_line",
+               SHT_PROGBITS, 0);
+    addSection(sh + SEC_Shstrtab, sec + SEC_Shstrtab, ".shstrtab",
+               SHT_STRTAB, 0);
+    sh[SEC_Null].sh_name = 0;
+
+    sh[SEC_Text].sh_addr = start;
+    sh[SEC_Text].sh_size = end - start;
+    sh[SEC_Text].sh_addralign = 16;
+
+    // symbols: null symbol, then a function per CBB
+    bufPut8(sec + SEC_Strtab, 0);
+    memset(&sym, 0, sizeof(sym));
+    bufPut(sec + SEC_Symtab, &sym, sizeof(sym));
+    for(int i = 0; i < r->genOrderCount; i++) {
+        CBB* cbb = r->genOrder[i];
+        uint64_t next = r->genOrder[i+1] ? r->genOrder[i+1]->addr2 : end;
+
+        if (next <= cbb->addr2) continue;
+        sym.st_name = sec[SEC_Strtab].size;
+        sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+        sym.st_shndx = SEC_Text;
+        sym.st_value = cbb->addr2;
+        sym.st_size = next - cbb->addr2;
+        bufPut(sec + SEC_Symtab, &sym, sizeof(sym));
+        bufPutStr(sec + SEC_Strtab, cbb_prettyName(cbb));
+    }
+    sh[SEC_Symtab].sh_link = SEC_Strtab;
+    sh[SEC_Symtab].sh_info = 1; // first non-local symbol
+    sh[SEC_Symtab].sh_entsize = sizeof(Elf64_Sym);
+    sh[SEC_Symtab].sh_addralign = 8;
+
+    buildEhFrame(sec + SEC_EhFrame, r, start, end);
+    sh[SEC_EhFrame].sh_addralign = 8;
+    buildDebugInfo(sec + SEC_Abbrev, sec + SEC_Info, name, start, end);
+    buildDebugLine(sec + SEC_Line, r, name, base, end);
+
+    // layout: ELF header, section contents, section headers
+    memset(&eh, 0, sizeof(eh));
+    memcpy(eh.e_ident, ELFMAG, SELFMAG);
+    eh.e_ident[EI_CLASS] = ELFCLASS64;
+    eh.e_ident[EI_DATA] = ELFDATA2LSB;
+    eh.e_ident[EI_VERSION] = EV_CURRENT;
+    eh.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    eh.e_type = ET_REL;
+    eh.e_machine = EM_X86_64;
+    eh.e_version = EV_CURRENT;
+    eh.e_ehsize = sizeof(Elf64_Ehdr);
+    eh.e_shentsize = sizeof(Elf64_Shdr);
+    eh.e_shnum = SEC_Max;
+    eh.e_shstrndx = SEC_Shstrtab;
+    bufPut(&elf, &eh, sizeof(eh));
+
+    for(int i = SEC_Symtab; i < SEC_Max; i++) {
+        bufAlign(&elf, 8, 0);
+        sh[i].sh_offset = elf.size;
+        sh[i].sh_size = sec[i].size;
+        bufPut(&elf, sec[i].data, sec[i].size);
+        free(sec[i].data);
+    }
+    bufAlign(&elf, 8, 0);
+    ((Elf64_Ehdr*) elf.data)->e_shoff = elf.size;
+    bufPut(&elf, sh, sizeof(sh));
+
+    *obj = elf.data;
+    return elf.size;
+}
+
+void gdbJitRegisterCBBs(Rewriter* r, int codeEnd)
+{
+    uint64_t start, end = (uint64_t) r->cs->buf + codeEnd;
+    GdbJitEntry* e;
+    uint8_t* obj;
+    int size;
+
+    if (!r->gdbJit || (r->genOrderCount == 0)) return;
+
+    start = r->genOrder[0]->addr2;
+    size = buildElf(r, start, end, &obj);
+
+    e = (GdbJitEntry*) malloc(sizeof(GdbJitEntry));
+    e->symfileAddr = (const char*) obj;
+    e->symfileSize = size;
+
+    if (r->gdbJitCount == r->gdbJitCapacity) {
+        r->gdbJitCapacity = r->gdbJitCapacity ? 2 * r->gdbJitCapacity : 4;
+        r->gdbJitEntry = (GdbJitEntry**) realloc(r->gdbJitEntry,
+                            sizeof(GdbJitEntry*) * r->gdbJitCapacity);
+    }
+    r->gdbJitEntry[r->gdbJitCount++] = e;
+
+    pthread_mutex_lock(&gdbJitLock);
+    e->prev = 0;
+    e->next = __jit_debug_descriptor.firstEntry;
+    if (e->next) e->next->prev = e;
+    __jit_debug_descriptor.firstEntry = e;
+    __jit_debug_descriptor.relevantEntry = e;
+    __jit_debug_descriptor.actionFlag = JIT_REGISTER_FN;
+    __jit_debug_register_code();
+    pthread_mutex_unlock(&gdbJitLock);
+}
+
+void gdbJitUnregister(Rewriter* r)
+{
+    pthread_mutex_lock(&gdbJitLock);
+    for(int i = 0; i < r->gdbJitCount; i++) {
+        GdbJitEntry* e = r->gdbJitEntry[i];
+
+        if (e->prev)
+            e->prev->next = e->next;
+        else
+            __jit_debug_descriptor.firstEntry = e->next;
+        if (e->next) e->next->prev = e->prev;
+
+        __jit_debug_descriptor.relevantEntry = e;
+        __jit_debug_descriptor.actionFlag = JIT_UNREGISTER_FN;
+        __jit_debug_register_code();
+
+        free((void*) e->symfileAddr);
+        free(e);
+    }
+    pthread_mutex_unlock(&gdbJitLock);
+    r->gdbJitCount = 0;
+}
@@ -25,6 +25,7 @@
 #include <stdint.h>
 
 #include "common.h"
+#include "buffers.h"
 #include "printer.h"
 
 
@@ -50,12 +51,12 @@ int VRegEncoding(Reg r)
     return r - Reg_X0;
 }
 
-// returns static buffer with requested operand encoding
+// returns thread-local static buffer with requested operand encoding
 static
 uint8_t* calcModRMDigit(Operand* o1, int digit,
                         int* prex, OpSegOverride* pso, int* plen)
 {
-    static uint8_t buf[10];
+    static __thread uint8_t buf[10];
     int modrm, r1;
     int o = 0;
     ValType vt;
@@ -208,7 +209,8 @@ uint8_t* calcModRM(Operand* o1, Operand* o2,
         r2 = GPRegEncoding(o2->reg);
     }
     else if (opIsVReg(o2)) {
-        assert(opIsVReg(o1) || opIsInd(o1));
+        // GP register as r/m e.g. with movd/movq
+        assert(opIsReg(o1) || opIsInd(o1));
         r2 = VRegEncoding(o2->reg);
     }
     else assert(0);
@@ -390,12 +392,12 @@ int genOI(uint8_t* buf, int opc, Operand* o1, Operand* o2)
 static
 Operand* reduceImm64to32(Operand* o)
 {
-    static Operand newOp;
+    static __thread Operand newOp;
 
     if (o->type == OT_Imm64) {
         // reduction possible if signed 64bit fits into signed 32bit
         int64_t v = (int64_t) o->val;
-        if ((v > -(1l << 31)) && (v < (1l << 31))) {
+        if ((v >= -(1l << 31)) && (v < (1l << 31))) {
             newOp.type = OT_Imm32;
             newOp.val = (uint32_t) (int32_t) v;
             return &newOp;
@@ -407,12 +409,12 @@ Operand* reduceImm64to32(Operand* o)
 static
 Operand* reduceImm32to8(Operand* o)
 {
-    static Operand newOp;
+    static __thread Operand newOp;
 
     if (o->type == OT_Imm32) {
         // reduction possible if signed 32bit fits into signed 8bit
         int32_t v = (int32_t) o->val;
-        if ((v > -(1<<7)) && (v < (1<<7))) {
+        if ((v >= -(1<<7)) && (v < (1<<7))) {
             newOp.type = OT_Imm8;
             newOp.val = (uint8_t) (int8_t) v;
             return &newOp;
@@ -434,6 +436,27 @@ int genRet(uint8_t* buf)
     return 1;
 }
 
+static
+int genJmpI(uint8_t* buf, Operand* o1)
+{
+    OpSegOverride so = OSO_None;
+    int rex = 0, len = 0;
+    int o = 0;
+    uint8_t* rmBuf;
+
+    // use 'jmp r/m64' (0xFF/4), 64 bit without REX.W
+    assert((o1->type == OT_Reg64) || (o1->type == OT_Ind64));
+    rmBuf = calcModRMDigit(o1, 4, &rex, &so, &len);
+    rex &= ~REX_MASK_W;
+    o += genPrefix(buf, rex, so);
+    buf[o++] = 0xFF;
+    while(len>0) {
+        buf[o++] = *rmBuf++;
+        len--;
+    }
+    return o;
+}
+
 static
 int genPush(uint8_t* buf, Operand* o)
 {
@@ -499,7 +522,24 @@ int genInc(uint8_t* buf, Operand* dst)
 }
 
 static
-int genMov(uint8_t* buf, Operand* src, Operand* dst)
+int genNeg(uint8_t* buf, Operand* dst)
+{
+    switch(dst->type) {
+    case OT_Ind32:
+    case OT_Ind64:
+    case OT_Reg32:
+    case OT_Reg64:
+      // use 'neg r/m 32/64' (0xF7/3)
+      return genDigitRM(buf, 0xF7, 3, dst);
+
+    default: assert(0);
+    }
+    return 0;
+}
+
+// <keepFlags>: flags may be used afterwards, do not use xor for zero
+static
+int genMov(uint8_t* buf, Operand* src, Operand* dst, bool keepFlags)
 {
     src = reduceImm64to32(src);
 
@@ -545,7 +585,7 @@ int genMov(uint8_t* buf, Operand* src, Operand* dst)
             break;
 
         case OT_Imm32:
-            if (src->val == 0) {
+            if ((src->val == 0) && !keepFlags) {
                 // setting to 0: use 'xor r/m,r 32/64' (0x31 MR)
                 return genModRM(buf, 0x31, -1, dst, dst, VT_None);
             }
@@ -553,7 +593,7 @@ int genMov(uint8_t* buf, Operand* src, Operand* dst)
             return genDigitMI(buf, 0xC7, 0, dst, src);
 
         case OT_Imm64: {
-            if (src->val == 0) {
+            if ((src->val == 0) && !keepFlags) {
                 // setting to 0: use 'xor r/m,r 32/64' (0x31 MR)
                 return genModRM(buf, 0x31, -1, dst, dst, VT_None);
             }
@@ -604,8 +644,8 @@ int genCMov(uint8_t* buf, InstrType it, Operand* src, Operand* dst)
             case IT_CMOVG:  opc = 0x4F; break; // cmovg  r,r/m 32/64
             default: assert(0);
             }
-            // use 'cmov r,r/m 32/64' (opc RM)
-            return genModRM(buf, opc, -1, src, dst, VT_None);
+            // use 'cmov r,r/m 32/64' (0x0F opc RM)
+            return genModRM(buf, 0x0F, opc, src, dst, VT_None);
             break;
 
         default: assert(0);
@@ -838,7 +878,6 @@ int genIMul(uint8_t* buf, Operand* src, Operand* dst)
         break;
 
     case OT_Imm32:
-        assert(opValType(src) == opValType(dst));
         switch(dst->type) {
         case OT_Reg32:
         case OT_Reg64:
@@ -874,6 +913,10 @@ int genIDiv1(uint8_t* buf, Operand* src)
 static
 int genXor(uint8_t* buf, Operand* src, Operand* dst)
 {
+    // if src is imm, try to reduce width
+    src = reduceImm64to32(src);
+    src = reduceImm32to8(src);
+
     switch(src->type) {
     // src reg
     case OT_Reg32:
@@ -941,6 +984,10 @@ int genXor(uint8_t* buf, Operand* src, Operand* dst)
 static
 int genOr(uint8_t* buf, Operand* src, Operand* dst)
 {
+    // if src is imm, try to reduce width
+    src = reduceImm64to32(src);
+    src = reduceImm32to8(src);
+
     switch(src->type) {
     // src reg
     case OT_Reg32:
@@ -1008,6 +1055,10 @@ int genOr(uint8_t* buf, Operand* src, Operand* dst)
 static
 int genAnd(uint8_t* buf, Operand* src, Operand* dst)
 {
+    // if src is imm, try to reduce width
+    src = reduceImm64to32(src);
+    src = reduceImm32to8(src);
+
     switch(src->type) {
     // src reg
     case OT_Reg32:
@@ -1290,6 +1341,390 @@ int genPassThrough(uint8_t* buf, Instr* instr)
 
 
 
+// space for data used by generated code
+#define DATA_STORAGE_SIZE 65536
+
+// allocate zeroed data for generated code, 0 if not possible
+static
+void* allocData(Rewriter* r, int size, int align)
+{
+    CodeStorage* cs;
+    uint8_t* p;
+
+    if (r->dataStorage == 0)
+        r->dataStorage = initDataStorage(DATA_STORAGE_SIZE);
+    cs = r->dataStorage;
+    if (cs->fullsize - cs->used < size + align) return 0;
+
+    useCodeStorage(cs, (align - cs->used % align) % align);
+    p = useCodeStorage(cs, size);
+    memset(p, 0, size);
+    return p;
+}
+
+// may flags set before instruction <i> of <cbb> be used afterwards?
+static
+bool flagsLiveAt(CBB* cbb, int i)
+{
+    for(; i < cbb->count; i++) {
+        Instr* instr = cbb->instr + i;
+
+        if (instr->ptLen > 0) return true;
+        switch(instr->type) {
+        case IT_MOV:
+        case IT_MOVSX:
+        case IT_LEA:
+        case IT_PUSH:
+        case IT_POP:
+        case IT_CLTQ:
+        case IT_CQTO:
+        case IT_HINT_CALL:
+        case IT_HINT_RET:
+            // flags not touched
+            break;
+        case IT_ADD:
+        case IT_SUB:
+        case IT_CMP:
+        case IT_TEST:
+        case IT_AND:
+        case IT_OR:
+        case IT_XOR:
+            // all status flags overwritten
+            return false;
+        case IT_RET:
+            // flags are not preserved over function calls
+            return false;
+        default:
+            return true;
+        }
+    }
+    return (cbb->endType != IT_RET);
+}
+
+// lea -128(%rsp),%rsp: skip red zone before using the stack
+static
+int genSkipRedZone(uint8_t* buf)
+{
+    buf[0] = 0x48;
+    buf[1] = 0x8D;
+    buf[2] = 0x64;
+    buf[3] = 0x24;
+    buf[4] = 0x80;
+    return 5;
+}
+
+// lea 128(%rsp),%rsp
+static
+int genRestoreRedZone(uint8_t* buf)
+{
+    buf[0] = 0x48;
+    buf[1] = 0x8D;
+    buf[2] = 0xA4;
+    buf[3] = 0x24;
+    *(int32_t*)(buf + 4) = 128;
+    return 8;
+}
+
+// lock incq <counter>, addressed via saved %rax. If flags are live, they
+// are saved on the stack (pushfq/popfq are slow, so only then)
+static
+int genCounterInc(uint8_t* buf, uint64_t* counter, bool saveFlags)
+{
+    int o = 0;
+
+    o += genSkipRedZone(buf);
+    if (saveFlags)
+        buf[o++] = 0x9C; // pushfq
+    buf[o++] = 0x50; // push %rax
+    buf[o++] = 0x48; // movabs $counter,%rax
+    buf[o++] = 0xB8;
+    *(uint64_t*)(buf + o) = (uint64_t) counter;
+    o += 8;
+    buf[o++] = 0xF0; // lock
+    buf[o++] = 0x48;
+    buf[o++] = 0xFF; // inc, digit 0
+    buf[o++] = 0x00; // (%rax)
+    buf[o++] = 0x58; // pop %rax
+    if (saveFlags)
+        buf[o++] = 0x9D; // popfq
+    o += genRestoreRedZone(buf + o);
+    return o;
+}
+
+// value profiling at function entry for tiered rewriting (see ProfiledValue
+// and Rewriter.profRec). Per value: if equal to the last value seen,
+// increment its count, otherwise remember it with count 1. Flags and %r11
+// are free at function entry, and the stack below: the records are
+// addressed via a saved %r10 (not used for parameters)
+static
+int genProfile(uint8_t* buf, Rewriter* r)
+{
+    int o = 0;
+
+    buf[o++] = 0x41; // push %r10
+    buf[o++] = 0x52;
+    buf[o++] = 0x49; // movabs $profRec,%r10
+    buf[o++] = 0xBA;
+    *(uint64_t*)(buf + o) = (uint64_t) r->profRec;
+    o += 8;
+    for(int i = 0; i < r->cc->profiledCount; i++) {
+        ProfiledValue* pv = r->cc->profiled + i;
+        int32_t last = 16 * i;
+        int32_t count = 16 * i + 8;
+        uint8_t rex;
+        int ri;
+
+        if (pv->par < 0) {
+            // movabs $addr,%r11; mov (%r11),%r11 (or %r11d)
+            buf[o++] = 0x49;
+            buf[o++] = 0xBB;
+            *(uint64_t*)(buf + o) = pv->addr;
+            o += 8;
+            buf[o++] = (pv->size == 8) ? 0x4D : 0x45;
+            buf[o++] = 0x8B;
+            buf[o++] = 0x1B;
+            ri = 11;
+        }
+        else if (pv->reg != Reg_None)
+            ri = pv->reg - Reg_AX;
+        else
+            continue;
+
+        // REX.W and REX.B (base %r10), REX.R for r8 - r15
+        rex = 0x49 | ((ri & 8) ? 4 : 0);
+
+        // cmp %reg,last(%r10); jne +9
+        buf[o++] = rex;
+        buf[o++] = 0x39;
+        buf[o++] = 0x82 | ((ri & 7) << 3); // disp32
+        *(int32_t*)(buf + o) = last;
+        o += 4;
+        buf[o++] = 0x75;
+        buf[o++] = 9;
+        // incq count(%r10); jmp +18
+        buf[o++] = 0x49;
+        buf[o++] = 0xFF;
+        buf[o++] = 0x82;
+        *(int32_t*)(buf + o) = count;
+        o += 4;
+        buf[o++] = 0xEB;
+        buf[o++] = 18;
+        // mov %reg,last(%r10); movq $1,count(%r10)
+        buf[o++] = rex;
+        buf[o++] = 0x89;
+        buf[o++] = 0x82 | ((ri & 7) << 3);
+        *(int32_t*)(buf + o) = last;
+        o += 4;
+        buf[o++] = 0x49;
+        buf[o++] = 0xC7;
+        buf[o++] = 0x82;
+        *(int32_t*)(buf + o) = count;
+        o += 4;
+        *(int32_t*)(buf + o) = 1;
+        o += 4;
+    }
+    buf[o++] = 0x41; // pop %r10
+    buf[o++] = 0x5A;
+    return o;
+}
+
+/* Memory access hook (see dbrew_config_memaccess_hook)
+ *
+ * Record in data storage: range start/end, address of memHookEntry, and
+ * hook function. Generated code loads the record address into %rcx,
+ * checks the range inline and on a match calls memHookEntry via the
+ * record, passing the address in %rax and on the stack the access kind:
+ * bit 0 write, bits 1-3 log2 of access size. memHookEntry saves all other
+ * caller-saved registers: this only is done when the hook gets called.
+ */
+enum { MHR_Start = 0, MHR_End, MHR_Entry, MHR_Func, MHR_Size };
+
+void memHookEntry(void);
+__asm__(
+"    .pushsection .text\n"
+"    .type memHookEntry, @function\n"
+"memHookEntry:\n"
+"    push %rbp\n"
+"    mov %rsp, %rbp\n"
+"    push %rcx\n     push %rdx\n     push %rsi\n     push %rdi\n"
+"    push %r8\n      push %r9\n      push %r10\n     push %r11\n"
+"    and $-16, %rsp\n"
+"    sub $256, %rsp\n"
+"    movdqu %xmm0, 0(%rsp)\n     movdqu %xmm1, 16(%rsp)\n"
+"    movdqu %xmm2, 32(%rsp)\n    movdqu %xmm3, 48(%rsp)\n"
+"    movdqu %xmm4, 64(%rsp)\n    movdqu %xmm5, 80(%rsp)\n"
+"    movdqu %xmm6, 96(%rsp)\n    movdqu %xmm7, 112(%rsp)\n"
+"    movdqu %xmm8, 128(%rsp)\n   movdqu %xmm9, 144(%rsp)\n"
+"    movdqu %xmm10, 160(%rsp)\n  movdqu %xmm11, 176(%rsp)\n"
+"    movdqu %xmm12, 192(%rsp)\n  movdqu %xmm13, 208(%rsp)\n"
+"    movdqu %xmm14, 224(%rsp)\n  movdqu %xmm15, 240(%rsp)\n"
+// hook(addr, size, write)
+"    mov %rcx, %r11\n"
+"    mov %rax, %rdi\n"
+"    mov 16(%rbp), %rax\n"
+"    mov %eax, %edx\n"
+"    and $1, %edx\n"
+"    mov %eax, %ecx\n"
+"    shr $1, %ecx\n"
+"    and $7, %ecx\n"
+"    mov $1, %esi\n"
+"    shl %cl, %esi\n"
+"    call *24(%r11)\n"
+"    movdqu 0(%rsp), %xmm0\n     movdqu 16(%rsp), %xmm1\n"
+"    movdqu 32(%rsp), %xmm2\n    movdqu 48(%rsp), %xmm3\n"
+"    movdqu 64(%rsp), %xmm4\n    movdqu 80(%rsp), %xmm5\n"
+"    movdqu 96(%rsp), %xmm6\n    movdqu 112(%rsp), %xmm7\n"
+"    movdqu 128(%rsp), %xmm8\n   movdqu 144(%rsp), %xmm9\n"
+"    movdqu 160(%rsp), %xmm10\n  movdqu 176(%rsp), %xmm11\n"
+"    movdqu 192(%rsp), %xmm12\n  movdqu 208(%rsp), %xmm13\n"
+"    movdqu 224(%rsp), %xmm14\n  movdqu 240(%rsp), %xmm15\n"
+"    lea -64(%rbp), %rsp\n"
+"    pop %r11\n      pop %r10\n      pop %r9\n       pop %r8\n"
+"    pop %rdi\n      pop %rsi\n      pop %rdx\n      pop %rcx\n"
+"    pop %rbp\n"
+// drop access kind pushed by generated code
+"    ret $8\n"
+"    .size memHookEntry, .-memHookEntry\n"
+"    .popsection\n"
+);
+
+// memory operand of <instr> to report to the hook, 0 if none
+static
+Operand* memHookOperand(Instr* instr, bool* isWrite)
+{
+    Operand* o;
+
+    switch(instr->type) {
+    case IT_LEA:
+    case IT_PUSH:
+    case IT_POP:
+    case IT_NOP:
+    case IT_HINT_CALL:
+    case IT_HINT_RET:
+        return 0;
+    default:
+        break;
+    }
+
+    *isWrite = false;
+    if (opIsInd(&(instr->dst))) {
+        o = &(instr->dst);
+        *isWrite = (instr->type != IT_CMP) && (instr->type != IT_TEST);
+    }
+    else if (opIsInd(&(instr->src)))
+        o = &(instr->src);
+    else if ((instr->form == OF_3) && opIsInd(&(instr->src2)))
+        o = &(instr->src2);
+    else
+        return 0;
+
+    // stack and thread-local accesses are not reported. RIP-relative
+    // accesses arrive as absolute addresses (RIP is static on capture),
+    // and are filtered statically by genMemHook
+    if ((o->reg == Reg_SP) || (o->seg != OSO_None))
+        return 0;
+    return o;
+}
+
+// code calling the memory access hook before access via <o>, if needed.
+// With statically known address outside of the range, nothing is generated
+static
+int genMemHook(uint8_t* buf, Rewriter* r, Operand* o, bool isWrite,
+               bool saveFlags)
+{
+    CaptureConfig* cc = r->cc;
+    uint64_t* rec;
+    bool isStatic;
+    int off = 0, kind, logSize, skip1 = 0, skip2 = 0;
+
+    // log2 of access size, passed to memHookEntry
+    switch(opValType(o)) {
+    case VT_8:   logSize = 0; break;
+    case VT_16:  logSize = 1; break;
+    case VT_32:  logSize = 2; break;
+    case VT_64:  logSize = 3; break;
+    case VT_128: logSize = 4; break;
+    case VT_256: logSize = 5; break;
+    default: return 0; // size unknown (e.g. implicit): not reported
+    }
+
+    isStatic = (o->reg == Reg_None) && (o->scale == 0);
+    if (isStatic && ((o->val < cc->memHookStart) ||
+                     (o->val >= cc->memHookEnd)))
+        return 0;
+
+    if (r->memHookRec == 0) {
+        rec = (uint64_t*) allocData(r, 8 * MHR_Size, 8);
+        if (rec == 0) return 0;
+        rec[MHR_Start] = cc->memHookStart;
+        rec[MHR_End] = cc->memHookEnd;
+        rec[MHR_Entry] = (uint64_t) memHookEntry;
+        rec[MHR_Func] = (uint64_t) cc->memHook;
+        r->memHookRec = rec;
+    }
+    rec = r->memHookRec;
+
+    off += genSkipRedZone(buf);
+    if (saveFlags)
+        buf[off++] = 0x9C; // pushfq
+    buf[off++] = 0x50; // push %rax
+    buf[off++] = 0x51; // push %rcx
+    if (isStatic) {
+        // movabs $addr,%rax
+        buf[off++] = 0x48;
+        buf[off++] = 0xB8;
+        *(uint64_t*)(buf + off) = o->val;
+        off += 8;
+    }
+    else {
+        Operand addr;
+
+        // address before loading %rcx: may be used by <o>
+        copyOperand(&addr, o);
+        opOverwriteType(&addr, VT_64);
+        off += genLea(buf + off, &addr, getRegOp(VT_64, Reg_AX));
+    }
+    // movabs $rec,%rcx
+    buf[off++] = 0x48;
+    buf[off++] = 0xB9;
+    *(uint64_t*)(buf + off) = (uint64_t) rec;
+    off += 8;
+    if (!isStatic) {
+        // cmp start(%rcx),%rax; jb skip; cmp end(%rcx),%rax; jae skip
+        buf[off++] = 0x48;
+        buf[off++] = 0x3B;
+        buf[off++] = 0x41;
+        buf[off++] = 8 * MHR_Start;
+        buf[off++] = 0x72;
+        skip1 = off++;
+        buf[off++] = 0x48;
+        buf[off++] = 0x3B;
+        buf[off++] = 0x41;
+        buf[off++] = 8 * MHR_End;
+        buf[off++] = 0x73;
+        skip2 = off++;
+    }
+
+    // push $kind; call *entry(%rcx)
+    kind = (isWrite ? 1 : 0) | (logSize << 1);
+    buf[off++] = 0x6A;
+    buf[off++] = (uint8_t) kind;
+    buf[off++] = 0xFF;
+    buf[off++] = 0x51; // digit 2, disp8
+    buf[off++] = 8 * MHR_Entry;
+
+    if (!isStatic) {
+        buf[skip1] = (uint8_t) (off - (skip1 + 1));
+        buf[skip2] = (uint8_t) (off - (skip2 + 1));
+    }
+    buf[off++] = 0x59; // pop %rcx
+    buf[off++] = 0x58; // pop %rax
+    if (saveFlags)
+        buf[off++] = 0x9D; // popfq
+    off += genRestoreRedZone(buf + off);
+    return off;
+}
+
 // generate code for a captured BB
 void generate(Rewriter* r, CBB* cbb)
 {
@@ -1306,9 +1741,51 @@ void generate(Rewriter* r, CBB* cbb)
 
     usedTotal = 0;
     buf0 = (uint64_t) reserveCodeStorage(r->cs, 0); // remember start address
+
+    // no counter for BBs not captured yet: stub gets replaced
+    cbb->counter = 0;
+    if (r->genCounters && (cbb->endType != IT_None))
+        cbb->counter = (uint64_t*) allocData(r, 8, 8);
+    if (cbb->counter) {
+        bool saveFlags = flagsLiveAt(cbb, 0);
+
+        buf = reserveCodeStorage(r->cs, 40);
+        used = genCounterInc(buf, cbb->counter, saveFlags);
+        if (r->showEmuSteps)
+            printf("  Counter at %p%s\n",
+                   (void*) cbb->counter, saveFlags ? " (saving flags)" : "");
+        useCodeStorage(r->cs, used);
+        usedTotal += used;
+    }
+    // value profiling at entry of first tier (see dbrew_rewrite_tiered)
+    if (r->genProfile && (cbb == r->capBB) && r->cc &&
+        (r->cc->profiledCount > 0)) {
+        if (r->profRec == 0)
+            r->profRec = (uint64_t*) allocData(r, 16 * r->cc->profiledCount, 8);
+        if (r->profRec) {
+            buf = reserveCodeStorage(r->cs, 60 * r->cc->profiledCount + 16);
+            used = genProfile(buf, r);
+            if (r->showEmuSteps)
+                printf("  Value profiling at %p\n", (void*) r->profRec);
+            useCodeStorage(r->cs, used);
+            usedTotal += used;
+        }
+    }
     for(i = 0; i < cbb->count; i++) {
         Instr* instr = cbb->instr + i;
 
+        if (r->cc && r->cc->memHook) {
+            bool isWrite;
+            Operand* o = memHookOperand(instr, &isWrite);
+
+            if (o) {
+                buf = reserveCodeStorage(r->cs, 80);
+                used = genMemHook(buf, r, o, isWrite, flagsLiveAt(cbb, i));
+                useCodeStorage(r->cs, used);
+                usedTotal += used;
+            }
+        }
+
         buf = reserveCodeStorage(r->cs, 15);
 
         if (instr->ptLen > 0) {
@@ -1340,6 +1817,9 @@ void generate(Rewriter* r, CBB* cbb)
             case IT_INC:
                 used = genInc(buf, &(instr->dst));
                 break;
+            case IT_NEG:
+                used = genNeg(buf, &(instr->dst));
+                break;
             case IT_XOR:
                 used = genXor(buf, &(instr->src), &(instr->dst));
                 break;
@@ -1363,7 +1843,8 @@ void generate(Rewriter* r, CBB* cbb)
                 break;
             case IT_MOV:
             case IT_MOVSX: // converting move
-                used = genMov(buf, &(instr->src), &(instr->dst));
+                used = genMov(buf, &(instr->src), &(instr->dst),
+                              flagsLiveAt(cbb, i + 1));
                 break;
             case IT_CMOVO:
             case IT_CMOVNO:
@@ -1392,6 +1873,9 @@ void generate(Rewriter* r, CBB* cbb)
             case IT_RET:
                 used = genRet(buf);
                 break;
+            case IT_JMPI:
+                used = genJmpI(buf, &(instr->dst));
+                break;
             case IT_SUB:
                 used = genSub(buf, &(instr->src), &(instr->dst));
                 break;
@@ -1432,6 +1916,16 @@ void generate(Rewriter* r, CBB* cbb)
         printf(" fall-through to (%s)\n",
                cbb_prettyName(cbb->nextFallThrough));
         }
+        else if ((cbb->endType == IT_JMP) && cbb->nextFallThrough) {
+            printf("  I%2d : %s (%s)\n",
+                   i, instrName(cbb->endType, 0),
+                   cbb_prettyName(cbb->nextFallThrough));
+        }
+        else if (cbb->jtCount > 0) {
+            printf("  I%2d : %s via table (index %%%s, %d entries)\n",
+                   i, instrName(cbb->endType, 0),
+                   regName(cbb->jtIndex, OT_Reg64), cbb->jtCount);
+        }
     }
 
     // add padding space after generated code for jump instruction
@@ -1439,6 +1933,6 @@ void generate(Rewriter* r, CBB* cbb)
 
     cbb->size = usedTotal;
     // start address of generated code.
-    // if CBB had no instruction, this points to the padding buffer
-    cbb->addr1 = (cbb->count == 0) ? ((uint64_t)buf) : cbb->instr[0].addr;
+    // if CBB had no instruction and no counter, this is the padding buffer
+    cbb->addr1 = buf0;
 }
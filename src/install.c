@@ -0,0 +1,459 @@
+/**
+ * This file is part of DBrew, the dynamic binary rewriting library.
+ *
+ * (c) 2015-2016, Josef Weidendorfer <josef.weidendorfer@gmx.de>
+ *
+ * DBrew is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * DBrew is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with DBrew.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Installing rewritten code by patching the entry of the original function.
+ *
+ * Other threads may execute the function while it gets patched. Following
+ * the usual protocol for cross-modifying code on x86, the first byte is
+ * replaced by an int3 breakpoint before the remaining bytes get written,
+ * and finally the first byte of the new instruction is written. Between
+ * the steps, all cores are serialized. Threads hitting the breakpoint in
+ * the meantime get redirected by a SIGTRAP handler.
+ *
+ * This does not cover threads which were preempted with their program
+ * counter inside of the replaced bytes (behind the first instruction):
+ * they resume in the middle of the new jump. Positions of other threads
+ * are not checked, so the caller must ensure this can not happen.
+ */
+
+#define _GNU_SOURCE
+
+#include "dbrew.h"
+
+#include <assert.h>
+#include <linux/membarrier.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "buffers.h"
+#include "common.h"
+#include "decode.h"
+#include "engine.h"
+#include "install.h"
+#include "instr.h"
+
+// code addresses with int3 during patching, and where trapping threads
+// continue. Entries stay valid for late traps, targets get updated.
+// They are released on the next install of the rewriter owning them
+// (for a different address) or when it is freed (see releasePatchSites)
+#define PATCHSITE_MAX 64
+
+typedef struct _PatchSite {
+    uint64_t addr;
+    uint64_t target;
+} PatchSite;
+
+static PatchSite patchSite[PATCHSITE_MAX];
+static pthread_mutex_t patchLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t patchOnce = PTHREAD_ONCE_INIT;
+static struct sigaction oldTrapAction;
+static bool syncCoreAvailable = false;
+
+static
+void trapHandler(int sig, siginfo_t* si, void* ctx)
+{
+    ucontext_t* uc = (ucontext_t*) ctx;
+    // int3 is a trap: RIP points after the breakpoint
+    uint64_t addr = uc->uc_mcontext.gregs[REG_RIP] - 1;
+
+    for(int i = 0; i < PATCHSITE_MAX; i++) {
+        if (__atomic_load_n(&(patchSite[i].addr), __ATOMIC_ACQUIRE) != addr)
+            continue;
+        uc->uc_mcontext.gregs[REG_RIP] =
+            __atomic_load_n(&(patchSite[i].target), __ATOMIC_ACQUIRE);
+        return;
+    }
+
+    // not ours: chain to handler installed before
+    if (oldTrapAction.sa_flags & SA_SIGINFO) {
+        oldTrapAction.sa_sigaction(sig, si, ctx);
+        return;
+    }
+    if ((oldTrapAction.sa_handler != SIG_DFL) &&
+        (oldTrapAction.sa_handler != SIG_IGN)) {
+        oldTrapAction.sa_handler(sig);
+        return;
+    }
+    sigaction(SIGTRAP, &oldTrapAction, 0);
+    raise(SIGTRAP);
+}
+
+static
+void initPatching(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = trapHandler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&(sa.sa_mask));
+    sigaction(SIGTRAP, &sa, &oldTrapAction);
+
+    // serialize instruction fetch of all threads after modifications
+    syncCoreAvailable =
+        (syscall(__NR_membarrier,
+                 MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0) == 0);
+}
+
+static
+void syncCores(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (syncCoreAvailable)
+        syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0);
+}
+
+// remove entry for <addr> set by setPatchSite, if any
+static
+void clearPatchSite(uint64_t addr)
+{
+    if (addr == 0) return;
+
+    pthread_mutex_lock(&patchLock);
+    for(int i = 0; i < PATCHSITE_MAX; i++) {
+        if (patchSite[i].addr != addr) continue;
+        __atomic_store_n(&(patchSite[i].addr), 0, __ATOMIC_RELEASE);
+        break;
+    }
+    pthread_mutex_unlock(&patchLock);
+}
+
+// set target for threads trapping at <addr>, return false if table full
+static
+bool setPatchSite(uint64_t addr, uint64_t target)
+{
+    int i, unused = -1;
+
+    pthread_mutex_lock(&patchLock);
+    for(i = 0; i < PATCHSITE_MAX; i++) {
+        if (patchSite[i].addr == addr) break;
+        if ((unused < 0) && (patchSite[i].addr == 0)) unused = i;
+    }
+    if (i == PATCHSITE_MAX) {
+        if (unused < 0) {
+            pthread_mutex_unlock(&patchLock);
+            return false;
+        }
+        i = unused;
+    }
+    __atomic_store_n(&(patchSite[i].target), target, __ATOMIC_RELEASE);
+    __atomic_store_n(&(patchSite[i].addr), addr, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&patchLock);
+
+    return true;
+}
+
+// protection of the mapping containing <addr> from /proc/self/maps,
+// -1 if not found
+static
+int pageProtection(uint64_t addr)
+{
+    char line[256], perm[5];
+    unsigned long start, end;
+    int prot = -1;
+    FILE* f;
+
+    f = fopen("/proc/self/maps", "r");
+    if (f == 0) return -1;
+    while(fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%lx-%lx %4s", &start, &end, perm) != 3) continue;
+        if ((addr < start) || (addr >= end)) continue;
+        prot = PROT_NONE;
+        if (perm[0] == 'r') prot |= PROT_READ;
+        if (perm[1] == 'w') prot |= PROT_WRITE;
+        if (perm[2] == 'x') prot |= PROT_EXEC;
+        break;
+    }
+    fclose(f);
+    return prot;
+}
+
+// overwrite <len> bytes of code at <addr> with <code> while other threads
+// may execute it. Trapping threads go to the patch site target.
+// With <text>, code is in a read-only text segment (else in code storage):
+// it gets writable temporarily, restoring the protection of each page
+static
+bool patchCode(uint64_t addr, uint8_t* code, int len, bool text)
+{
+    uint8_t* p = (uint8_t*) addr;
+    uint64_t page = addr & ~4095ul;
+    // patch may cross a page boundary
+    int prot[2], pages = (int) ((addr + len - 1 - page) / 4096) + 1;
+
+    if (text) {
+        for(int i = 0; i < pages; i++) {
+            prot[i] = pageProtection(page + 4096 * i);
+            if (prot[i] < 0) return false;
+        }
+        for(int i = 0; i < pages; i++) {
+            if (mprotect((void*) (page + 4096 * i), 4096,
+                         prot[i] | PROT_WRITE | PROT_EXEC) == 0)
+                continue;
+            while(i-- > 0)
+                mprotect((void*) (page + 4096 * i), 4096, prot[i]);
+            return false;
+        }
+    }
+
+    __atomic_store_n(p, 0xCC, __ATOMIC_RELEASE);
+    syncCores();
+    memcpy(p + 1, code + 1, len - 1);
+    syncCores();
+    __atomic_store_n(p, code[0], __ATOMIC_RELEASE);
+    syncCores();
+    __builtin___clear_cache((char*) p, (char*) (p + len));
+
+    if (text) {
+        for(int i = 0; i < pages; i++)
+            mprotect((void*) (page + 4096 * i), 4096, prot[i]);
+    }
+    return true;
+}
+
+// encode a jump at <from> to <to>, return length
+static
+int genJump(uint8_t* buf, uint64_t from, uint64_t to)
+{
+    int64_t diff = (int64_t) (to - (from + 5));
+
+    if ((diff >= -(1l << 31)) && (diff < (1l << 31))) {
+        buf[0] = 0xE9;
+        *(int32_t*)(buf + 1) = (int32_t) diff;
+        return 5;
+    }
+    // jmp *0(%rip), followed by absolute target
+    buf[0] = 0xFF;
+    buf[1] = 0x25;
+    *(int32_t*)(buf + 2) = 0;
+    *(uint64_t*)(buf + 6) = to;
+    return 14;
+}
+
+// limits for decoding the function in jumpsIntoPrologue
+#define SCAN_BBS    500
+#define SCAN_INSTRS 5000
+
+// does any direct branch reachable from <func> jump into the bytes
+// [func+1, func+len) which get replaced? Also true if the function is too
+// large to check. Uses a separate rewriter to keep decoded BBs of <r>
+static
+bool jumpsIntoPrologue(uint64_t func, int len)
+{
+    Rewriter* d = dbrew_new();
+    uint64_t todo[SCAN_BBS];
+    int todoCount = 0, done = 0;
+    bool found = false;
+
+    dbrew_set_decoding_capacity(d, SCAN_INSTRS, SCAN_BBS);
+    todo[todoCount++] = func;
+    while(!found && (done < todoCount)) {
+        DBB* dbb;
+        Instr* last;
+        uint64_t next[2];
+        int nextCount = 0;
+
+        // a BB may need many instructions: keep a margin
+        if (d->decInstrCount > SCAN_INSTRS - SCAN_INSTRS / 5) {
+            found = true;
+            break;
+        }
+        dbb = dbrew_decode(d, todo[done++]);
+        last = dbb->instr + dbb->count - 1;
+
+        if ((last->type == IT_JMP) || (last->type == IT_CALL) ||
+            instrIsJcc(last->type)) {
+            if (last->dst.type == OT_Imm64) {
+                if ((last->dst.val > func) && (last->dst.val < func + len))
+                    found = true;
+                // calls get into other functions
+                if (last->type != IT_CALL)
+                    next[nextCount++] = last->dst.val;
+            }
+        }
+        if ((last->type != IT_JMP) && (last->type != IT_JMPI) &&
+            (last->type != IT_RET) && (last->type != IT_Invalid))
+            next[nextCount++] = dbb->addr + dbb->size;
+
+        for(int i = 0; i < nextCount; i++) {
+            int j;
+            for(j = 0; j < todoCount; j++)
+                if (todo[j] == next[i]) break;
+            if (j < todoCount) continue;
+            if (todoCount == SCAN_BBS) {
+                found = true;
+                break;
+            }
+            todo[todoCount++] = next[i];
+        }
+    }
+    dbrew_free(d);
+
+    return found;
+}
+
+// copy whole instructions covering the first <len> bytes of the original
+// function, followed by a jump to the rest. Return 0 if not relocatable
+static
+uint64_t relocatePrologue(Rewriter* r, int len)
+{
+    DBB* dbb = dbrew_decode(r, r->func);
+    uint8_t* buf;
+    int size = 0;
+
+    for(int i = 0; (i < dbb->count) && (size < len); i++) {
+        Instr* instr = dbb->instr + i;
+
+        // control flow and RIP-relative operands depend on the address
+        switch(instr->type) {
+        case IT_Invalid:
+        case IT_CALL:
+        case IT_RET:
+        case IT_JMP:
+        case IT_JMPI:
+            return 0;
+        default:
+            if (instrIsJcc(instr->type)) return 0;
+            break;
+        }
+        if ((opIsInd(&(instr->dst)) && (instr->dst.reg == Reg_IP)) ||
+            (opIsInd(&(instr->src)) && (instr->src.reg == Reg_IP)) ||
+            (opIsInd(&(instr->src2)) && (instr->src2.reg == Reg_IP)))
+            return 0;
+        size += instr->len;
+    }
+    if (size < len) return 0;
+    // a jump into the replaced bytes would execute part of the patch
+    if (jumpsIntoPrologue(r->func, len)) return 0;
+
+    // a previous prologue copy is retired on uninstall
+    if (r->installStorage == 0)
+        r->installStorage = initCodeStorage(64);
+    r->installStorage->used = 0;
+    buf = useCodeStorage(r->installStorage, size + 14);
+    memcpy(buf, (uint8_t*) r->func, size);
+    genJump(buf + size, (uint64_t) (buf + size), r->func + size);
+
+    return (uint64_t) buf;
+}
+
+/**
+ * Install rewritten code of <r> by patching the entry of the original
+ * function with a jump to it: all callers get the rewritten version.
+ * Guards for expected values (see dbrew_config_expectpar) fall back to
+ * a relocated copy of the original prologue instead.
+ * Other threads may call the function while it gets patched. However,
+ * this is not safe against arbitrary preemption: a thread stopped behind
+ * the first instruction of the entry would resume within the new jump.
+ * Other threads are not checked for this: make sure no thread can be
+ * there, e.g. by installing before the function is called concurrently.
+ * Returns false if the prologue can not be relocated (control flow or
+ * RIP-relative addressing, jumps back into it) or the code can not be made
+ * writable.
+ * Rewriting again with <r> first uninstalls the code. Not supported with
+ * lazy capturing: callers may still run into stubs of uninstalled code.
+ */
+bool dbrew_install(Rewriter* r)
+{
+    uint8_t code[14];
+    uint64_t tramp;
+    int len;
+
+    assert((r->cc == 0) || !r->cc->lazyCapture);
+    dbrew_rewrite_wait(r);
+    if (r->installed) return true;
+    if (r->generatedCodeAddr == 0) return false;
+    // rewriting was not profitable: original function is used as is
+    if (r->generatedCodeAddr == r->func) return false;
+
+    pthread_once(&patchOnce, initPatching);
+
+    len = genJump(code, r->func, r->generatedCodeAddr);
+    tramp = relocatePrologue(r, len);
+    if (tramp == 0) return false;
+
+    // patch sites of a previous install were used long enough ago
+    if (r->patchedFunc != r->func) {
+        clearPatchSite(r->patchedFunc);
+        r->patchedFunc = 0;
+    }
+    if (r->patchedFallback &&
+        ((r->guardFallback == 0) ||
+         (r->patchedFallback != r->guardFallback->addr2))) {
+        clearPatchSite(r->patchedFallback);
+        r->patchedFallback = 0;
+    }
+
+    if (r->guardFallback) {
+        uint8_t fb[14];
+        uint64_t fbAddr = r->guardFallback->addr2;
+
+        // fallback code (move of address, indirect jump) has 10 bytes min
+        if (genJump(fb, fbAddr, tramp) > 10) return false;
+        if (!setPatchSite(fbAddr, tramp)) return false;
+        r->patchedFallback = fbAddr;
+        if (!patchCode(fbAddr, fb, 5, false)) return false;
+    }
+
+    memcpy(r->installOrig, (uint8_t*) r->func, len);
+    if (!setPatchSite(r->func, r->generatedCodeAddr)) return false;
+    r->patchedFunc = r->func;
+    if (!patchCode(r->func, code, len, true)) return false;
+
+    r->installSize = len;
+    r->installed = true;
+    return true;
+}
+
+/**
+ * Restore the original function entry patched by dbrew_install.
+ * Threads may still execute the rewritten code or the relocated prologue:
+ * both are kept unchanged until dbrew_free(), and rewriting again uses
+ * fresh storage.
+ */
+void dbrew_uninstall(Rewriter* r)
+{
+    uint64_t tramp;
+
+    if (!r->installed) return;
+
+    // threads trapping during restore run the relocated prologue
+    tramp = (uint64_t) r->installStorage->buf;
+    setPatchSite(r->func, tramp);
+    patchCode(r->func, r->installOrig, r->installSize, true);
+
+    retireStorage(r, r->installStorage);
+    r->installStorage = 0;
+    retireGenerated(r);
+    r->installed = false;
+}
+
+void releasePatchSites(Rewriter* r)
+{
+    clearPatchSite(r->patchedFunc);
+    clearPatchSite(r->patchedFallback);
+    r->patchedFunc = 0;
+    r->patchedFallback = 0;
+}
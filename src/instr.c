@@ -188,7 +188,7 @@ void setRegOp(Operand* o, ValType t, Reg r)
 
 Operand* getRegOp(ValType t, Reg r)
 {
-    static Operand o;
+    static __thread Operand o;
 
     setRegOp(&o, t, r);
     return &o;
@@ -196,7 +196,7 @@ Operand* getRegOp(ValType t, Reg r)
 
 Operand* getImmOp(ValType t, uint64_t v)
 {
-    static Operand o;
+    static __thread Operand o;
 
     switch(t) {
     case VT_8:
@@ -350,6 +350,8 @@ void copyInstr(Instr* dst, Instr* src)
     dst->type  = src->type;
     dst->vtype = src->vtype;
     dst->form  = src->form;
+    dst->origAddr  = src->origAddr;
+    dst->cfaOffset = src->cfaOffset;
 
     dst->dst.type = OT_None;
     dst->src.type = OT_None;
@@ -393,6 +395,8 @@ void initSimpleInstr(Instr* i, InstrType it)
     i->src2.type = OT_None;
 
     i->info_memAddr = 0;
+    i->origAddr = 0;
+    i->cfaOffset = 0;
 }
 
 void initUnaryInstr(Instr* i, InstrType it, Operand* o)
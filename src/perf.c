@@ -0,0 +1,182 @@
+/**
+ * This file is part of DBrew, the dynamic binary rewriting library.
+ *
+ * (c) 2015-2016, Josef Weidendorfer <josef.weidendorfer@gmx.de>
+ *
+ * DBrew is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * DBrew is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with DBrew.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Making generated code known to the perf profiler.
+ *
+ * With a perf map (/tmp/perf-<pid>.map), perf report resolves symbols of
+ * samples in generated code. A jitdump file (/tmp/jit-<pid>.dump) also
+ * provides the code bytes for perf annotate: it gets recorded by perf via
+ * an executable mapping of the file, and merged with "perf inject --jit".
+ * For correct ordering, use "perf record -k mono".
+ * Every generated CBB becomes a symbol, named by cbb_prettyName.
+ */
+
+#define _GNU_SOURCE
+
+#include "perf.h"
+
+#include <elf.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buffers.h"
+
+// jitdump format, see tools/perf/Documentation/jitdump-specification.txt
+#define JITDUMP_MAGIC   0x4A695444
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD   0
+
+typedef struct _JitHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t totalSize;
+    uint32_t elfMach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+} JitHeader;
+
+// followed by 0-terminated name and code bytes
+typedef struct _JitCodeLoad {
+    uint32_t id;
+    uint32_t totalSize;
+    uint64_t timestamp;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t codeAddr;
+    uint64_t codeSize;
+    uint64_t codeIndex;
+} JitCodeLoad;
+
+// files are per process, shared by all rewriters
+static pthread_mutex_t perfLock = PTHREAD_MUTEX_INITIALIZER;
+static FILE* perfMap = 0;
+static FILE* jitDump = 0;
+static uint64_t jitCodeIndex = 0;
+
+static
+uint64_t perfTimestamp(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+static
+FILE* openPerfMap(void)
+{
+    char name[64];
+
+    sprintf(name, "/tmp/perf-%d.map", getpid());
+    perfMap = fopen(name, "a");
+    if (perfMap)
+        setvbuf(perfMap, 0, _IOLBF, 0);
+    return perfMap;
+}
+
+static
+FILE* openJitDump(void)
+{
+    JitHeader h;
+    char name[64];
+    void* marker;
+
+    sprintf(name, "/tmp/jit-%d.dump", getpid());
+    jitDump = fopen(name, "w+");
+    if (jitDump == 0) return 0;
+
+    h.magic = JITDUMP_MAGIC;
+    h.version = JITDUMP_VERSION;
+    h.totalSize = sizeof(JitHeader);
+    h.elfMach = EM_X86_64;
+    h.pad1 = 0;
+    h.pid = getpid();
+    h.timestamp = perfTimestamp();
+    h.flags = 0;
+    fwrite(&h, sizeof(h), 1, jitDump);
+    fflush(jitDump);
+
+    // perf record detects the file by this executable mapping
+    marker = mmap(0, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC,
+                  MAP_PRIVATE, fileno(jitDump), 0);
+    if (marker == MAP_FAILED) {
+        fclose(jitDump);
+        jitDump = 0;
+    }
+    return jitDump;
+}
+
+static
+void writeJitCodeLoad(const char* name, uint64_t addr, uint64_t size)
+{
+    JitCodeLoad rec;
+    int nameLen = strlen(name) + 1;
+
+    rec.id = JIT_CODE_LOAD;
+    rec.totalSize = sizeof(rec) + nameLen + size;
+    rec.timestamp = perfTimestamp();
+    rec.pid = getpid();
+    rec.tid = syscall(SYS_gettid);
+    rec.vma = addr;
+    rec.codeAddr = addr;
+    rec.codeSize = size;
+    rec.codeIndex = jitCodeIndex++;
+
+    fwrite(&rec, sizeof(rec), 1, jitDump);
+    fwrite(name, nameLen, 1, jitDump);
+    fwrite((void*) addr, size, 1, jitDump);
+}
+
+void perfRegisterCBBs(Rewriter* r, int codeEnd)
+{
+    uint64_t end = (uint64_t) r->cs->buf + codeEnd;
+
+    if (!r->perfMap && !r->perfJitDump) return;
+
+    pthread_mutex_lock(&perfLock);
+    if (r->perfMap && (perfMap == 0)) openPerfMap();
+    if (r->perfJitDump && (jitDump == 0)) openJitDump();
+
+    for(int i = 0; i < r->genOrderCount; i++) {
+        CBB* cbb = r->genOrder[i];
+        uint64_t next = r->genOrder[i+1] ? r->genOrder[i+1]->addr2 : end;
+        char name[120];
+
+        // includes trailing jumps and lazy stubs
+        if (next <= cbb->addr2) continue;
+        snprintf(name, sizeof(name), "dbrew:%s", cbb_prettyName(cbb));
+
+        if (r->perfMap && perfMap)
+            fprintf(perfMap, "%lx %lx %s\n",
+                    cbb->addr2, next - cbb->addr2, name);
+        if (r->perfJitDump && jitDump)
+            writeJitCodeLoad(name, cbb->addr2, next - cbb->addr2);
+    }
+    if (jitDump) fflush(jitDump);
+    pthread_mutex_unlock(&perfLock);
+}
@@ -235,7 +235,7 @@ const char* regName(Reg r, OpType t)
 
 char* prettyAddress(uint64_t a, FunctionConfig* fc)
 {
-    static char buf[100];
+    static __thread char buf[100];
 
     if (fc && fc->name) {
         if (a == fc->func) {
@@ -254,7 +254,7 @@ char* prettyAddress(uint64_t a, FunctionConfig* fc)
 // if <fc> is not-null, use it to print immediates/displacement
 char* op2string(Operand* o, ValType t, FunctionConfig* fc)
 {
-    static char buf[30];
+    static __thread char buf[30];
     int off = 0;
     uint64_t val;
 
@@ -485,11 +485,16 @@ const char* instrName(InstrType it, int* pOpCount)
 
 char* instr2string(Instr* instr, int align, FunctionConfig* fc)
 {
-    static char buf[100];
+    static __thread char buf[100];
     const char* n;
     int oc = 0, off = 0;
 
     n = instrName(instr->type, &oc);
+    // sign extensions: AT&T names depend on type
+    if (instr->type == IT_CLTQ)
+        n = (instr->vtype == VT_32) ? "cwtl" : "cltq";
+    else if (instr->type == IT_CQTO)
+        n = (instr->vtype == VT_64) ? "cltd" : "cqto";
 
     if (align)
         off += sprintf(buf, "%-7s", n);
@@ -526,7 +531,8 @@ char* instr2string(Instr* instr, int align, FunctionConfig* fc)
             typeVisible = true;
     }
     // is type implicitly known via instruction name?
-    if (instr->vtype == VT_Implicit)
+    if ((instr->vtype == VT_Implicit) ||
+        (instr->type == IT_CLTQ) || (instr->type == IT_CQTO))
         typeVisible = true;
 
     if (vt == VT_None) {
@@ -601,7 +607,7 @@ char* instr2string(Instr* instr, int align, FunctionConfig* fc)
 
 char* bytes2string(Instr* instr, int start, int count)
 {
-    static char buf[100];
+    static __thread char buf[100];
     int off = 0, i, j;
     for(i = start, j=0; (i < instr->len) && (j<count); i++, j++) {
         uint8_t b = ((uint8_t*) instr->addr)[i];
@@ -0,0 +1,87 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include -pthread
+//!ccflags = -std=gnu99 -g -O1 -no-pie
+//!nooutput = 1
+
+// asynchronous rewriting while other threads keep calling the stub:
+// code reached via the stub before must stay valid
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "dbrew.h"
+
+#define THREADS 4
+#define ROUNDS 200
+
+typedef long (*f_t)(long);
+
+// two functions with same result, but different code
+long f1(long n)
+{
+    long s = 0;
+    for(long i = 0; i < n; i++)
+        s += i * i;
+    return s;
+}
+
+long f2(long n)
+{
+    long s = 0;
+    while(n > 0) {
+        n--;
+        s += n * n;
+    }
+    return s;
+}
+
+static f_t stub;
+static int stop = 0;
+
+static
+void* caller(void* arg)
+{
+    long errors = 0;
+    long calls = 0;
+
+    (void) arg;
+    while(!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+        long n = 1000 + calls % 100;
+        if (stub(n) != f1(n)) errors++;
+        calls++;
+    }
+    return (void*) errors;
+}
+
+int main(void)
+{
+    pthread_t t[THREADS];
+    long errors = 0;
+    void* res;
+
+    Rewriter* r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) f1);
+    dbrew_config_unroll(r, 2, 0);
+    stub = (f_t) dbrew_rewrite_async(r, 1);
+    dbrew_rewrite_wait(r);
+
+    for(int i = 0; i < THREADS; i++)
+        pthread_create(&t[i], 0, caller, 0);
+
+    for(int round = 0; round < ROUNDS; round++) {
+        // same rewriter and stub, alternating functions
+        dbrew_set_function(r, (uint64_t) ((round & 1) ? f1 : f2));
+        dbrew_config_unroll(r, 2, 0);
+        dbrew_rewrite_async(r, 1);
+        dbrew_rewrite_wait(r);
+    }
+
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    for(int i = 0; i < THREADS; i++) {
+        pthread_join(t[i], &res);
+        errors += (long) res;
+    }
+    printf(">>> %ld errors\n", errors);
+    dbrew_free(r);
+
+    return (errors > 0);
+}
@@ -0,0 +1,44 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include -pthread
+//!ccflags = -std=gnu99 -g -O1 -no-pie
+//!nooutput = 1
+
+// asynchronous rewriting: stub calls original until rewriting is finished
+
+#include <stdio.h>
+
+#include "dbrew.h"
+
+typedef int (*f1_t)(int, int);
+
+int f1(int a, int b)
+{
+    return a * b + 1;
+}
+
+int main(void)
+{
+    int errors = 0;
+
+    Rewriter* r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) f1);
+    dbrew_config_staticpar(r, 1);
+
+    for(int round = 0; round < 3; round++) {
+        // specialize for b = round
+        f1_t stub = (f1_t) dbrew_rewrite_async(r, 1, round);
+
+        // original or rewritten: same result with b = round
+        for(int i = 0; i < 1000; i++)
+            if (stub(i, round) != f1(i, round)) errors++;
+
+        dbrew_rewrite_wait(r);
+
+        // must be rewritten code now: passed b is ignored
+        for(int i = 0; i < 10; i++)
+            if (stub(i, 42) != f1(i, round)) errors++;
+    }
+    printf(">>> %d errors\n", errors);
+    dbrew_free(r);
+
+    return (errors > 0);
+}
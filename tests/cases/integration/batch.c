@@ -0,0 +1,47 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include
+//!ccflags = -std=gnu99 -g -O0 -no-pie
+//!nooutput = 1
+
+// rewrite variants for multiple values of a static parameter at once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dbrew.h"
+
+typedef int (*f1_t)(int, int);
+
+int f1(int a, int b)
+{
+    int s = 0;
+    for(int i = 0; i < b; i++)
+        s += a + i;
+    return s;
+}
+
+int main(void)
+{
+    uint64_t args[8][6] = {{0}};
+    uint64_t* entry;
+    int errors = 0;
+
+    Rewriter* r = dbrew_new();
+    dbrew_set_capture_capacity(r, 5000, 500, 50000);
+    dbrew_set_function(r, (uint64_t) f1);
+    dbrew_config_staticpar(r, 1);
+    for(int b = 0; b < 8; b++)
+        args[b][1] = b;
+    entry = dbrew_rewrite_batch(r, 8, args);
+
+    for(int b = 0; b < 8; b++) {
+        f1_t ff = (f1_t) entry[b];
+        if ((b > 0) && (entry[b] <= entry[b-1])) errors++;
+        for(int a = 0; a < 10; a++)
+            if (ff(a, b) != f1(a, b)) errors++;
+    }
+    free(entry);
+    dbrew_free(r);
+
+    printf(">>> %d errors\n", errors);
+    return (errors > 0);
+}
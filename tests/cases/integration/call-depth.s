@@ -0,0 +1,31 @@
+//!run = {outfile} --run --var 1
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    call 1f
+    ret
+1:
+    call 2f
+    ret
+2:
+    call 3f
+    ret
+3:
+    call 4f
+    ret
+4:
+    call 5f
+    ret
+5:
+    call 6f
+    ret
+6:
+    call 7f
+    ret
+7:
+    call 8f
+    ret
+8:
+    lea 1(%rdi), %eax
+    ret
@@ -0,0 +1,53 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include
+//!ccflags = -std=gnu99 -g -O0 -no-pie
+//!nooutput = 1
+
+// execution counters in generated code: entry BB counts all calls,
+// branch BBs count according to taken paths
+
+#include <stdio.h>
+
+#include "dbrew.h"
+
+typedef int (*f1_t)(int, int);
+
+int f1(int a, int b)
+{
+    if (a > b) return a - b;
+    return b - a;
+}
+
+int main(void)
+{
+    DBrewCounter c[20];
+    uint64_t sum = 0;
+    int n, errors = 0;
+    f1_t ff;
+
+    Rewriter* r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) f1);
+    dbrew_set_counters(r, true);
+    ff = (f1_t) dbrew_rewrite(r, 1, 2);
+
+    for(int i = 0; i < 10; i++)
+        if (ff(i, 5) != f1(i, 5)) errors++;
+
+    n = dbrew_get_counters(r, c, 20);
+    if ((n < 3) || (n > 20)) errors++;
+    else {
+        if ((c[0].addr != (uint64_t) f1) || (c[0].count != 10)) errors++;
+        for(int i = 1; i < n; i++)
+            sum += c[i].count;
+        // each call leaves the entry BB via one of two paths
+        if (sum < 10) errors++;
+    }
+
+    dbrew_reset_counters(r);
+    ff(1, 2);
+    dbrew_get_counters(r, c, 20);
+    if (c[0].count != 1) errors++;
+    dbrew_free(r);
+
+    printf(">>> %d errors\n", errors);
+    return (errors > 0);
+}
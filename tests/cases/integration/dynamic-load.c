@@ -0,0 +1,36 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include
+//!ccflags = -std=c99 -g -O1 -no-pie
+//!nooutput = 1
+
+// loads via dynamic addresses are not done while capturing: the pointer
+// may be invalid on paths not taken at runtime
+
+#include <stdio.h>
+
+#include "dbrew.h"
+
+typedef int (*f1_t)(int*, int);
+
+int f1(int* p, int n)
+{
+    if (n > 0)
+        return p[n] + p[n - 1];
+    return n;
+}
+
+int main(void)
+{
+    int a[4] = { 1, 2, 3, 4 }, errors = 0;
+
+    Rewriter* r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) f1);
+    // unmapped pointer: only used with n <= 0
+    f1_t ff = (f1_t) dbrew_rewrite(r, (int*) 0x1234568, 0);
+    if (ff((int*) 0x1234568, 0) != 0) errors++;
+    if (ff((int*) 0x1234568, -3) != -3) errors++;
+    if (ff(a, 3) != 7) errors++;
+    dbrew_free(r);
+
+    printf(">>> %d errors\n", errors);
+    return (errors > 0);
+}
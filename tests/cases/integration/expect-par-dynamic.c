@@ -0,0 +1,62 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include
+//!ccflags = -std=gnu99 -g -O1 -no-pie
+//!nooutput = 1
+
+// expected values for floating point and stack parameters: no guard,
+// these parameters stay dynamic
+
+#include <stdio.h>
+
+#include "dbrew.h"
+
+typedef double (*f1_t)(double, long, double);
+typedef long (*f2_t)(long, long, long, long, long, long, long, long);
+
+__attribute__((noinline))
+double f1(double x, long n, double y)
+{
+    if (n > 0)
+        return x * y;
+    return x + y;
+}
+
+__attribute__((noinline))
+long f2(long a, long b, long c, long d, long e, long f, long g, long h)
+{
+    long s = a + b + c + d + e + f;
+    for(int i = 0; i < g; i++)
+        s += h;
+    return s;
+}
+
+int main(void)
+{
+    int errors = 0;
+    Rewriter* r;
+
+    // FP parameter x expected, integer parameter n guarded
+    r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) f1);
+    dbrew_set_signature(r, "dld");
+    dbrew_config_expectpar(r, 0, 0);
+    dbrew_config_expectpar(r, 1, 1);
+    f1_t ff1 = (f1_t) dbrew_rewrite(r, 0.0, 1, 2.5);
+    if (ff1(3.0, 1, 2.0) != f1(3.0, 1, 2.0)) errors++;
+    if (ff1(0.0, 1, 2.0) != f1(0.0, 1, 2.0)) errors++;
+    if (ff1(-1.5, 0, 7.0) != f1(-1.5, 0, 7.0)) errors++;
+    dbrew_free(r);
+
+    // stack parameter g expected: loop with dynamic bound gets rolled
+    r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) f2);
+    dbrew_set_signature(r, "llllllll");
+    dbrew_config_unroll(r, 2, 0);
+    dbrew_config_expectpar(r, 6, 3);
+    f2_t ff2 = (f2_t) dbrew_rewrite(r, 1, 2, 3, 4, 5, 6, 3, 100);
+    if (ff2(1, 2, 3, 4, 5, 6, 3, 100) != f2(1, 2, 3, 4, 5, 6, 3, 100)) errors++;
+    if (ff2(6, 5, 4, 3, 2, 1, 9, 9) != f2(6, 5, 4, 3, 2, 1, 9, 9)) errors++;
+    dbrew_free(r);
+
+    printf(">>> %d errors\n", errors);
+    return (errors > 0);
+}
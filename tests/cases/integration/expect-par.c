@@ -0,0 +1,69 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include
+//!ccflags = -std=c99 -g -O2 -no-pie -Wl,--section-start=.fixeddata=0x10000000 -Wl,--section-start=.fixedtext=0x10001000
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "dbrew.h"
+
+typedef int (*f1_t)(int, int);
+
+// fixed addresses: independent from library size, as shown in disassembly
+__attribute__((section(".fixeddata"))) int scale = 3;
+
+__attribute__((section(".fixedtext"))) int f1(int a, int b)
+{
+    int s = b * scale;
+    if (a == 4) return s + 1;
+    return s * a;
+}
+
+// speculate on a == 4 and scale == 3, run with expected and other values
+static
+int runtest(bool fallbackCapture)
+{
+    int res = 0;
+
+    printf(">>> Testcase fallback %s.\n",
+           fallbackCapture ? "captured generic" : "original");
+
+    Rewriter* r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) f1);
+    dbrew_set_signature(r, "ii");
+    dbrew_config_function_setname(r, (uint64_t) f1, "test");
+    dbrew_config_function_setsize(r, (uint64_t) f1, 100);
+    dbrew_config_expectpar(r, 0, 4);
+    dbrew_config_expectmem(r, (uint64_t) &scale, 4, 3);
+    dbrew_config_expectfallback(r, fallbackCapture);
+    f1_t ff = (f1_t) dbrew_rewrite(r, 4, 1);
+
+    Rewriter* r2 = dbrew_new();
+    dbrew_config_function_setname(r2, (uint64_t) ff, "gen");
+    dbrew_config_function_setsize(r2, (uint64_t) ff, 200);
+    dbrew_config_function_setname(r2, (uint64_t) f1, "test");
+    dbrew_decode_print(r2, (uint64_t) ff, dbrew_generated_size(r));
+
+    int a[] = { 4, 5, 0 };
+    for(int i = 0; i < 3; i++) {
+        for(scale = 3; scale < 5; scale++) {
+            int orig = f1(a[i], 7);
+            int rewritten = ff(a[i], 7);
+            printf(">>> Run a = %d, scale = %d: orig/rewritten: %d/%d\n",
+                   a[i], scale, orig, rewritten);
+            if (orig != rewritten) res++;
+        }
+    }
+    scale = 3;
+    dbrew_free(r2);
+    dbrew_free(r);
+
+    return res;
+}
+
+int main(void)
+{
+    int res = runtest(false);
+    res += runtest(true);
+
+    return res;
+}
@@ -0,0 +1,143 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include
+//!ccflags = -std=gnu99 -g -O0 -no-pie
+//!nooutput = 1
+
+// GDB JIT interface: in-memory ELF object registered for rewritten code,
+// with a function symbol at the entry, an .eh_frame FDE covering the code
+// and a .debug_line program for it; unregistered on dbrew_free
+
+#include <elf.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dbrew.h"
+
+// layout as expected by GDB
+typedef struct _JitEntry {
+    struct _JitEntry *next, *prev;
+    const char* symfileAddr;
+    uint64_t symfileSize;
+} JitEntry;
+
+typedef struct {
+    uint32_t version;
+    uint32_t actionFlag;
+    JitEntry* relevantEntry;
+    JitEntry* firstEntry;
+} JitDescriptor;
+
+extern JitDescriptor __jit_debug_descriptor;
+
+int f1(int a, int b)
+{
+    if (a > b) return a - b;
+    return b - a;
+}
+
+static
+int hasSymbol(const char* elf, uint64_t addr, const char* name)
+{
+    Elf64_Ehdr* eh = (Elf64_Ehdr*) elf;
+    Elf64_Shdr* sh = (Elf64_Shdr*) (elf + eh->e_shoff);
+
+    for(int i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type != SHT_SYMTAB) continue;
+        Elf64_Sym* sym = (Elf64_Sym*) (elf + sh[i].sh_offset);
+        const char* str = elf + sh[sh[i].sh_link].sh_offset;
+        int count = sh[i].sh_size / sizeof(Elf64_Sym);
+        for(int j = 0; j < count; j++)
+            if ((sym[j].st_value == addr) &&
+                (strcmp(str + sym[j].st_name, name) == 0))
+                return 1;
+    }
+    return 0;
+}
+
+static
+Elf64_Shdr* findSection(const char* elf, const char* name)
+{
+    Elf64_Ehdr* eh = (Elf64_Ehdr*) elf;
+    Elf64_Shdr* sh = (Elf64_Shdr*) (elf + eh->e_shoff);
+    const char* str = elf + sh[eh->e_shstrndx].sh_offset;
+
+    for(int i = 0; i < eh->e_shnum; i++)
+        if (strcmp(str + sh[i].sh_name, name) == 0)
+            return sh + i;
+    return 0;
+}
+
+// is there an FDE in .eh_frame with [start,start+size) covering <addr>?
+// (pc_begin and pc_range are absolute 8 byte values)
+static
+int hasFDE(const char* elf, uint64_t addr)
+{
+    Elf64_Shdr* sh = findSection(elf, ".eh_frame");
+    uint32_t off = 0, len;
+
+    if (sh == 0) return 0;
+    while(off + 4 <= sh->sh_size) {
+        const char* p = elf + sh->sh_offset + off;
+        memcpy(&len, p, 4);
+        if (len == 0) break; // terminator
+        uint32_t id;
+        memcpy(&id, p + 4, 4);
+        if (id != 0) {
+            uint64_t start, size;
+            memcpy(&start, p + 8, 8);
+            memcpy(&size, p + 16, 8);
+            if ((addr >= start) && (addr < start + size)) return 1;
+        }
+        off += len + 4;
+    }
+    return 0;
+}
+
+// does .debug_line have a line program starting at <addr>?
+static
+int hasLines(const char* elf, uint64_t addr)
+{
+    Elf64_Shdr* sh = findSection(elf, ".debug_line");
+    const char* p;
+    uint32_t hdrLen;
+    uint64_t start;
+
+    if ((sh == 0) || (sh->sh_size < 10)) return 0;
+    p = elf + sh->sh_offset;
+    memcpy(&hdrLen, p + 6, 4);
+    if (10 + hdrLen + 11 > sh->sh_size) return 0;
+    p += 10 + hdrLen;
+    // first opcode: extended DW_LNE_set_address (2) with 8 byte address
+    if ((p[0] != 0) || (p[1] != 9) || (p[2] != 2)) return 0;
+    memcpy(&start, p + 3, 8);
+    return (start == addr);
+}
+
+int main(void)
+{
+    JitEntry* e;
+    uint64_t code;
+    int errors = 0;
+
+    Rewriter* r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) f1);
+    dbrew_config_function_setname(r, (uint64_t) f1, "f1");
+    dbrew_set_gdb_jit(r, true);
+    code = dbrew_rewrite(r, 1, 2);
+
+    e = __jit_debug_descriptor.firstEntry;
+    if ((e == 0) || (e->symfileSize < sizeof(Elf64_Ehdr)) ||
+        (memcmp(e->symfileAddr, ELFMAG, SELFMAG) != 0))
+        errors++;
+    else {
+        if (!hasSymbol(e->symfileAddr, code, "f1|0")) errors++;
+        if (!hasFDE(e->symfileAddr, code)) errors++;
+        if (!hasLines(e->symfileAddr, code)) errors++;
+    }
+    if (((int(*)(int,int)) code)(1, 2) != 1) errors++;
+
+    dbrew_free(r);
+    if (__jit_debug_descriptor.firstEntry != 0) errors++;
+
+    printf(">>> %d errors\n", errors);
+    return (errors > 0);
+}
@@ -0,0 +1,120 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include -pthread
+//!ccflags = -std=gnu99 -g -O0 -no-pie
+//!nooutput = 1
+
+// install rewritten code into the original function, while other threads
+// are calling it. Calls with unexpected parameters use the original code
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "dbrew.h"
+
+int f1(int a, int b)
+{
+    int s = 0;
+    for(int i = 0; i < b; i++)
+        s += a;
+    return s + 1;
+}
+
+// loop jumps back into the bytes replaced by the jump at the entry
+int loopback(int a, int b);
+__asm__(".text\n"
+        "loopback:\n"
+        "    xor %eax, %eax\n"
+        "1:  add %edi, %eax\n"
+        "    dec %esi\n"
+        "    jg 1b\n"
+        "    ret\n");
+
+// is the page containing <addr> writable (see /proc/self/maps)?
+static
+int writable(uint64_t addr)
+{
+    char line[256], perm[5];
+    unsigned long start, end;
+    int w = 0;
+    FILE* f = fopen("/proc/self/maps", "r");
+
+    while(fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%lx-%lx %4s", &start, &end, perm) != 3) continue;
+        if ((addr >= start) && (addr < end)) w = (perm[1] == 'w');
+    }
+    fclose(f);
+    return w;
+}
+
+static volatile int done = 0;
+static volatile int errors = 0;
+
+static
+void* caller(void* arg)
+{
+    int b = (int)(intptr_t) arg;
+
+    while(!done) {
+        for(int a = 0; a < 10; a++)
+            if (f1(a, b) != a * b + 1) errors++;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    pthread_t t[4];
+    Rewriter* r = dbrew_new();
+    uint8_t entry = *(uint8_t*) f1;
+
+    dbrew_set_function(r, (uint64_t) f1);
+    dbrew_config_expectpar(r, 1, 3);
+    dbrew_rewrite(r, 1, 3);
+
+    for(int i = 0; i < 4; i++)
+        pthread_create(&t[i], 0, caller, (void*)(intptr_t) (2 + i % 2));
+    for(int i = 0; i < 200; i++) {
+        if (!dbrew_install(r)) errors++;
+        if (*(uint8_t*) f1 == entry) errors++;
+        dbrew_uninstall(r);
+        if (*(uint8_t*) f1 != entry) errors++;
+    }
+    if (!dbrew_install(r)) errors++;
+    // protection of text segment restored
+    if (writable((uint64_t) f1)) errors++;
+    done = 1;
+    for(int i = 0; i < 4; i++)
+        pthread_join(t[i], 0);
+
+    // installed: expected and unexpected parameter
+    if (f1(5, 3) != 16) errors++;
+    if (f1(5, 4) != 21) errors++;
+    dbrew_free(r);
+    if (f1(5, 4) != 21) errors++;
+
+    // patch sites get recycled: more installs than table entries, each
+    // with fresh code (and fallback) and a new rewriter
+    for(int i = 0; i < 100; i++) {
+        r = dbrew_new();
+        dbrew_set_function(r, (uint64_t) f1);
+        dbrew_config_expectpar(r, 1, 3);
+        dbrew_rewrite(r, 1, 3);
+        for(int j = 0; j < 2; j++) {
+            if (!dbrew_install(r)) errors++;
+            if (f1(5, 4) != 21) errors++;
+            dbrew_rewrite(r, 1, 3);
+        }
+        dbrew_free(r);
+    }
+
+    // can not be installed
+    r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) loopback);
+    dbrew_rewrite(r, 1, 3);
+    if (dbrew_install(r)) errors++;
+    if (loopback(5, 4) != 20) errors++;
+    dbrew_free(r);
+
+    printf(">>> %d errors\n", errors);
+    return (errors > 0);
+}
@@ -0,0 +1,33 @@
+//!ccflags = -std=c99 -g -no-pie
+//!nooutput = 1
+//!run = {outfile} --run --var --check=-1,0,1,2,3,4,-2 0 1 2 5
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    lea r9d, [rdi+1]
+    mov eax, 7
+    cmp r9d, 3
+    ja 1f
+    jmp [8*r9 + .Ltable]
+.Lc0:
+    add eax, 10
+    ret
+.Lc1:
+    add eax, r9d
+    ret
+.Lc2:
+    lea eax, [rax+rdi+20]
+    ret
+.Lc3:
+    mov eax, r9d
+    ret
+1:
+    xor eax, eax
+    ret
+
+    .section .rodata
+    .align 8
+.Ltable:
+    .quad .Lc0, .Lc1, .Lc2, .Lc3
@@ -0,0 +1,33 @@
+//!ccflags = -std=c99 -g -no-pie
+//!nooutput = 1
+//!run = {outfile} --run --var --check=-1,0,1,2,3,4,100,-2,-100 0 1 2 5
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    lea eax, [rdi+1]
+    cmp eax, 3
+    ja 1f
+    mov eax, eax
+    jmp [8*rax + .Ltable]
+.Lc0:
+    mov eax, 10
+    ret
+.Lc1:
+    mov eax, 11
+    ret
+.Lc2:
+    lea eax, [rdi+20]
+    ret
+.Lc3:
+    mov eax, 13
+    ret
+1:
+    xor eax, eax
+    ret
+
+    .section .rodata
+    .align 8
+.Ltable:
+    .quad .Lc0, .Lc1, .Lc2, .Lc3
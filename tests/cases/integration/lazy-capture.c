@@ -0,0 +1,56 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include
+//!ccflags = -std=gnu99 -g -O0 -no-pie
+//!nooutput = 1
+
+// lazy capturing: paths not taken while rewriting get captured on
+// first execution
+
+#include <stdio.h>
+
+#include "dbrew.h"
+
+typedef int (*f1_t)(int, int);
+
+int f1(int a, int b)
+{
+    int s = 0;
+    if (a > 1) s += 1;
+    if (a > 3) s += 20;
+    if (a > 7) s += 300;
+    if (a > 15) s += 4000;
+    if (a > 31) s += 50000;
+    if (a > 47) s += 600000;
+    return s * b;
+}
+
+int main(void)
+{
+    int errors = 0, size[3];
+    DBrewStats stats;
+
+    // third run: too few CBBs for capturing all paths lazily, stubs
+    // running out of capacity continue in original code
+    for(int run = 0; run < 3; run++) {
+        Rewriter* r = dbrew_new();
+        dbrew_set_capture_capacity(r, 10000, (run < 2) ? 1000 : 24, 50000);
+        dbrew_set_function(r, (uint64_t) f1);
+        dbrew_config_staticpar(r, 1);
+        dbrew_config_lazy(r, run > 0);
+        f1_t ff = (f1_t) dbrew_rewrite(r, 0, 3);
+        size[run] = dbrew_generated_size(r);
+
+        // each value twice: first via stub, then patched
+        for(int i = 0; i < 128; i++) {
+            int a = (i < 64) ? 63 - i : i - 64;
+            if (ff(a, 3) != f1(a, 3)) errors++;
+        }
+        dbrew_get_stats(r, &stats);
+        if ((run == 2) && (stats.fallbacks == 0)) errors++;
+        dbrew_free(r);
+    }
+    // only the path for a = 0 generated up front
+    if (size[1] >= size[0]) errors++;
+    printf(">>> %d errors (sizes %d/%d)\n", errors, size[0], size[1]);
+
+    return (errors > 0);
+}
@@ -0,0 +1,103 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include
+//!ccflags = -std=c99 -g -O1 -no-pie
+//!nooutput = 1
+
+#include <stdio.h>
+
+#include "dbrew.h"
+
+typedef int (*f1_t)(int*, int);
+
+// dynamic bound: without rolling, each iteration gets a separate CBB
+int f1(int* a, int n)
+{
+    int s = 0;
+    for(int i = 0; i < n; i++)
+        s += a[i] * i;
+    return s;
+}
+
+// static bound: without rolling, the loop gets fully unrolled
+int f2(int* a, int n)
+{
+    int s = 0;
+    for(int i = 0; i < n; i++)
+        s += a[i] ^ i;
+    return s;
+}
+
+// the budget applies per loop: the short second loop still gets unrolled
+int f3(int* a, int n)
+{
+    int s = 0;
+    for(int i = 0; i < n; i++)
+        s += a[i] ^ i;
+    for(int i = 0; i < 4; i++)
+        s += a[i] * (i + 1);
+    return s;
+}
+
+static
+int check(const char* name, f1_t f, f1_t ff, int* a, int n)
+{
+    int orig = f(a, n);
+    int rewritten = ff(a, n);
+    printf(">>> Run %s, n = %d: orig/rewritten: %d/%d\n",
+           name, n, orig, rewritten);
+    return (orig != rewritten);
+}
+
+// rolling keeps the number of CBBs, states, and code size bounded
+static
+int checkSize(const char* name, Rewriter* r, int maxCBB, int maxSize)
+{
+    DBrewStats st;
+    int size = dbrew_generated_size(r);
+
+    dbrew_get_stats(r, &st);
+    if ((int) st.cbbCount <= maxCBB && size <= maxSize)
+        return 0;
+    printf(">>> %s not rolled: %d CBBs, %d states, %d bytes\n",
+           name, (int) st.cbbCount, (int) st.esCount, size);
+    return 1;
+}
+
+int main(void)
+{
+    int a[1000], res = 0;
+    int n[] = { 0, 1, 2, 3, 10, 1000 };
+
+    for(int i = 0; i < 1000; i++) a[i] = i % 7;
+
+    // roll after 2 iterations
+    Rewriter* r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) f1);
+    dbrew_config_unroll(r, 2, 0);
+    f1_t ff = (f1_t) dbrew_rewrite(r, a, 10);
+    for(int i = 0; i < 6; i++)
+        res += check("f1", f1, ff, a, n[i]);
+    res += checkSize("f1", r, 12, 200);
+    dbrew_free(r);
+
+    // 1000 iterations exceed the budget (bytes)
+    r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) f2);
+    dbrew_config_staticpar(r, 1);
+    dbrew_config_unroll(r, 1000, 1000);
+    ff = (f1_t) dbrew_rewrite(r, a, 1000);
+    res += check("f2", f2, ff, a, 1000);
+    res += checkSize("f2", r, 8, 1000);
+    dbrew_free(r);
+
+    // only the first loop gets rolled, without extra CBBs for the second
+    r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) f3);
+    dbrew_config_staticpar(r, 1);
+    dbrew_config_unroll(r, 1000, 1000);
+    ff = (f1_t) dbrew_rewrite(r, a, 1000);
+    res += check("f3", f3, ff, a, 1000);
+    res += checkSize("f3", r, 4, 1000);
+    dbrew_free(r);
+
+    return res;
+}
@@ -0,0 +1,85 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include
+//!ccflags = -std=gnu99 -g -O0 -no-pie
+//!nooutput = 1
+
+// memory access hook: accesses into a range get reported, accesses with
+// known address outside of the range generate no code; RIP-relative
+// accesses to globals are checked with their absolute address
+
+#include <stdio.h>
+
+#include "dbrew.h"
+
+typedef long (*f1_t)(long*, int);
+
+long a[10], b[10];
+int reads, writes, errors;
+
+long f1(long* p, int n)
+{
+    long s = 0;
+    for(int i = 0; i < n; i++) {
+        s += p[i];
+        p[i] = i;
+    }
+    return s;
+}
+
+long f2(void)
+{
+    return a[3] + a[8];
+}
+
+static
+void hook(uint64_t addr, int size, bool write)
+{
+    if ((addr < (uint64_t) (a + 2)) || (addr >= (uint64_t) (a + 5)) ||
+        (size != 8))
+        errors++;
+    if (write) writes++;
+    else reads++;
+}
+
+int main(void)
+{
+    Rewriter* r;
+    f1_t ff;
+    int size;
+
+    // unknown address: checked at runtime
+    r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) f1);
+    dbrew_config_unroll(r, 2, 0);
+    dbrew_config_memaccess_hook(r, (uint64_t) (a + 2), 24, hook);
+    ff = (f1_t) dbrew_rewrite(r, a, 10);
+    for(int i = 0; i < 10; i++) a[i] = i + 1;
+    if (ff(a, 10) != 55) errors++;
+    if ((reads != 3) || (writes != 3)) errors++;
+    dbrew_free(r);
+
+    // known addresses outside of range: same code as without hook
+    r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) f1);
+    dbrew_config_staticpar(r, 0);
+    dbrew_config_staticpar(r, 1);
+    dbrew_rewrite(r, b, 3);
+    // compare with a repeated rewrite (first one differs in size)
+    dbrew_rewrite(r, b, 3);
+    size = dbrew_generated_size(r);
+    dbrew_config_memaccess_hook(r, (uint64_t) (a + 2), 24, hook);
+    dbrew_rewrite(r, b, 3);
+    if (dbrew_generated_size(r) != size) errors++;
+    dbrew_free(r);
+
+    // globals: only the access to a[3] is in range
+    reads = writes = 0;
+    r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) f2);
+    dbrew_config_memaccess_hook(r, (uint64_t) (a + 2), 24, hook);
+    if (((long(*)(void)) dbrew_rewrite(r)) () != a[3] + a[8]) errors++;
+    if ((reads != 1) || (writes != 0)) errors++;
+    dbrew_free(r);
+
+    printf(">>> %d errors\n", errors);
+    return (errors > 0);
+}
@@ -0,0 +1,20 @@
+//!run = {outfile} --run 1 1073741824
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    xor eax, eax
+    add eax, edi
+    jo 2f
+    xor eax, eax
+    add eax, 0x80000000
+    jc 1f
+    xor eax, eax
+    ret
+1:
+    mov eax, 1
+    ret
+2:
+    mov eax, 2
+    ret
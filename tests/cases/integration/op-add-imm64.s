@@ -0,0 +1,16 @@
+//!run = {outfile} --run --var --check=0,-1
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    movsxd rax, edi
+    mov rcx, 0x123456789
+    add rax, rcx
+    cmp rax, rcx
+    jz 1f
+    shr rax, 4
+    ret
+1:
+    mov eax, 1
+    ret
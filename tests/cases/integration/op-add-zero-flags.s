@@ -0,0 +1,15 @@
+//!run = {outfile} --run --var --check=0,5
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    cmp edi, edi
+    xor eax, eax
+    add eax, edi
+    jz 1f
+    mov eax, 1
+    ret
+1:
+    mov eax, 2
+    ret
@@ -0,0 +1,14 @@
+//!run = {outfile} --run --var --check=0,5,-1
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    movsxd rax, edi
+    mov rcx, 0x3f0
+    and rax, rcx
+    mov rcx, 3
+    or rax, rcx
+    mov rcx, -0x100
+    xor rax, rcx
+    ret
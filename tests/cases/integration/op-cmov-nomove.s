@@ -0,0 +1,18 @@
+//!run = {outfile} --run --var --check=0,3 1 3
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    mov rax, -1
+    xor ecx, ecx
+    cmp ecx, ecx
+    cmovnz eax, ecx
+    shr rax, 32
+    mov edx, eax
+    mov eax, 5
+    mov ecx, 7
+    cmp edi, 3
+    cmovz eax, ecx
+    add eax, edx
+    ret
@@ -0,0 +1,11 @@
+//!run = {outfile} --run --var --check=0,3,7
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    mov eax, 5
+    mov ecx, edi
+    cmp edi, 3
+    cmovz eax, ecx
+    ret
@@ -0,0 +1,14 @@
+//!run = {outfile} --run 1 1073741824
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    mov eax, edi
+    cdq
+    mov ecx, edx
+    mov rax, 0x4000000000000000
+    cqo
+    or ecx, edx
+    mov eax, ecx
+    ret
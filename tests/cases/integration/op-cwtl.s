@@ -0,0 +1,10 @@
+//!run = {outfile} --run 1 32768
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    mov eax, edi
+    cwde
+    shr rax, 32
+    ret
@@ -0,0 +1,26 @@
+//!run = {outfile} --run 1 0 5
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    xor ecx, ecx
+    cmp ecx, 1
+    mov eax, edi
+    dec eax
+    jz 1f
+    js 2f
+    jnc 3f
+    inc eax
+    jz 1f
+    mov eax, 4
+    ret
+1:
+    mov eax, 1
+    ret
+2:
+    mov eax, 2
+    ret
+3:
+    mov eax, 3
+    ret
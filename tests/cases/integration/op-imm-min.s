@@ -0,0 +1,12 @@
+//!run = {outfile} --run --var --check=0,5
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    movsxd rax, edi
+    mov rcx, -0x80000000
+    add rax, rcx
+    mov ecx, -128
+    add eax, ecx
+    ret
@@ -0,0 +1,18 @@
+//!run = {outfile} --run 2 65536
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    mov eax, edi
+    imul eax, edi
+    jo 1f
+    jc 2f
+    ret
+1:
+    jnc 2f
+    mov eax, 1
+    ret
+2:
+    mov eax, 2
+    ret
@@ -0,0 +1,15 @@
+//!run = {outfile} --run --var --check=0,1,5 5
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    test edi, edi
+    xor ecx, ecx
+    cmp ecx, 1
+    dec edi
+    mov eax, 1
+    ja 1f
+    mov eax, 2
+1:
+    ret
@@ -0,0 +1,19 @@
+//!run = {outfile} --run --var --check=0,1,-1 1
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    mov eax, 0x80000000
+    cmp eax, edi
+    jle 1f
+    xor eax, eax
+    ret
+1:
+    cmp eax, edi
+    jg 2f
+    mov eax, 1
+    ret
+2:
+    mov eax, 2
+    ret
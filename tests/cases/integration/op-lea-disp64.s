@@ -0,0 +1,9 @@
+//!run = {outfile} --run --var --check=0,-1
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    mov rcx, 0x123456789
+    lea rax, [rcx+rdi*2+8]
+    ret
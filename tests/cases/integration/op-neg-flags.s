@@ -0,0 +1,18 @@
+//!run = {outfile} --run 0 1
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    mov eax, edi
+    neg eax
+    jnc 1f
+    js 2f
+    xor eax, eax
+    ret
+1:
+    mov eax, 1
+    ret
+2:
+    mov eax, 2
+    ret
@@ -0,0 +1,9 @@
+//!run = {outfile} --run --var --check=0,1,-5
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    mov eax, edi
+    neg eax
+    ret
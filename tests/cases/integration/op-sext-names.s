@@ -0,0 +1,13 @@
+//!run = {outfile} --run --var --check=-1,1
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    mov eax, edi
+    cwde
+    cdqe
+    cdq
+    cqo
+    mov eax, edx
+    ret
@@ -0,0 +1,17 @@
+//!run = {outfile} --run --var --check=1,-1
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    movsxd rax, edi
+    xor ecx, ecx
+    shl eax, cl
+    shr rax, 32
+    mov rdx, rax
+    movsxd rax, edi
+    mov ecx, 1
+    imul eax, ecx
+    shr rax, 31
+    add rax, rdx
+    ret
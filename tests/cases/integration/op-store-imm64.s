@@ -0,0 +1,19 @@
+//!ccflags = -std=c99 -g -no-pie -Wl,--section-start=.fixeddata=0x10000000
+//!run = {outfile} --run 0 1
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    lea rdx, [rip + buf]
+    movsxd rax, edi
+    mov rcx, 0x123456789
+    mov [rdx + 8*rax], rcx
+    mov rax, [rdx + 8*rax]
+    shr rax, 32
+    ret
+
+    // fixed address: independent from library size, as shown in disassembly
+    .section .fixeddata, "aw"
+buf:
+    .quad 0, 0
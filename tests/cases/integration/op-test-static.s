@@ -0,0 +1,16 @@
+//!run = {outfile} --run --var --check=0,1,2,3
+    .intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    mov ecx, 2
+    test edi, ecx
+    jz 1f
+    mov eax, 1
+    xor ecx, ecx
+    ret
+1:
+    mov eax, 0
+    xor ecx, ecx
+    ret
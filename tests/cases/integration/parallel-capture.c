@@ -0,0 +1,57 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include -pthread
+//!ccflags = -std=gnu99 -g -O0 -no-pie
+//!nooutput = 1
+
+// explore paths of a branchy function with multiple capture workers
+
+#include <stdio.h>
+#include <time.h>
+
+#include "dbrew.h"
+
+typedef int (*f1_t)(int, int);
+
+// each condition doubles the number of paths with different known sums
+int f1(int a, int b)
+{
+    int s = 0;
+    if (a > 1) s += 1;
+    if (a > 3) s += 20;
+    if (a > 7) s += 300;
+    if (a > 15) s += 4000;
+    if (a > 31) s += 50000;
+    if (a > 47) s += 600000;
+    return s * b;
+}
+
+int main(void)
+{
+    int errors = 0;
+    struct timespec t1, t2;
+    DBrewStats st;
+
+    for(int workers = 0; workers < 9; workers += 4) {
+        Rewriter* r = dbrew_new();
+        dbrew_set_capture_capacity(r, 10000, 1000, 50000);
+        dbrew_set_function(r, (uint64_t) f1);
+        dbrew_config_staticpar(r, 1);
+        dbrew_config_parallel(r, workers);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        f1_t ff = (f1_t) dbrew_rewrite(r, 0, 3);
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+
+        // decode time of workers is not subtracted below zero (allow for
+        // inexact calibration of time stamp counter)
+        dbrew_get_stats(r, &st);
+        if (st.captureTime > 2 * ((t2.tv_sec - t1.tv_sec) * 1000000000ul +
+                                  (t2.tv_nsec - t1.tv_nsec)) + 1000000)
+            errors++;
+
+        for(int a = 0; a < 64; a++)
+            if (ff(a, 3) != f1(a, 3)) errors++;
+        dbrew_free(r);
+    }
+    printf(">>> %d errors\n", errors);
+
+    return (errors > 0);
+}
@@ -0,0 +1,58 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include
+//!ccflags = -std=gnu99 -g -O0 -no-pie
+//!nooutput = 1
+
+// perf map and jitdump for generated code: symbol at entry of rewritten
+// code, named after the function
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dbrew.h"
+
+int f1(int a, int b)
+{
+    if (a > b) return a - b;
+    return b - a;
+}
+
+int main(void)
+{
+    char name[64], line[200], sym[100];
+    unsigned long start, size;
+    uint32_t header[10];
+    uint64_t code;
+    int errors = 1;
+    FILE* f;
+
+    Rewriter* r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) f1);
+    dbrew_config_function_setname(r, (uint64_t) f1, "f1");
+    dbrew_set_perf_output(r, true, true);
+    code = dbrew_rewrite(r, 1, 2);
+
+    sprintf(name, "/tmp/perf-%d.map", getpid());
+    f = fopen(name, "r");
+    while(f && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%lx %lx %99s", &start, &size, sym) != 3) continue;
+        if ((start == code) && (size > 0) && (strcmp(sym, "dbrew:f1|0") == 0))
+            errors = 0;
+    }
+    if (f) fclose(f);
+    unlink(name);
+
+    // header with magic and size, followed by code load record
+    sprintf(name, "/tmp/jit-%d.dump", getpid());
+    f = fopen(name, "r");
+    if ((f == 0) || (fread(header, 4, 10, f) != 10) ||
+        (header[0] != 0x4A695444) || (header[2] != 40))
+        errors++;
+    if (f) fclose(f);
+    unlink(name);
+
+    dbrew_free(r);
+
+    printf(">>> %d errors\n", errors);
+    return (errors > 0);
+}
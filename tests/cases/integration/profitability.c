@@ -0,0 +1,61 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include
+//!ccflags = -std=c99 -g -O1 -no-pie
+//!nooutput = 1
+
+// profitability check: fully unrolled loop executes fewer instructions,
+// but exceeds a small code size budget
+
+#include <stdio.h>
+
+#include "dbrew.h"
+
+typedef int (*f1_t)(int*, int);
+
+int f1(int* a, int n)
+{
+    int s = 0;
+    for(int i = 0; i < n; i++)
+        s += a[i] ^ i;
+    return s;
+}
+
+static
+int rewrite(int* a, int budget, DBrewStats* st)
+{
+    Rewriter* r = dbrew_new();
+    f1_t ff;
+    int res = 0;
+
+    dbrew_set_function(r, (uint64_t) f1);
+    dbrew_config_staticpar(r, 1);
+    dbrew_config_profitability(r, true, budget);
+    ff = (f1_t) dbrew_rewrite(r, a, 20);
+    dbrew_get_stats(r, st);
+    printf(">>> Budget %d: instructions %lu (original %lu), %lu bytes, "
+           "fallbacks %lu\n", budget, st->estInstrRewritten,
+           st->estInstrOrig, st->estCodeSize, st->fallbacks);
+    if (ff(a, 20) != f1(a, 20)) res = 1;
+    if ((budget == 0) && (ff == f1)) res = 1;
+    if ((budget > 0) && (ff != f1)) res = 1;
+    dbrew_free(r);
+    return res;
+}
+
+int main(void)
+{
+    DBrewStats st;
+    int a[100], res = 0;
+
+    for(int i = 0; i < 100; i++) a[i] = i % 7;
+
+    // no budget: profitable, unrolled loop is generated
+    res += rewrite(a, 0, &st);
+    if ((st.fallbacks != 0) ||
+        (st.estInstrRewritten >= st.estInstrOrig)) res++;
+
+    // budget smaller than unrolled code: original is returned
+    res += rewrite(a, 200, &st);
+    if ((st.fallbacks != 1) || (st.estCodeSize <= 200)) res++;
+
+    return res;
+}
@@ -0,0 +1,53 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include
+//!ccflags = -std=gnu99 -g -O1 -no-pie
+//!nooutput = 1
+
+// many rewrites with one rewriter: per-rewrite allocations (expressions,
+// saved emulator states) are reused, memory use must not grow
+
+#include <stdio.h>
+#include <sys/resource.h>
+
+#include "dbrew.h"
+
+typedef int (*f1_t)(int*, int);
+
+int f1(int* a, int n)
+{
+    int s = 0;
+    for(int i = 0; i < n; i++)
+        s += a[i] ^ i;
+    return s;
+}
+
+static
+long maxRSS(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss; // in KB
+}
+
+int main(void)
+{
+    int a[10], errors = 0;
+    long rss = 0;
+
+    for(int i = 0; i < 10; i++) a[i] = i % 7;
+
+    Rewriter* r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) f1);
+    dbrew_config_staticpar(r, 1);
+    for(int i = 0; i < 3000; i++) {
+        int n = i % 10;
+        f1_t ff = (f1_t) dbrew_rewrite(r, a, n);
+        if (ff(a, n) != f1(a, n)) errors++;
+        if (i == 500) rss = maxRSS();
+    }
+    printf(">>> %d errors, max RSS growth %ld KB\n", errors, maxRSS() - rss);
+    if (maxRSS() - rss > 1024) errors++;
+    dbrew_free(r);
+
+    return (errors > 0);
+}
@@ -0,0 +1,67 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include
+//!ccflags = -std=gnu99 -g -O1 -no-pie
+//!nooutput = 1
+
+// typed signatures: floating point and stack parameters
+
+#include <stdio.h>
+
+#include "dbrew.h"
+
+typedef double (*f1_t)(double, long, double);
+typedef long (*f2_t)(long, long, long, long, long, long, long, long);
+
+__attribute__((noinline))
+double f1(double x, long n, double y)
+{
+    if (n > 0)
+        return x * y;
+    return x + y;
+}
+
+__attribute__((noinline))
+long f2(long a, long b, long c, long d, long e, long f, long g, long h)
+{
+    long s = a + b + c + d + e + f;
+    for(int i = 0; i < g; i++)
+        s += h;
+    return s;
+}
+
+int main(void)
+{
+    int errors = 0;
+    Rewriter* r;
+
+    // static FP parameter y
+    r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) f1);
+    dbrew_set_signature(r, "dld");
+    dbrew_config_staticpar(r, 2);
+    f1_t ff1 = (f1_t) dbrew_rewrite(r, 1.0, 0, 2.5);
+    if (ff1(3.0, 1, 0.0) != f1(3.0, 1, 2.5)) errors++;
+    if (ff1(-1.5, 2, 7.0) != f1(-1.5, 2, 2.5)) errors++;
+
+    // same with argument array
+    DBrewArg argv[3];
+    argv[0].d = 1.0;
+    argv[1].i = 0;
+    argv[2].d = 0.5;
+    ff1 = (f1_t) dbrew_rewrite_argv(r, argv);
+    if (ff1(3.0, 4, 0.0) != f1(3.0, 4, 0.5)) errors++;
+    dbrew_free(r);
+
+    // static stack parameters g and h: loop gets unrolled
+    r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) f2);
+    dbrew_set_signature(r, "llllllll");
+    dbrew_config_staticpar(r, 6);
+    dbrew_config_staticpar(r, 7);
+    f2_t ff2 = (f2_t) dbrew_rewrite(r, 1, 2, 3, 4, 5, 6, 3, 100);
+    if (ff2(1, 2, 3, 4, 5, 6, 0, 0) != f2(1, 2, 3, 4, 5, 6, 3, 100)) errors++;
+    if (ff2(6, 5, 4, 3, 2, 1, 9, 9) != f2(6, 5, 4, 3, 2, 1, 3, 100)) errors++;
+    dbrew_free(r);
+
+    printf(">>> %d errors\n", errors);
+    return (errors > 0);
+}
@@ -0,0 +1,41 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include
+//!ccflags = -std=c99 -g -O1 -no-pie
+//!nooutput = 1
+
+// recursion with known depth needs an emulated stack larger than default
+
+#include <stdio.h>
+
+#include "dbrew.h"
+
+typedef long (*f1_t)(long*, long);
+
+__attribute__((noinline))
+long sum(long* a, long n)
+{
+    if (n == 0) return 0;
+    return a[n - 1] + sum(a, n - 1);
+}
+
+int main(void)
+{
+    long a[150];
+    int res = 0;
+
+    for(int i = 0; i < 150; i++) a[i] = i;
+
+    Rewriter* r = dbrew_new();
+    // 150 frames of 16 bytes, plus capacity for the unrolled recursion
+    dbrew_set_stack_size(r, 8192);
+    dbrew_set_capture_capacity(r, 5000, 1000, 20000);
+    dbrew_set_function(r, (uint64_t) sum);
+    dbrew_config_staticpar(r, 1);
+    f1_t ff = (f1_t) dbrew_rewrite(r, a, 150);
+
+    for(int i = 0; i < 150; i++) a[i] = 2 * i;
+    if (ff(a, 150) != sum(a, 150)) res = 1;
+    printf(">>> %ld %ld\n", ff(a, 150), sum(a, 150));
+    dbrew_free(r);
+
+    return res;
+}
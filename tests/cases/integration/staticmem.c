@@ -0,0 +1,50 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include
+//!ccflags = -std=gnu99 -g -O1 -no-pie
+//!nooutput = 1
+
+// loads from memory declared read-only are folded at rewrite time:
+// changing the memory afterwards does not influence rewritten code
+
+#include <stdio.h>
+
+#include "dbrew.h"
+
+typedef int (*f1_t)(int, int);
+
+struct {
+    int scale;
+    int offset;
+} cfg = { 3, 10 };
+
+int table[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+
+__attribute__((noinline))
+int f1(int i, int x)
+{
+    return (table[i] * x) * cfg.scale + cfg.offset;
+}
+
+int main(void)
+{
+    int errors = 0, expected[10];
+    Rewriter* r = dbrew_new();
+
+    dbrew_set_function(r, (uint64_t) f1);
+    dbrew_config_staticpar(r, 0);
+    dbrew_config_staticmem(r, (uint64_t) &cfg.offset, sizeof(int));
+    dbrew_config_staticmem(r, (uint64_t) table, sizeof(table));
+    dbrew_config_staticmem(r, (uint64_t) &cfg.scale, sizeof(int));
+    f1_t ff = (f1_t) dbrew_rewrite(r, 5, 0);
+
+    for(int x = 0; x < 10; x++)
+        expected[x] = f1(5, x);
+    table[5] = 0;
+    cfg.scale = 0;
+    cfg.offset = 0;
+    for(int x = 0; x < 10; x++)
+        if (ff(5, x) != expected[x]) errors++;
+    dbrew_free(r);
+
+    printf(">>> %d errors\n", errors);
+    return (errors > 0);
+}
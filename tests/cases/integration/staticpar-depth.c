@@ -0,0 +1,78 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include
+//!ccflags = -std=gnu99 -g -O1 -no-pie
+//!nooutput = 1
+
+// decision tree walked via a static parameter: loads beyond the
+// configured indirection depth or byte budget stay dynamic, so changing
+// deep nodes after rewriting influences rewritten code
+
+#include <stdio.h>
+
+#include "dbrew.h"
+
+typedef struct _Node {
+    int threshold;
+    int result;
+    struct _Node *left, *right;
+} Node;
+
+typedef int (*f1_t)(Node*, int);
+
+// full binary tree with 4 levels, leaves with results
+Node node[15];
+
+__attribute__((noinline))
+int eval(Node* n, int x)
+{
+    while(n->left)
+        n = (x < n->threshold) ? n->left : n->right;
+    return n->result;
+}
+
+static
+void initTree(void)
+{
+    for(int i = 0; i < 15; i++) {
+        node[i].threshold = 100 * (i + 1);
+        node[i].result = i;
+        node[i].left = (i < 7) ? &node[2*i + 1] : 0;
+        node[i].right = (i < 7) ? &node[2*i + 2] : 0;
+    }
+}
+
+static
+int check(f1_t ff)
+{
+    int errors = 0;
+
+    // leaves are below the limits: changes have to be visible
+    for(int i = 7; i < 15; i++)
+        node[i].result = 20 + i;
+    for(int x = 0; x < 2000; x += 50)
+        if (ff(node, x) != eval(node, x)) errors++;
+    return errors;
+}
+
+int main(void)
+{
+    int errors = 0;
+    Rewriter* r;
+
+    initTree();
+    r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) eval);
+    dbrew_config_staticpar_depth(r, 0, 2);
+    errors += check((f1_t) dbrew_rewrite(r, node, 0));
+    dbrew_free(r);
+
+    initTree();
+    r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) eval);
+    dbrew_config_staticpar(r, 0);
+    dbrew_config_staticbudget(r, 32);
+    errors += check((f1_t) dbrew_rewrite(r, node, 0));
+    dbrew_free(r);
+
+    printf(">>> %d errors\n", errors);
+    return (errors > 0);
+}
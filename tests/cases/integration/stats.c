@@ -0,0 +1,51 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include
+//!ccflags = -std=gnu99 -g -O0 -no-pie
+//!nooutput = 1
+
+// statistics of rewriting: consistency of counters over two rewrites
+
+#include <stdio.h>
+
+#include "dbrew.h"
+
+int f1(int a, int b)
+{
+    if (a > b) return a - b;
+    return b - a;
+}
+
+int main(void)
+{
+    DBrewStats s1, s2;
+    int errors = 0;
+    Rewriter* r = dbrew_new();
+
+    dbrew_set_function(r, (uint64_t) f1);
+    dbrew_rewrite(r, 1, 2);
+    dbrew_get_stats(r, &s1);
+
+    if ((s1.dbbCount == 0) || (s1.cbbCount == 0) || (s1.esCount == 0))
+        errors++;
+    if ((s1.instrDecoded == 0) || (s1.instrEmulated == 0) ||
+        (s1.instrCaptured == 0) || (s1.instrGenerated == 0))
+        errors++;
+    if (s1.bytesGenerated < (uint64_t) dbrew_generated_size(r)) errors++;
+    if (s1.esCompares < s1.esHits) errors++;
+    if (s1.captureTime == 0) errors++;
+
+    // second rewrite reuses decoded BBs
+    dbrew_rewrite(r, 1, 2);
+    dbrew_get_stats(r, &s2);
+    if (s2.dbbCount != s1.dbbCount) errors++;
+    if (s2.dbbHits <= s1.dbbHits) errors++;
+    if (s2.cbbCount != 2 * s1.cbbCount) errors++;
+    if (s2.bytesGenerated != 2 * s1.bytesGenerated) errors++;
+
+    dbrew_reset_stats(r);
+    dbrew_get_stats(r, &s1);
+    if ((s1.dbbCount != 0) || (s1.decodeTime != 0)) errors++;
+    dbrew_free(r);
+
+    printf(">>> %d errors\n", errors);
+    return (errors > 0);
+}
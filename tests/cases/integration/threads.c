@@ -0,0 +1,93 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include -pthread
+//!ccflags = -std=gnu99 -g -O0 -no-pie
+//!nooutput = 1
+
+// stress test: specialize different kernels on 16 threads at once
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "dbrew.h"
+
+#define THREADS 16
+#define ROUNDS 20
+
+typedef int (*kernel_t)(int, int);
+
+int k_add(int a, int b)
+{
+    return a + 3 * b;
+}
+
+int k_mul(int a, int b)
+{
+    return a * b - b;
+}
+
+int k_cond(int a, int b)
+{
+    if (b > 5) return a - b;
+    return a ^ b;
+}
+
+int k_loop(int a, int b)
+{
+    int s = a;
+    for(int i = 0; i < b; i++)
+        s += i * a;
+    return s;
+}
+
+// k_loop last: only rewritten with known loop bound
+static kernel_t kernels[] = { k_add, k_mul, k_cond, k_loop };
+
+static
+void* worker(void* arg)
+{
+    long id = (long) arg;
+    long errors = 0;
+
+    for(int round = 0; round < ROUNDS; round++) {
+        int b = (int) id + round % 3;
+        kernel_t k, kk;
+        Rewriter* r = 0;
+
+        if (round % 2) {
+            k = kernels[(id + round) % 4];
+            // explicit rewriter, second parameter fixed
+            r = dbrew_new();
+            dbrew_set_function(r, (uint64_t) k);
+            dbrew_config_staticpar(r, 1);
+            kk = (kernel_t) dbrew_rewrite(r, 1, b);
+        }
+        else {
+            // default rewriter of this thread, nothing fixed
+            k = kernels[(id + round) % 3];
+            kk = (kernel_t) dbrew_rewrite_func((uint64_t) k, 1, b);
+        }
+
+        for(int a = -2; a < 3; a++)
+            if (k(a, b) != kk(a, b)) errors++;
+
+        if (r)
+            dbrew_free(r);
+    }
+    return (void*) errors;
+}
+
+int main(void)
+{
+    pthread_t t[THREADS];
+    long errors = 0;
+
+    for(long i = 0; i < THREADS; i++)
+        pthread_create(&t[i], 0, worker, (void*) i);
+    for(int i = 0; i < THREADS; i++) {
+        void* res;
+        pthread_join(t[i], &res);
+        errors += (long) res;
+    }
+    printf(">>> %ld errors\n", errors);
+
+    return (errors > 0);
+}
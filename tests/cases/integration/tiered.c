@@ -0,0 +1,61 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} ../libdbrew.a -I../include -pthread
+//!ccflags = -std=gnu99 -g -O1 -no-pie
+//!nooutput = 1
+
+// tiered rewriting: after enough calls with same value for parameter <n>,
+// stub switches to code specialized for it, with fallback for other values
+
+#include <stdio.h>
+#include <time.h>
+
+#include "dbrew.h"
+
+typedef int (*f1_t)(int*, int);
+
+int f1(int* a, int n)
+{
+    // counting down from <n>: loop only unrolled if <n> is known
+    int s = 0;
+    for(int i = n; i > 0; i--)
+        s += a[i - 1] ^ i;
+    return s;
+}
+
+int main(void)
+{
+    struct timespec ts = { 0, 1000000 };
+    int a[20], errors = 0, i;
+
+    for(i = 0; i < 20; i++) a[i] = i % 5;
+
+    Rewriter* r = dbrew_new();
+    dbrew_set_function(r, (uint64_t) f1);
+    dbrew_config_profilepar(r, 1);
+    f1_t stub = (f1_t) dbrew_rewrite_tiered(r, 100, a, 10);
+
+    // first tier: values of n change, no promotion yet
+    for(i = 0; i < 50; i++)
+        if (stub(a, i % 20) != f1(a, i % 20)) errors++;
+
+    // n stable: wait up to 5 seconds for promotion
+    for(i = 0; i < 5000 && !dbrew_rewrite_promoted(r); i++) {
+        if (stub(a, 10) != f1(a, 10)) errors++;
+        nanosleep(&ts, 0);
+    }
+    if (!dbrew_rewrite_promoted(r)) errors++;
+
+    // second tier: specialized for n = 10, fallback for other values
+    for(i = 0; i < 20; i++)
+        if (stub(a, i) != f1(a, i)) errors++;
+    if (stub(a, 10) != f1(a, 10)) errors++;
+
+    // rewrite again: same stub, first tier in fresh storage
+    if ((f1_t) dbrew_rewrite_tiered(r, 100, a, 10) != stub) errors++;
+    for(i = 0; i < 20; i++)
+        if (stub(a, i) != f1(a, i)) errors++;
+
+    printf(">>> %d errors\n", errors);
+    dbrew_free(r);
+
+    return (errors > 0);
+}
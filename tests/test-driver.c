@@ -10,6 +10,11 @@
 typedef int (*f1_t)(int);
 int f1(int);
 
+// values to run the version with variable parameter with (--check=...)
+#define MAXCHECK 32
+static int checkCount = 0;
+static int checkValue[MAXCHECK];
+
 int runtest(Rewriter*r, int parameter, bool doRun)
 {
     f1_t ff;
@@ -36,6 +41,20 @@ int runtest(Rewriter*r, int parameter, bool doRun)
 
     if (!doRun) return 0;
 
+    // variable parameter: check with all given values
+    if ((parameter < 0) && (checkCount > 0)) {
+        int res = 0;
+        for(int i = 0; i < checkCount; i++) {
+            int orig = f1(checkValue[i]);
+            int rewritten = ff(checkValue[i]);
+
+            printf(">>> Run %d orig/rewritten: %d/%d\n",
+                   checkValue[i], orig, rewritten);
+            if (orig != rewritten) res = 1;
+        }
+        return res;
+    }
+
     // Ensure that the program actually works.
     int orig = f1(parameter);
     int rewritten = ff(parameter);
@@ -44,6 +63,17 @@ int runtest(Rewriter*r, int parameter, bool doRun)
     return (orig != rewritten) ? 1 : 0;
 }
 
+// parse comma-separated list of values for --check=
+static
+void parseCheck(char* s)
+{
+    while(*s && (checkCount < MAXCHECK)) {
+        checkValue[checkCount++] = (int) strtol(s, &s, 0);
+        if (*s == ',') s++;
+        else break;
+    }
+}
+
 int main(int argc, char** argv)
 {
     int parameter;
@@ -56,6 +86,7 @@ int main(int argc, char** argv)
         if (strcmp(argv[arg], "--debug")==0) debug = true;
         if (strcmp(argv[arg], "--run")==0) run = true;
         if (strcmp(argv[arg], "--var")==0) var = true;
+        if (strncmp(argv[arg], "--check=", 8)==0) parseCheck(argv[arg] + 8);
         arg++;
     }
 